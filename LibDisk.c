@@ -1,22 +1,272 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "LibDisk.h"
 
-typedef struct sector {
-  char data[SECTOR_SIZE];
-} sector_t;
-
 // used to see what happened w/ disk ops
-int diskErrno; 
+__thread int diskErrno; 
+
+// the disk in memory (static makes it private to the file), and its
+// geometry; Disk_Init() makes a disk of the geometry last set by
+// Disk_SetGeometry(), while Disk_Load() gives the disk the size of the
+// image file
+static char* disk;
+static int sector_size = SECTOR_SIZE;
+static int total_sectors = TOTAL_SECTORS;
+static int new_sector_size = SECTOR_SIZE;
+static int new_total_sectors = TOTAL_SECTORS;
+
+// the backend in use; with DISK_MMAP, 'disk' is either an anonymous
+// mapping (before any file is loaded or saved) or a shared mapping of
+// the file named 'mapped_file'
+static int disk_mode = DISK_MEMORY;
+static char mapped_file[1024];
+
+#define DISK_BYTES ((size_t)total_sectors*sector_size)
+#define SECTOR(s) (disk+(size_t)(s)*sector_size)
+
+// 'image_file' is the file last loaded or saved; it only differs from
+// the disk in the sectors marked in 'dirty_map', so saving to it again
+// writes just those (with DISK_MMAP it's the mapped file, and the dirty
+// sectors are the pages that still need an msync)
+static char image_file[1024];
+static unsigned char* dirty_map;
+#define DIRTY_MAP_BYTES ((size_t)(total_sectors+7)/8)
+static int sync_flags;
+static Disk_Stats_t stats;
+
+// with DISK_LAZY, the image file is kept open (as 'lazy_fd') after
+// Disk_Load(), and each sector is read from it the first time it's
+// accessed; 'resident_map' has a bit set for each sector read (or
+// written) since, and 'page_lock' makes sure a sector is only read
+// once; when 'lazy_fd' is -1, every sector is in memory
+static int lazy_fd = -1;
+static unsigned char* resident_map;
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mark_dirty(int sector, int count)
+{
+  // sectors sharing a byte of the map may be written concurrently
+  for(int i = sector; i < sector+count; i++)
+    __atomic_fetch_or(&dirty_map[i/8], 0x80>>(i%8), __ATOMIC_RELAXED);
+}
+
+static void clear_dirty(int sector, int count)
+{
+  for(int i = sector; i < sector+count; i++)
+    __atomic_fetch_and(&dirty_map[i/8], ~(0x80>>(i%8)), __ATOMIC_RELAXED);
+}
+
+static int is_dirty(int sector)
+{
+  return dirty_map[sector/8] & (0x80>>(sector%8));
+}
+
+// the disk now matches 'file' (or, with NULL, no file at all)
+static void set_image_file(char* file)
+{
+  if(dirty_map) memset(dirty_map, 0, DIRTY_MAP_BYTES);
+  if(file == NULL) image_file[0] = '\0';
+  else {
+    strncpy(image_file, file, sizeof(image_file)-1);
+    image_file[sizeof(image_file)-1] = '\0';
+  }
+}
+
+// the next run of dirty sectors at or after *sector; returns its length
+// (0 if there is none) and leaves its first sector in *sector
+static int next_dirty_run(int* sector)
+{
+  int i = *sector;
+  while(i < total_sectors && !is_dirty(i)) {
+    if(!(i%8) && !dirty_map[i/8]) i += 8; // skip clean bytes at once
+    else i++;
+  }
+  if(i > total_sectors) i = total_sectors;
+  int len = 0;
+  while(i+len < total_sectors && is_dirty(i+len)) len++;
+  *sector = i;
+  return len;
+}
+
+static int is_resident(int sector)
+{
+  return __atomic_load_n(&resident_map[sector/8], __ATOMIC_ACQUIRE) & (0x80>>(sector%8));
+}
+
+// read 'len' sectors from 'sector' on from the same place in the file
+static int read_sectors(int fd, int sector, int len)
+{
+  size_t bytes = (size_t)len*sector_size;
+  off_t offset = (off_t)sector*sector_size;
+  char* to = (char*)SECTOR(sector);
+  while(bytes > 0) {
+    ssize_t n = pread(fd, to, bytes, offset);
+    if(n <= 0) {
+      diskErrno = E_READING_FILE;
+      return -1;
+    }
+    to += n; offset += n; bytes -= n;
+  }
+  return 0;
+}
+
+// make sure the sectors from 'sector' on are in memory, reading the
+// ones that aren't from the image file (a run at a time); sectors are
+// paged in before they're written as well, since a snapshot may need
+// their old content
+static int page_in(int sector, int count)
+{
+  if(lazy_fd < 0) return 0;
+  for(int s = sector; s < sector+count; s++) {
+    if(is_resident(s)) continue;
+    pthread_mutex_lock(&page_lock);
+    int len = 0;
+    while(s+len < sector+count && !is_resident(s+len)) len++;
+    if(len > 0 && read_sectors(lazy_fd, s, len) < 0) {
+      pthread_mutex_unlock(&page_lock);
+      return -1;
+    }
+    for(int i = s; i < s+len; i++)
+      __atomic_fetch_or(&resident_map[i/8], 0x80>>(i%8), __ATOMIC_RELEASE);
+    stats.paged_in += len;
+    pthread_mutex_unlock(&page_lock);
+    if(len > 0) s += len-1;
+  }
+  return 0;
+}
+
+// forget the image file being paged in (every sector is in memory by
+// now, or the disk is about to be replaced)
+static void close_lazy()
+{
+  if(lazy_fd < 0) return;
+  close(lazy_fd);
+  lazy_fd = -1;
+}
+
+// the snapshots; 'copies[s]' holds the content sector 's' had when
+// the snapshot was taken, once the disk's own sector has been written
+// since (it's NULL while they're still the same); writes only take
+// 'snapshot_lock' if there's a snapshot at all
+typedef struct {
+  int used;
+  char** copies;
+} snapshot_t;
+
+static snapshot_t snapshots[DISK_SNAPSHOTS];
+static int nsnapshots;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_snapshot(snapshot_t* snap)
+{
+  for(int s = 0; s < total_sectors; s++) free(snap->copies[s]);
+  free(snap->copies);
+  snap->copies = NULL;
+  snap->used = 0;
+  __atomic_store_n(&nsnapshots, nsnapshots-1, __ATOMIC_RELEASE);
+}
 
-// the disk in memory (static makes it private to the file)
-static sector_t* disk;
+// the sectors about to be written keep their current content for the
+// snapshots that still share them
+static int preserve(int sector, int count)
+{
+  if(!__atomic_load_n(&nsnapshots, __ATOMIC_ACQUIRE)) return 0;
+  pthread_mutex_lock(&snapshot_lock);
+  for(int i = 0; i < DISK_SNAPSHOTS; i++) {
+    if(!snapshots[i].used) continue;
+    for(int s = sector; s < sector+count; s++) {
+      if(snapshots[i].copies[s]) continue;
+      char* copy = malloc(sector_size);
+      if(copy == NULL) {
+	pthread_mutex_unlock(&snapshot_lock);
+	diskErrno = E_MEM_OP;
+	return -1;
+      }
+      memcpy(copy, SECTOR(s), sector_size);
+      snapshots[i].copies[s] = copy;
+      stats.cow_copies++;
+    }
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  return 0;
+}
+
+// the number of sectors of an image file of the given size; -1 if it
+// isn't a whole number of sectors
+static int image_sectors(off_t size)
+{
+  if(size <= 0 || size%sector_size || size/sector_size > 0x7fffffff) return -1;
+  return (int)(size/sector_size);
+}
+
+// the map of dirty sectors for a disk of 'count' sectors (all clean)
+static int alloc_dirty_map(int count)
+{
+  unsigned char* map = calloc((count+7)/8, 1);
+  if(map == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  free(dirty_map);
+  dirty_map = map;
+  return 0;
+}
+
+static void release_disk()
+{
+  if(disk == NULL) return;
+  if(disk_mode == DISK_MMAP) munmap(disk, DISK_BYTES);
+  else free(disk);
+  disk = NULL;
+}
+
+// create a disk of 'count' sectors (of 'sector_size' bytes) and fill
+// every sector with zeroes
+static int alloc_disk(int count)
+{
+  if(alloc_dirty_map(count) < 0) return -1;
+  total_sectors = count;
+  if(disk_mode == DISK_MMAP) {
+    disk = mmap(NULL, DISK_BYTES, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(disk == MAP_FAILED) disk = NULL;
+  } else
+    disk = calloc(total_sectors, sector_size);
+  if(disk == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  return 0;
+}
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+// set to 0 to leave out the counting of the sectors transferred
+#ifndef DISKSTATS
+#define DISKSTATS 1
+#endif
+
+// count a transfer of 'count' sectors from 'sector' on; it's a seek
+// unless it starts where the previous one ended ('last_sector'; the
+// transfers may come from several threads at once)
+#if DISKSTATS
+static int last_sector;
+
+static void count_io(long* counter, int sector, int count)
+{
+  __atomic_fetch_add(counter, count, __ATOMIC_RELAXED);
+  int prev = __atomic_exchange_n(&last_sector, sector+count, __ATOMIC_RELAXED);
+  if(prev != sector) {
+    __atomic_fetch_add(&stats.seeks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.seek_distance, abs(sector-prev), __ATOMIC_RELAXED);
+  }
+}
+#else
+#define count_io(counter, sector, count) ((void)0)
+#endif
 
 /*
  * Disk_Init
@@ -28,12 +278,261 @@ static sector_t* disk;
  */
 int Disk_Init()
 {
-  // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
-  if(disk == NULL) {
+  mapped_file[0] = '\0';
+  set_image_file(NULL);
+  Disk_SnapshotRelease(-1);
+  close_lazy();
+
+  // a disk in memory is simply wiped and used again, unless its
+  // geometry changes; a mapped disk is released, since it may be the
+  // mapping of a file
+  if(disk != NULL && disk_mode != DISK_MMAP &&
+     sector_size == new_sector_size && total_sectors == new_total_sectors) {
+    memset(disk, 0, DISK_BYTES);
+    return 0;
+  }
+  release_disk();
+  sector_size = new_sector_size;
+  return alloc_disk(new_total_sectors);
+}
+
+/*
+ * Disk_SetMode
+ *
+ * Chooses the backend (one of Disk_Mode_t); takes effect at the next
+ * Disk_Init().
+ */
+int Disk_SetMode(int mode)
+{
+  if(mode != DISK_MEMORY && mode != DISK_MMAP && mode != DISK_LAZY) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  // the current disk was set up by another backend
+  if(mode != disk_mode) {
+    close_lazy();
+    release_disk();
+  }
+  disk_mode = mode;
+  return 0;
+}
+
+/*
+ * Disk_SetGeometry
+ *
+ * Chooses the sector size (a power of two, from 512 bytes up to
+ * MAX_SECTOR_SIZE) and the number of sectors of the disk; takes
+ * effect at the next Disk_Init().
+ */
+int Disk_SetGeometry(int size, int count)
+{
+  if(size < 512 || size > MAX_SECTOR_SIZE || (size & (size-1)) || count <= 0 ||
+     (size_t)size*count/size != (size_t)count) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  new_sector_size = size;
+  new_total_sectors = count;
+  return 0;
+}
+
+/*
+ * Disk_GetGeometry
+ *
+ * Gives the sector size and the number of sectors of the disk.
+ */
+void Disk_GetGeometry(int* size, int* count)
+{
+  if(size) *size = sector_size;
+  if(count) *count = total_sectors;
+}
+
+/*
+ * Disk_SetSync
+ *
+ * Sets how careful Disk_Save() is (DISK_SYNC_* flags; 0 leaves the
+ * data to the operating system, which is the default).
+ */
+int Disk_SetSync(int flags)
+{
+  if(flags & ~DISK_SYNC_DATA) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  sync_flags = flags;
+  return 0;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies the counters kept by Disk_Save(), Disk_Commit(), the paging
+ * in of DISK_LAZY and the transfers of sectors since the program
+ * started.
+ */
+void Disk_GetStats(Disk_Stats_t* s)
+{
+  if(s) *s = stats;
+}
+
+// replace the disk with a shared mapping of the given file (which
+// must hold a whole number of sectors)
+static int map_file(char* file)
+{
+  int fd = open(file, O_RDWR);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  struct stat st;
+  int count = fstat(fd, &st) < 0 ? -1 : image_sectors(st.st_size);
+  if(count < 0) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+  void* m = mmap(NULL, (size_t)count*sector_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file open
+  if(m == MAP_FAILED) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  if(count != total_sectors && alloc_dirty_map(count) < 0) {
+    munmap(m, (size_t)count*sector_size);
+    return -1;
+  }
+  release_disk();
+  disk = m;
+  total_sectors = count;
+  strncpy(mapped_file, file, sizeof(mapped_file)-1);
+  mapped_file[sizeof(mapped_file)-1] = '\0';
+  set_image_file(file);
+  return 0;
+}
+
+// write the dirty sectors back to the mapped file; msync needs page
+// aligned addresses, so each run is widened to whole pages
+static int save_mapped()
+{
+  long page = sysconf(_SC_PAGESIZE);
+  int flags = (sync_flags & DISK_SYNC_DATA) ? MS_SYNC : MS_ASYNC;
+  for(int sector = 0, len; (len = next_dirty_run(&sector)) > 0; sector += len) {
+    size_t start = (size_t)sector*sector_size;
+    size_t end = start+(size_t)len*sector_size;
+    start -= start%page;
+    if(msync((char*)disk+start, end-start, flags) < 0) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    stats.runs++;
+    stats.bytes_written += (long)len*sector_size;
+  }
+  return 0;
+}
+
+// write 'len' sectors from 'sector' on to the same place in the file
+static int write_sectors(int fd, int sector, int len)
+{
+  size_t bytes = (size_t)len*sector_size;
+  off_t offset = (off_t)sector*sector_size;
+  char* from = (char*)SECTOR(sector);
+  while(bytes > 0) {
+    ssize_t n = pwrite(fd, from, bytes, offset);
+    if(n <= 0) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    from += n; offset += n; bytes -= n;
+    stats.bytes_written += n;
+  }
+  return 0;
+}
+
+// write the dirty sectors to the image file, one pwrite per run; if
+// the file doesn't look like the image anymore, 1 is returned so that
+// the whole disk is written instead
+static int save_dirty(char* file)
+{
+  int fd = open(file, O_WRONLY);
+  if(fd < 0) return 1;
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size != (off_t)DISK_BYTES) {
+    close(fd);
+    return 1;
+  }
+  for(int sector = 0, len; (len = next_dirty_run(&sector)) > 0; sector += len) {
+    if(write_sectors(fd, sector, len) < 0) {
+      close(fd);
+      return -1;
+    }
+    stats.runs++;
+  }
+  if((sync_flags & DISK_SYNC_DATA) && fdatasync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  if(close(fd) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_Commit
+ *
+ * Writes a few sectors through to the image file (the file the disk
+ * was last loaded from or saved to) right away, so that they survive
+ * a crash without waiting for the next Disk_Save(); with
+ * DISK_SYNC_DATA they are on the device when it returns
+ */
+int Disk_Commit(int sector, int count)
+{
+  if (sector < 0 || count < 0 || sector+count > total_sectors) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (!image_file[0]) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  if (count == 0) return 0;
+
+  // a mapped file already has them, they only need to be flushed
+  if (disk_mode == DISK_MMAP && mapped_file[0]) {
+    if (sync_flags & DISK_SYNC_DATA) {
+      long page = sysconf(_SC_PAGESIZE);
+      size_t start = (size_t)sector*sector_size;
+      size_t end = start+(size_t)count*sector_size;
+      start -= start%page;
+      if (msync((char*)disk+start, end-start, MS_SYNC) < 0) {
+	diskErrno = E_WRITING_FILE;
+	return -1;
+      }
+      clear_dirty(sector, count);
+    }
+    stats.commits++;
+    return 0;
+  }
+
+  int fd = open(image_file, O_WRONLY);
+  if (fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  if (write_sectors(fd, sector, count) < 0 ||
+      ((sync_flags & DISK_SYNC_DATA) && fdatasync(fd) < 0)) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  if (close(fd) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  clear_dirty(sector, count);
+  stats.commits++;
   return 0;
 }
 
@@ -52,7 +551,31 @@ int Disk_Save(char* file)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // a mapped file already has every change; just flush the dirty pages
+  if (disk_mode == DISK_MMAP && mapped_file[0] && !strcmp(file, mapped_file)) {
+    if (save_mapped() < 0) return -1;
+    memset(dirty_map, 0, DIRTY_MAP_BYTES);
+    stats.saves++;
+    return 0;
+  }
+
+  // the file we're in sync with only needs the changed sectors
+  if (disk_mode != DISK_MMAP && image_file[0] && !strcmp(file, image_file)) {
+    int r = save_dirty(file);
+    if (r < 0) return -1;
+    if (r == 0) {
+      memset(dirty_map, 0, DIRTY_MAP_BYTES);
+      stats.saves++;
+      return 0;
+    }
+  }
     
+  // the whole image is written, so it must all be in memory (the file
+  // being paged in may well be the one overwritten)
+  if (page_in(0, total_sectors) < 0) return -1;
+  close_lazy();
+
   // open the diskFile
   if ((diskFile = fopen(file, "w")) == NULL) {
     diskErrno = E_OPENING_FILE;
@@ -60,14 +583,70 @@ int Disk_Save(char* file)
   }
     
   // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if ((fwrite(disk, sector_size, total_sectors, diskFile)) != total_sectors) {
+    fclose(diskFile);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  if ((sync_flags & DISK_SYNC_DATA) &&
+      (fflush(diskFile) != 0 || fdatasync(fileno(diskFile)) < 0)) {
     fclose(diskFile);
     diskErrno = E_WRITING_FILE;
     return -1;
   }
     
   // clean up and return
-  fclose(diskFile);
+  if (fclose(diskFile) != 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  stats.saves++;
+  stats.full_saves++;
+  stats.bytes_written += DISK_BYTES;
+
+  // from now on, the file written is the disk (if it isn't mapped yet);
+  // a mapped disk stays in sync with its own file, not this copy
+  if (disk_mode == DISK_MMAP) {
+    if (!mapped_file[0]) return map_file(file);
+    return 0;
+  }
+  set_image_file(file);
+  return 0;
+}
+
+// keep the given image file open to read its sectors on demand; the
+// disk takes its size, but none of its content is read yet
+static int open_lazy(char* file)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  struct stat st;
+  int count = fstat(fd, &st) < 0 ? -1 : image_sectors(st.st_size);
+  if (count < 0) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+  if (count != total_sectors || disk == NULL) {
+    release_disk();
+    if (alloc_disk(count) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  unsigned char* map = calloc((count+7)/8, 1);
+  if (map == NULL) {
+    close(fd);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  free(resident_map);
+  resident_map = map;
+  lazy_fd = fd;
+  set_image_file(file);
   return 0;
 }
 
@@ -86,15 +665,41 @@ int Disk_Load(char* file)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // the snapshots are of the disk being replaced
+  Disk_SnapshotRelease(-1);
+  close_lazy();
+
+  // no copy is needed if the file can be mapped, or if it's paged in
+  if (disk_mode == DISK_MMAP)
+    return map_file(file);
+  if (disk_mode == DISK_LAZY)
+    return open_lazy(file);
     
   // open the diskFile
   if ((diskFile = fopen(file, "r")) == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
+
+  // the disk takes the size of the image
+  struct stat st;
+  int count = fstat(fileno(diskFile), &st) < 0 ? -1 : image_sectors(st.st_size);
+  if (count < 0) {
+    fclose(diskFile);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+  if (count != total_sectors || disk == NULL) {
+    release_disk();
+    if (alloc_disk(count) < 0) {
+      fclose(diskFile);
+      return -1;
+    }
+  }
     
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if ((fread(disk, sector_size, total_sectors, diskFile)) != total_sectors) {
     fclose(diskFile);
     diskErrno = E_READING_FILE;
     return -1;
@@ -102,6 +707,7 @@ int Disk_Load(char* file)
     
   // clean up and return
   fclose(diskFile);
+  set_image_file(file);
   return 0;
 }
 
@@ -114,13 +720,16 @@ int Disk_Load(char* file)
 int Disk_Read(int sector, char* buffer)
 {
   // quick error checks
-  if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+  if ((sector < 0) || (sector >= total_sectors) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
     
+  if(page_in(sector, 1) < 0) return -1;
+  count_io(&stats.reads, sector, 1);
+
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)buffer, (void*)(SECTOR(sector)), sector_size)) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -136,15 +745,304 @@ int Disk_Read(int sector, char* buffer)
 int Disk_Write(int sector, char* buffer) 
 {
   // quick error checks
-  if((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+  if((sector < 0) || (sector >= total_sectors) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
     
+  if(page_in(sector, 1) < 0 || preserve(sector, 1) < 0) return -1;
+  count_io(&stats.writes, sector, 1);
+    
   // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)(SECTOR(sector)), (void*)buffer, sector_size)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  mark_dirty(sector, 1);
+  return 0;
+}
+
+/*
+ * Disk_ReadRange
+ *
+ * Reads 'count' consecutive sectors starting from 'sector' into a
+ * buffer of count sectors' worth of bytes provided by the user.
+ */
+int Disk_ReadRange(int sector, int count, char* buffer)
+{
+  // quick error checks
+  if((sector < 0) || (count < 0) || (sector+count > total_sectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  if(page_in(sector, count) < 0) return -1;
+  count_io(&stats.reads, sector, count);
+
+  // one copy for the whole run
+  memcpy((void*)buffer, (void*)(SECTOR(sector)), count*sector_size);
+  return 0;
+}
+
+/*
+ * Disk_WriteRange
+ *
+ * Writes 'count' consecutive sectors starting from 'sector' from a
+ * buffer of count sectors' worth of bytes to "disk".
+ */
+int Disk_WriteRange(int sector, int count, char* buffer)
+{
+  // quick error checks
+  if((sector < 0) || (count < 0) || (sector+count > total_sectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  if(page_in(sector, count) < 0 || preserve(sector, count) < 0) return -1;
+  count_io(&stats.writes, sector, count);
+
+  // one copy for the whole run
+  memcpy((void*)(SECTOR(sector)), (void*)buffer, count*sector_size);
+  mark_dirty(sector, count);
+  return 0;
+}
+
+// check every element of a scatter/gather list before any transfer
+static int check_iovec(Disk_IOVec_t* iov, int n)
+{
+  if((iov == NULL && n > 0) || n < 0) return -1;
+  for(int i = 0; i < n; i++) {
+    if((iov[i].sector < 0) || (iov[i].sector >= total_sectors) || (iov[i].buffer == NULL))
+      return -1;
+  }
+  return 0;
+}
+
+// the number of elements starting at iov[i] whose sectors as well as
+// buffers are adjacent, so that they can be copied at once
+static int iovec_run(Disk_IOVec_t* iov, int n, int i)
+{
+  int len = 1;
+  while((i+len < n) &&
+	(iov[i+len].sector == iov[i].sector+len) &&
+	(iov[i+len].buffer == iov[i].buffer+len*sector_size))
+    len++;
+  return len;
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Reads a list of sectors, each into its own buffer.
+ */
+int Disk_ReadV(Disk_IOVec_t* iov, int n)
+{
+  if(check_iovec(iov, n) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  for(int i = 0; i < n; ) {
+    int len = iovec_run(iov, n, i);
+    if(page_in(iov[i].sector, len) < 0) return -1;
+    count_io(&stats.reads, iov[i].sector, len);
+    memcpy((void*)iov[i].buffer, (void*)(SECTOR(iov[i].sector)), len*sector_size);
+    i += len;
+  }
+  return 0;
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Writes a list of sectors, each from its own buffer.
+ */
+int Disk_WriteV(Disk_IOVec_t* iov, int n)
+{
+  if(check_iovec(iov, n) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  for(int i = 0; i < n; i++)
+    if(page_in(iov[i].sector, 1) < 0 || preserve(iov[i].sector, 1) < 0) return -1;
+  for(int i = 0; i < n; ) {
+    int len = iovec_run(iov, n, i);
+    memcpy((void*)(SECTOR(iov[i].sector)), (void*)iov[i].buffer, len*sector_size);
+    mark_dirty(iov[i].sector, len);
+    count_io(&stats.writes, iov[i].sector, len);
+    i += len;
+  }
+  return 0;
+}
+
+/*
+ * Disk_Map
+ *
+ * Returns the address of a sector of a mapped disk, so that it can be
+ * read without copying; the content must not be modified through it.
+ */
+const char* Disk_Map(int sector)
+{
+  if((disk_mode != DISK_MMAP) || (sector < 0) || (sector >= total_sectors) || (disk == NULL))
+    return NULL;
+  count_io(&stats.reads, sector, 1);
+  return (const char*)(SECTOR(sector));
+}
+
+/*
+ * Disk_Snapshot
+ *
+ * Takes a snapshot of the disk as it is now; returns its handle, or
+ * -1 if there are too many snapshots already (or no memory).
+ */
+int Disk_Snapshot()
+{
+  if(disk == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  pthread_mutex_lock(&snapshot_lock);
+  int snap = 0;
+  while(snap < DISK_SNAPSHOTS && snapshots[snap].used) snap++;
+  if(snap == DISK_SNAPSHOTS) {
+    pthread_mutex_unlock(&snapshot_lock);
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  // nothing is copied until the disk's sectors are written
+  snapshots[snap].copies = calloc(total_sectors, sizeof(char*));
+  if(snapshots[snap].copies == NULL) {
+    pthread_mutex_unlock(&snapshot_lock);
     diskErrno = E_MEM_OP;
     return -1;
   }
+  snapshots[snap].used = 1;
+  __atomic_store_n(&nsnapshots, nsnapshots+1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&snapshot_lock);
+  return snap;
+}
+
+static int valid_snapshot(int snap)
+{
+  return snap >= 0 && snap < DISK_SNAPSHOTS && snapshots[snap].used;
+}
+
+// copy 'count' sectors of a snapshot from 'sector' on (with the
+// snapshot lock held)
+static int snapshot_copy(snapshot_t* snap, int sector, int count, char* buffer)
+{
+  for(int s = sector; s < sector+count; s++, buffer += sector_size) {
+    if(snap->copies[s]) memcpy(buffer, snap->copies[s], sector_size);
+    else if(page_in(s, 1) < 0) return -1;
+    else memcpy(buffer, SECTOR(s), sector_size);
+  }
+  return 0;
+}
+
+/*
+ * Disk_SnapshotRead
+ *
+ * Reads a single sector as it was when the snapshot was taken.
+ */
+int Disk_SnapshotRead(int snap, int sector, char* buffer)
+{
+  if((sector < 0) || (sector >= total_sectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  pthread_mutex_lock(&snapshot_lock);
+  if(!valid_snapshot(snap)) {
+    pthread_mutex_unlock(&snapshot_lock);
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  int r = snapshot_copy(&snapshots[snap], sector, 1, buffer);
+  pthread_mutex_unlock(&snapshot_lock);
+  return r;
+}
+
+/*
+ * Disk_SnapshotSave
+ *
+ * Writes the whole image of a snapshot to a file; the disk is only
+ * held up for the copy of a batch of sectors at a time.
+ */
+int Disk_SnapshotSave(int snap, char* file)
+{
+  if(file == NULL || !strcmp(file, image_file) || !strcmp(file, mapped_file)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  char* batch = malloc((size_t)64*sector_size);
+  if(batch == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  FILE* snapFile = fopen(file, "w");
+  if(snapFile == NULL) {
+    free(batch);
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  for(int sector = 0; sector < total_sectors; sector += 64) {
+    int count = total_sectors-sector < 64 ? total_sectors-sector : 64;
+    pthread_mutex_lock(&snapshot_lock);
+    if(!valid_snapshot(snap)) { // released meanwhile
+      pthread_mutex_unlock(&snapshot_lock);
+      fclose(snapFile);
+      free(batch);
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+    int r = snapshot_copy(&snapshots[snap], sector, count, batch);
+    pthread_mutex_unlock(&snapshot_lock);
+    if(r < 0) {
+      fclose(snapFile);
+      free(batch);
+      return -1;
+    }
+    if(fwrite(batch, sector_size, count, snapFile) != (size_t)count) {
+      fclose(snapFile);
+      free(batch);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+  }
+  if((sync_flags & DISK_SYNC_DATA) &&
+     (fflush(snapFile) != 0 || fdatasync(fileno(snapFile)) < 0)) {
+    fclose(snapFile);
+    free(batch);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  free(batch);
+  if(fclose(snapFile) != 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_SnapshotRelease
+ *
+ * Drops a snapshot and the sectors copied for it (all snapshots, if
+ * 'snap' is -1).
+ */
+int Disk_SnapshotRelease(int snap)
+{
+  pthread_mutex_lock(&snapshot_lock);
+  if(snap == -1) {
+    for(int i = 0; i < DISK_SNAPSHOTS; i++)
+      if(snapshots[i].used) release_snapshot(&snapshots[i]);
+    pthread_mutex_unlock(&snapshot_lock);
+    return 0;
+  }
+  if(!valid_snapshot(snap)) {
+    pthread_mutex_unlock(&snapshot_lock);
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  release_snapshot(&snapshots[snap]);
+  pthread_mutex_unlock(&snapshot_lock);
   return 0;
 }
@@ -13,9 +13,11 @@
 #ifndef __Disk_H__
 #define __Disk_H__
 
-// a few disk parameters
+// a few disk parameters: the geometry of a disk unless it's set
+// otherwise with Disk_SetGeometry(), and the largest sector size
 #define SECTOR_SIZE 512
 #define TOTAL_SECTORS 10000 
+#define MAX_SECTOR_SIZE 4096
 
 // disk errors
 typedef enum {
@@ -26,12 +28,87 @@ typedef enum {
   E_READING_FILE,
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
 
+// disk backends, chosen with Disk_SetMode() before Disk_Init()
+typedef enum {
+  DISK_MEMORY, // the image is read into memory by Disk_Load() and written back by Disk_Save()
+  DISK_MMAP,   // the image file is mapped into memory by Disk_Load(); Disk_Save() to the
+               // same file only needs to flush the dirty pages
+  DISK_LAZY,   // as DISK_MEMORY, but Disk_Load() keeps the image file open and each sector
+               // is only read from it when first accessed
+} Disk_Mode_t;
+
+// one element of a scatter/gather request: the sector and the buffer
+// (of a sector's size) it's read into or written from
+typedef struct {
+  int sector;
+  char* buffer;
+} Disk_IOVec_t;
+
+// flags for Disk_SetSync()
+#define DISK_SYNC_DATA 1 // Disk_Save() and Disk_Commit() wait for the data to reach the device (fdatasync)
+
+// what Disk_Save() and Disk_Commit() (and the paging in of DISK_LAZY)
+// have done so far, and the sectors transferred by the other calls
+// (counted only if the library is built with DISKSTATS set to 1, the
+// default)
+typedef struct {
+  long saves;          // calls to Disk_Save() that succeeded
+  long full_saves;     // ... of which had to write the whole image
+  long runs;           // runs of consecutive dirty sectors written by the others
+  long bytes_written;  // bytes actually written to image files
+  long commits;        // calls to Disk_Commit() that succeeded
+  long cow_copies;     // sectors copied for snapshots, before their first write since
+  long paged_in;       // sectors read from the image file on first access (DISK_LAZY)
+  long reads;          // sectors read (or mapped with Disk_Map())
+  long writes;         // sectors written
+  long seeks;          // transfers not starting at the sector after the previous one
+  long seek_distance;  // the sectors between where those started and the previous one ended
+} Disk_Stats_t;
+
+int Disk_SetMode(int mode);
+int Disk_SetSync(int flags);
+// the sector size (a power of two, from 512 to MAX_SECTOR_SIZE) and
+// number of sectors of the disk made by the next Disk_Init(); a disk
+// loaded with Disk_Load() gets the size of the image file instead
+int Disk_SetGeometry(int sector_size, int total_sectors);
+void Disk_GetGeometry(int* sector_size, int* total_sectors);
+void Disk_GetStats(Disk_Stats_t* stats);
 int Disk_Init();
+// saving to the file last loaded or saved only writes the sectors
+// changed since then; any other file gets the whole image
 int Disk_Save(char* file);
+// write 'count' sectors from 'sector' on through to the file last
+// loaded or saved, without waiting for the next Disk_Save()
+int Disk_Commit(int sector, int count);
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// multi-sector I/O: 'count' consecutive sectors from/to one buffer,
+// or a list of 'n' (sector, buffer) pairs; either all sectors are
+// transferred or, if any parameter is invalid, none is
+int Disk_ReadRange(int sector, int count, char* buffer);
+int Disk_WriteRange(int sector, int count, char* buffer);
+int Disk_ReadV(Disk_IOVec_t* iov, int n);
+int Disk_WriteV(Disk_IOVec_t* iov, int n);
+
+// copy-on-write snapshots: Disk_Snapshot() freezes the disk as it is
+// now (nothing may be writing to it meanwhile) and returns a handle;
+// the snapshot shares every sector with the disk until the sector is
+// next written, and only then is its old content copied; Disk_Init()
+// and Disk_Load() release all snapshots
+#define DISK_SNAPSHOTS 8
+int Disk_Snapshot();
+int Disk_SnapshotRead(int snap, int sector, char* buffer);
+// write the image of a snapshot to a file (not the one the disk is
+// kept in sync with), while the disk is still being used
+int Disk_SnapshotSave(int snap, char* file);
+int Disk_SnapshotRelease(int snap);
+
+// direct (read-only) access to a sector of a mapped disk, without a
+// copy; NULL if the disk is not mapped or the sector is invalid
+const char* Disk_Map(int sector);
+
 #endif // __Disk_H__
@@ -1,30 +1,83 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "LibDisk.h"
 #include "LibFS.h"
 #include <ctype.h>
-// set to 1 to have detailed debug print-outs and 0 to have none
-#define FSDEBUG 1
+// set to 1 to have detailed debug print-outs and 0 to have none (the
+// print-outs then compile to nothing; FS_GetStats() tells what the
+// file system does at far less cost)
+#ifndef FSDEBUG
+#define FSDEBUG 0
+#endif
 
 #if FSDEBUG
 #define dprintf printf
 #else
-#define dprintf noprintf
-void noprintf(char* str, ...) {}
+#define dprintf(...) do { if(0) printf(__VA_ARGS__); } while(0)
+#endif
+
+// set to 0 to leave out the statistics of FS_GetStats() altogether;
+// STAT() then drops the statement updating a counter
+#ifndef FSSTATS
+#define FSSTATS 1
+#endif
+
+#if FSSTATS
+#define STAT(stmt) stmt
+#else
+#define STAT(stmt) do {} while(0)
 #endif
 
+// the geometry of the file system: the size of a sector, the number
+// of sectors, and the number of inodes; it's chosen when the file
+// system is formatted and recorded in the superblock (an image made
+// before that has the default geometry), and the layout below all
+// follows from it
+static int sector_size = SECTOR_SIZE;
+static int total_sectors = TOTAL_SECTORS;
+static int max_files = MAX_FILES;
+
 // the file system partitions the disk into five parts:
 
 // 1. the superblock (one sector), which contains a magic number at
 // its first four bytes (integer)
 #define SUPERBLOCK_START_SECTOR 0
 
+// the integers of the superblock: the magic number, the format
+// version (#1), and the geometry (zero if it's the default one)
+#define SB_MAGIC 0
+#define SB_VERSION 1
+#define SB_SECTOR_SIZE 2
+#define SB_TOTAL_SECTORS 3
+#define SB_MAX_FILES 4
+#define SB_INTS 5
+
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+// the on-disk format version follows the magic number; images made
+// before it existed have a zero there and use the original format,
+// where each inode lists its data sectors one by one; since version
+// 2, an inode describes its data as extents (runs of sectors), version
+// 3 adds a metadata journal (#6), version 4 compressed files (#7), and
+// version 5 keeps the content of small files in their inodes
+#define FS_VERSION_BLOCKLIST 1
+#define FS_VERSION_EXTENTS 2
+#define FS_VERSION_JOURNAL 3
+#define FS_VERSION_COMPRESSED 4
+#define FS_VERSION_INLINE 5
+#define FS_VERSION_LATEST FS_VERSION_INLINE
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
@@ -32,8 +85,8 @@ void noprintf(char* str, ...) {}
 // the total number of bytes and sectors needed for the inode bitmap;
 // we use one bit for each inode (whether it's a file or directory) to
 // indicate whether the particular inode in the inode table is in use
-#define INODE_BITMAP_SIZE ((MAX_FILES+7)/8)
-#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define INODE_BITMAP_SIZE ((max_files+7)/8)
+#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+sector_size-1)/sector_size)
 
 // 3. the sector bitmap (one or more sectors), which indicates whether
 // the particular sector in the disk is currently in use
@@ -42,8 +95,8 @@ void noprintf(char* str, ...) {}
 // the total number of bytes and sectors needed for the data block
 // bitmap (we call it the sector bitmap); we use one bit for each
 // sector of the disk to indicate whether the sector is in use or not
-#define SECTOR_BITMAP_SIZE ((TOTAL_SECTORS+7)/8)
-#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define SECTOR_BITMAP_SIZE ((total_sectors+7)/8)
+#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+sector_size-1)/sector_size)
 
 // 4. the inode table (one or more sectors), which contains the inodes
 // stored consecutively
@@ -52,12 +105,46 @@ void noprintf(char* str, ...) {}
 // an inode is used to represent each file or directory; the data
 // structure supposedly contains all necessary information about the
 // corresponding file or directory
+typedef struct _extent {
+  int start;  // first sector of the run
+  int length; // number of sectors in the run
+} extent_t;
+
+// the number of extents kept in the inode itself; the rest (if any)
+// are stored in one indirect sector
+#define INODE_EXTENTS 14
+#define EXTENTS_PER_SECTOR (sector_size/sizeof(extent_t))
+#define MAX_EXTENTS (INODE_EXTENTS+EXTENTS_PER_SECTOR)
+
 typedef struct _inode {
   int size; // the size of the file or number of directory entries
-  int type; // 0 means regular file; 1 means directory
-  int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+  int type; // 0 means regular file; 1 means directory; 2 means compressed regular file (#7); 3 means inline file
+  union {
+    // version 1: indices to sectors containing data blocks
+    int data[MAX_SECTORS_PER_FILE];
+    // version 2: the data blocks, in order, as runs of sectors
+    struct {
+      int nextents;  // number of extents in use
+      int indirect;  // sector with the extents after the first INODE_EXTENTS (0 if none)
+      extent_t extent[INODE_EXTENTS];
+    };
+    // version 5: the content of an inline file
+    char bytes[MAX_SECTORS_PER_FILE*sizeof(int)];
+  };
 } inode_t;
 
+// since version 5, a regular file starts as an inline file, whose
+// content is kept in the inode itself as long as it fits; creating,
+// reading, or writing it then needs neither a data sector nor the
+// sector bitmap; the file becomes a regular one with blocks (for good)
+// once it grows larger
+#define INLINE_FILE 3 // the inode type
+#define INLINE_SIZE ((int)sizeof(((inode_t*)0)->bytes))
+
+// both layouts must occupy the same space in the inode table
+_Static_assert(sizeof(inode_t) == (2+MAX_SECTORS_PER_FILE)*sizeof(int),
+	       "inode layouts differ in size");
+
 // the inode structures are stored consecutively and yet they don't
 // straddle accross the sector boundaries; that is, there may be
 // fragmentation towards the end of each sector used by the inode
@@ -65,13 +152,37 @@ typedef struct _inode {
 // are as many entries in the table as the number of files allowed in
 // the system; the inode bitmap (#2) indicates whether the entries are
 // current in use or not
-#define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))
-#define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
+#define INODES_PER_SECTOR (sector_size/sizeof(inode_t))
+#define INODE_TABLE_SECTORS ((max_files+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
 
 // 5. the data blocks; all the rest sectors are reserved for data
 // blocks for the content of files and directories
 #define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
 
+// 6. since version 3, the journal takes the first sectors of the data
+// blocks (they're marked as used in the sector bitmap)
+#define JOURNAL_START_SECTOR DATABLOCK_START_SECTOR
+#define JOURNAL_SECTORS 256
+
+// 7. since version 4, a regular file created while the file system is
+// booted with 'compress_files' set is stored compressed: its content
+// is cut into chunks of CHUNK_BLOCKS blocks' worth of bytes (only the
+// last one may be shorter), and each chunk takes as few blocks as its
+// compressed form needs, after a header; the chunks follow each other
+// in the file's blocks, so the blocks a file can describe hold that
+// much more of its content
+#define COMPRESSED_FILE 2 // the inode type
+#define CHUNK_BLOCKS 8
+#define CHUNK_SIZE (CHUNK_BLOCKS*sector_size)
+
+typedef struct _chunk_header {
+  int size;   // the number of bytes of the file in the chunk
+  int stored; // the number of bytes stored after the header (equal to 'size' if not compressed)
+} chunk_header_t;
+
+// the most blocks a chunk takes (if its content doesn't compress)
+#define CHUNK_MAX_BLOCKS ((int)((sizeof(chunk_header_t)+CHUNK_SIZE+sector_size-1)/sector_size))
+
 // other file related definitions
 
 // max length of a path is 256 bytes (including the ending null)
@@ -80,10 +191,60 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
 
-// max number of open files is 256
+// max number of open files is 256 (unless set otherwise at boot)
 #define MAX_OPEN_FILES 256
 
-inode_t* getInodeHelper(int child_inode);
+// the size of a cache line, to keep apart data used by different
+// threads
+#define CACHE_LINE 64
+
+// the calls counted by FS_GetStats() are timed by the entry points
+// between STAT_BEGIN() and STAT_END(), which gives back the result of
+// the call; the counters are spread over a few shards, each thread
+// adding to one of them, so that the threads don't contend on them
+#if FSSTATS
+#define STAT_SHARDS 16
+
+typedef struct _stat_shard {
+  FS_OpStats_t ops[FS_OPS];
+} __attribute__((aligned(CACHE_LINE))) stat_shard_t;
+
+static stat_shard_t stat_shards[STAT_SHARDS];
+static int stat_next_shard;
+static __thread int stat_shard = -1; // the calling thread's shard
+
+static inline long stat_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+static int stat_op(int op, long start, int ret)
+{
+  long ns = stat_clock()-start;
+  long us = ns/1000;
+  int bucket = us ? 64-__builtin_clzl(us) : 0;
+  if(bucket >= FS_LATENCY_BUCKETS) bucket = FS_LATENCY_BUCKETS-1;
+  if(stat_shard < 0)
+    stat_shard = __atomic_fetch_add(&stat_next_shard, 1, __ATOMIC_RELAXED)%STAT_SHARDS;
+  FS_OpStats_t* s = &stat_shards[stat_shard].ops[op];
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  if(ret < 0) __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  else if(op == FS_OP_FILE_READ || op == FS_OP_FILE_WRITE)
+    __atomic_fetch_add(&s->bytes, ret, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->latency[bucket], 1, __ATOMIC_RELAXED);
+  return ret;
+}
+
+#define STAT_BEGIN() long stat_start = stat_clock()
+#define STAT_END(op, ret) stat_op(op, stat_start, ret)
+#else
+#define STAT_BEGIN() do {} while(0)
+#define STAT_END(op, ret) ((void)(op), (ret))
+#endif
+
 //int remove_file_or_directory(int type, char* pathname)
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
@@ -93,1128 +254,5720 @@ typedef struct _dirent {
   int inode; // inode of the file
 } dirent_t;
 
+// copy a name into a name field of MAX_NAME bytes (a legal name fits
+// with its terminator; anything longer is cut short)
+static inline void name_copy(char* to, const char* from)
+{
+  size_t len = strnlen(from, MAX_NAME-1);
+  memcpy(to, from, len);
+  to[len] = '\0';
+}
+
 // the number of directory entries that can be contained in a sector
-#define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
+#define DIRENTS_PER_SECTOR (sector_size/sizeof(dirent_t))
 
 // global errno value here
-int osErrno;
+__thread int osErrno;
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the format version of the file system that's booted
+static int fs_version;
+static int compress_files; // files created are compressed (#7)
+static unsigned boot_count; // to tell the boots apart
+
+// the calls a server makes for its clients (see the end of the file);
+// a request is a header followed by 'len' bytes (the path or paths,
+// ending with a null, or the data written), and the reply as well
+// (the data read, or the entries or statistics asked for)
+typedef enum {
+  RPC_SYNC, RPC_SNAPSHOT, RPC_SNAPSHOT_SAVE, RPC_SNAPSHOT_DELETE,
+  RPC_FILE_CREATE, RPC_FILE_UNLINK, RPC_FILE_CREATE_BATCH, RPC_FILE_UNLINK_BATCH,
+  RPC_FILE_OPEN, RPC_FILE_READ, RPC_FILE_WRITE, RPC_FILE_RESERVE, RPC_FILE_SEEK, RPC_FILE_CLOSE,
+  RPC_DIR_CREATE, RPC_DIR_UNLINK, RPC_DIR_SIZE, RPC_DIR_READ,
+  RPC_DIR_OPEN, RPC_DIR_NEXT, RPC_DIR_TELL, RPC_DIR_SEEK, RPC_DIR_CLOSE,
+  RPC_CACHE_STATS, RPC_ALLOC_STATS, RPC_STATS, RPC_CHECK,
+} rpc_op_t;
+
+typedef struct {
+  int op;     // one of rpc_op_t
+  int fd;     // the file descriptor or directory stream
+  int arg;    // the size, offset, cursor or count of the call
+  int offset; // where File_Submit() reads or writes (-1 for the fd's position)
+  int len;
+} rpc_request_t;
+
+typedef struct {
+  int result; // what the call returned
+  int error;  // osErrno if it failed
+  int len;
+} rpc_reply_t;
+
+// the connection to the server of the image, if one was running when
+// the file system was booted; the entry points then leave the calls
+// to the server
+static int remote = -1;
+static int remote_connect(char* image, FS_Options_t* options);
+static int remote_call(int op, int fd, int arg, const void* data, int len, void* out, int cap);
+static int remote_path(int op, char* path);
+static int remote_io(int op, int fd, void* buffer, int size);
+static int remote_batch(int op, char* dir, char** names, int n);
+static int remote_submit(FS_Request_t* requests, int count);
+
+// the first sector that can be allocated to files and directories
+static inline int data_start_sector()
+{
+  return DATABLOCK_START_SECTOR + (fs_version >= FS_VERSION_JOURNAL ? JOURNAL_SECTORS : 0);
+}
+
 /* the following functions are internal helper functions */
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
-static int check_magic()
+// the metadata sectors changed by the namespace operation the calling
+// thread is running (see the journal below); NULL if it isn't running
+// one, or if the file system has no journal
+#define JTXN_SECTORS 32 // at most this many sectors per transaction
+
+typedef struct _jtxn {
+  int n;        // number of sectors noted
+  int overflow; // set if more than JTXN_SECTORS were changed
+  int sector[JTXN_SECTORS];
+} jtxn_t;
+
+static __thread jtxn_t* txn;
+
+// note that a sector has been changed by the current transaction
+static void journal_note(int sector)
 {
-  char buf[SECTOR_SIZE];
-  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
-    return 0;
-  if(*(int*)buf == OS_MAGIC) return 1;
-  else return 0;
+  jtxn_t* t = txn;
+  if(!t) return;
+  for(int i=0; i<t->n; i++)
+    if(t->sector[i] == sector) return;
+  if(t->n < JTXN_SECTORS) t->sector[t->n++] = sector;
+  else t->overflow = 1;
 }
 
-// initialize a bitmap with 'num' sectors starting from 'start'
-// sector; all bits should be set to zero except that the first
-// 'nbits' number of bits are set to one
-static void bitmap_init(int start, int num, int nbits)
+// note that a sector changed by the current transaction has been freed
+// since: its content no longer matters, and must not be logged
+static void journal_forget(int sector)
 {
-  /* YOUR CODE */
-  dprintf("Initializing Bitmap\n");
-  
-  int beginSector,beginByte,beginBit,bitToOne;
-  
-  for(beginSector = 0; beginSector < num ; beginSector++){ // here we will iterate through each sector once becasue we can use the Disk_Write operation sector wise.
-    char *bitmap = calloc(512,sizeof(char)); // using calloc, we assign a particular sector and make all the values 0 at the same time
-    int temp,mod; // These 2 variables are used to optimize the assigning of 1 to first nbits value
-    
-    if (nbits > 512*8){ // this if blocks indicate that the value of nbits is larger than the total size of a sector,so we can make the all sector set without using any sequential process.
-      memset(bitmap,255,512); // set all the bytes of this sector to 255 which means all the bits are 1 of this particular sector.
-      nbits = nbits - 512; // reducing the value of nbits to 512 as we have already set the 512 bytes
-    }
-
-    else if(nbits < 512*8 && nbits > 0){ // in this situation, the value of nbits is less than a sector contains
-      //memset(buf,1,nbits);
-      //nbits = 0;
-      temp = nbits/8; // returns how many bytes we can be completely set using the 255.
-      mod = nbits%8; // returns how many bits are left over
-      memset(bitmap,255,temp); // set all the bytes we can set to 255
-      for(beginBit = 0; beginBit < 8;beginBit++){ // seqentially modified the last byte with the leftover bits. Took some help from https://www.cprogramming.com/tutorial/bitwise_operators.html website whileimplementing this part.
-        if(mod > 0){
-	  bitmap[temp] = (1 << (7-beginBit));
-	  mod--;
-	}
-      }
-      nbits=0; // all nbits are set, so making the value to 0
-    }
-    else{
-      //do nothing. just write a all 0 array to the disk
+  jtxn_t* t = txn;
+  if(!t) return;
+  for(int i=0; i<t->n; i++) {
+    if(t->sector[i] == sector) {
+      t->sector[i] = t->sector[--t->n];
+      return;
     }
-
-    //print the bitmap
-    /*for(int i =0; i< 512; i++)
-      dprintf("%x ",bitmap[i]);
-    dprintf("\n");*/
-    Disk_Write(start+beginSector, bitmap);
-   
-    free(bitmap); // free the bitmap after use
   }
 }
 
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits)
+// the buffer cache sits between the file system and the disk: it
+// keeps up to BCACHE_SIZE disk sectors in memory, found through a
+// hash table on the sector number; the file system works directly on
+// the cached copy of a sector (pinned while in use) instead of
+// copying it to the stack; modified sectors are only written to the
+// disk when they are evicted (chosen by the CLOCK algorithm among
+// the unpinned buffers) or when the cache is flushed on sync
+#define BCACHE_SIZE 256
+#define BCACHE_BUCKETS 512 // must be a power of two
+
+// the cache is split into stripes by sector number, each with its own
+// buffers, hash table, CLOCK hand, and lock, so that threads working
+// on different sectors rarely wait for each other; consecutive
+// sectors fall into different stripes
+#define BCACHE_STRIPES 8 // must be a power of two
+#define BCACHE_STRIPE_SIZE (BCACHE_SIZE/BCACHE_STRIPES)
+#define BCACHE_STRIPE_BUCKETS (BCACHE_BUCKETS/BCACHE_STRIPES)
+
+// flags for bcache_get()
+#define BC_ZERO 1 // the sector is new: zero the buffer instead of reading the disk
+
+typedef struct _buf {
+  int sector;        // the disk sector cached here (-1 if the buffer is free)
+  int pins;          // number of users currently holding the buffer
+  int dirty;         // modified since read from the disk
+  int referenced;    // reference bit for CLOCK
+  struct _buf* next; // next buffer in the same hash bucket
+  char* data;        // a sector's worth of bytes in 'bcache_data'
+} buf_t;
+
+typedef struct _bstripe {
+  pthread_mutex_t lock; // protects everything in the stripe but the buffer contents
+  buf_t bufs[BCACHE_STRIPE_SIZE];
+  buf_t* hash[BCACHE_STRIPE_BUCKETS];
+  int hand;             // the CLOCK hand
+  FS_CacheStats_t stats;
+} bstripe_t;
+
+static bstripe_t bcache[BCACHE_STRIPES];
+
+// the data of all buffers, one sector after the other (the buffers of
+// a stripe being next to each other), sized for the sector size at boot
+static char* bcache_data;
+static int bcache_data_sector_size;
+
+static inline bstripe_t* bcache_stripe(int sector)
 {
-  /* YOUR CODE */
-  dprintf("bitmap first unused using nbits value of %d\n",nbits);
-  int beginSector,beginByte,beginBit;
-  int result;
-  int position = 0;// this variable will be used to return the first unused position
-  char *bitmap = calloc(512,sizeof(char));
-  beginSector = 0; // we will iterate each sector using this variable
-  
-  while(nbits > 0){// we will iterate as long as we have a positivie nbits value
-    if(Disk_Read(start+beginSector, bitmap) == 0){
-      for(beginByte = 0; beginByte < 512 ; beginByte++){// we will iterate each byte
-          result = bitmap[beginByte];
-	  if(result == -1){ // this means all the bits are 1 in this particular byte, so no need to iterate through the bits
-	    position +=8; // increase the position as 8
-	    nbits -= 8;// decrease the nbits value to 8
-	  }
-	  else{	// here all the bits of this byte is not 1, so we will find our desired unused bit now
-            for(beginBit = 0; beginBit < 8; beginBit++){ // iterate through the 8 bits of that byte
-            //temp = bitmap[beginByte] >> beginBit;
-	    //temp &= 1;
-	    //temp = (bitmap[beginByte] & (1 << beginBit));
-	    if((bitmap[beginByte] & (1 << (7-beginBit))) == 0){ // this particular bit is 0 (our desired one). Took help to get a particular bit from a byte from this website: https://stackoverflow.com/questions/4854207/get-a-specific-bit-from-byte
-	      bitmap[beginByte] = bitmap[beginByte] | (1 << (7-beginBit)); // update the specific byte
-	      Disk_Write(start+beginSector, bitmap); // update the disk with modified byte
-	      return position;
-	    }
-            position++;
-	    nbits --;  
-	    }
-         }
-      }
-    }
-    beginSector++;
-  }
-  return -1;
+  return &bcache[(sector*2654435761u) & (BCACHE_STRIPES-1)];
 }
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit)
+static inline int bcache_bucket(int sector)
 {
-  /* YOUR CODE */
-  dprintf("Bitmap reset function has been called");
-  int beginSector, beginByte, beginBit;
-  int Sector,byte,bit;
-  char *bitmap = calloc(512,sizeof(char));
-  Sector = ibit / (512*8);// we find out in which sector the ibit is located
-  bit = ibit % 8; // find out the ibit's position in that particular sector
-  beginByte = ibit / 512;// find out in which byte the ibit is located
-  //ibit = ibit - (Sector*512*8) - (byte*8);
-  dprintf("the sector and byte is %d and %d\n",Sector,byte);
-  Disk_Read(start+Sector, bitmap);
-  //for(int beginByte = 0; beginByte < 512; beginSector++){
-    for(int beginBit = 0; beginBit < 8; beginBit++){
-      if(bit == 0){
-        bitmap[beginByte] = bitmap[beginByte] & (~(1 << (7 - beginBit)));
-	Disk_Write(start+Sector, bitmap);
-	return 0;
-      }
-      bit --;
-    }
-  //}
-  return -1;
+  return ((sector*2654435761u)/BCACHE_STRIPES) & (BCACHE_STRIPE_BUCKETS-1);
 }
 
-// return 1 if the file name is illegal; otherwise, return 0; legal
-// characters for a file name include letters (case sensitive),
-// numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
-static int illegal_filename(char* name)
+static inline buf_t* bcache_buf(char* data)
 {
-  /* YOUR CODE */
-  int len = strlen(name);
-  //dprintf("Size is %d\n",len); 
-  //dprintf("value is %s\n",name);
-  if(len > MAX_NAME - 1){
-    dprintf("Name is too big\n");
-    return 1;
-  }
-  for(int i = 0; i<len;i++){
-    if(!(isdigit(name[i]) || isalpha(name[i]) || name[i] == '.' || name[i] == '-' || name[i] == '_')){
-      dprintf("name contains illegal charecter\n");
-      return 1;
-    }
-  }
-  
-  return 0; 
+  int i = (data-bcache_data)/sector_size;
+  return &bcache[i/BCACHE_STRIPE_SIZE].bufs[i%BCACHE_STRIPE_SIZE];
 }
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname,
-			    int *cached_inode_sector, char* cached_inode_buffer)
+// find the buffer holding the given sector in its stripe (locked by
+// the caller); NULL if not cached
+static buf_t* bcache_lookup(bstripe_t* st, int sector)
 {
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-	 parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return -2;
-  }
+  for(buf_t* b = st->hash[bcache_bucket(sector)]; b; b = b->next)
+    if(b->sector == sector) return b;
+  return NULL;
+}
 
-  int nentries = parent->size; // remaining number of directory entries 
-  int idx = 0;
-  while(nentries > 0) {
-    char buf[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buf) < 0) return -2;
-    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-	// found the file/directory; update inode cache
-	int child_inode = ((dirent_t*)buf)[i].inode;
-	dprintf("... found child_inode=%d\n", child_inode);
-	int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-	if(sector != (*cached_inode_sector)) {
-	  *cached_inode_sector = sector;
-	  if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-	  dprintf("... load inode table for child\n");
-	}
-	return child_inode;
-      }
-    }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
-  }
-  dprintf("... could not find child inode\n");
-  return -1; // not found
+// add a buffer to the hash chain of its sector
+static void bcache_hash_in(bstripe_t* st, buf_t* b)
+{
+  int h = bcache_bucket(b->sector);
+  b->next = st->hash[h];
+  st->hash[h] = b;
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_fname' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char* path, int* last_inode, char* last_fname)
+// remove the buffer from its hash chain
+static void bcache_unhash(bstripe_t* st, buf_t* b)
 {
-  if(!path) {
-    dprintf("... invalid path\n");
-    return -1;
-  }
-  if(path[0] != '/') {
-    dprintf("... '%s' not absolute path\n", path);
-    return -1;
+  buf_t** pp = &st->hash[bcache_bucket(b->sector)];
+  while(*pp != b) pp = &(*pp)->next;
+  *pp = b->next;
+  b->next = NULL;
+}
+
+// write a dirty buffer back to disk; return 0 if successful, -1 otherwise
+static int bcache_writeback(bstripe_t* st, buf_t* b)
+{
+  if(!b->dirty) return 0;
+  if(Disk_Write(b->sector, b->data) < 0) return -1;
+  b->dirty = 0;
+  st->stats.writebacks++;
+  return 0;
+}
+
+// pick a buffer of the stripe to hold a new sector, evicting (and
+// writing back if dirty) an old one by the CLOCK algorithm; NULL if
+// all are pinned
+static buf_t* bcache_victim(bstripe_t* st)
+{
+  for(int n=0; n<2*BCACHE_STRIPE_SIZE; n++) {
+    buf_t* b = &st->bufs[st->hand];
+    st->hand = (st->hand+1)%BCACHE_STRIPE_SIZE;
+    if(b->pins > 0) continue;
+    if(b->sector < 0) return b;
+    if(b->referenced) { b->referenced = 0; continue; }
+    if(bcache_writeback(st, b) < 0) return NULL;
+    dprintf("... bcache evicts sector %d\n", b->sector);
+    bcache_unhash(st, b);
+    b->sector = -1;
+    st->stats.evictions++;
+    return b;
   }
-  
-  // make a copy of the path (skip leading '/'); this is necessary
-  // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH]; 
-  strncpy(pathstore, path+1, MAX_PATH-1);
-  pathstore[MAX_PATH-1] = '\0'; // for safety
-  char* lpath = pathstore;
-  
-  int parent_inode = -1, child_inode = 0; // start from root
-  // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
-  
-  // for each file/directory name separated by '/'
-  char* token;
-  while((token = strsep(&lpath, "/")) != NULL) {
-    dprintf("... process token: '%s'\n", token);
-    if(*token == '\0') continue; // multiple '/' ignored
-    if(illegal_filename(token)) {
-      dprintf("... illegal file name: '%s'\n", token);
-      return -1; 
+  dprintf("... bcache: all buffers are pinned\n");
+  return NULL;
+}
+
+// return the cached content of a disk sector, pinned until released
+// by bcache_put(); with BC_ZERO, the sector is zero-filled instead of
+// read from the disk, and marked modified (for newly allocated
+// sectors, which must not inherit what a copy left in the cache
+// holds); return NULL if there's an error; the buffer itself is not
+// locked: threads sharing a sector must agree on its use through the
+// locks of the file system objects it belongs to
+static char* bcache_get(int sector, int flags)
+{
+  bstripe_t* st = bcache_stripe(sector);
+  pthread_mutex_lock(&st->lock);
+  buf_t* b = bcache_lookup(st, sector);
+  if(b) {
+    st->stats.hits++;
+    if(flags & BC_ZERO) {
+      memset(b->data, 0, sector_size);
+      b->dirty = 1;
     }
-    if(child_inode < 0) {
-      // regardless whether child_inode was not found previously, or
-      // there was issues related to the parent (say, not a
-      // directory), or there was a read error, we abort
-      dprintf("... parent inode can't be established\n");
-      return -1;
+  } else {
+    st->stats.misses++;
+    if(!(b = bcache_victim(st))) {
+      pthread_mutex_unlock(&st->lock);
+      return NULL;
     }
-    parent_inode = child_inode;
-    child_inode = find_child_inode(parent_inode, token,
-				   &cached_sector, cached_buffer);
-    if(last_fname) strcpy(last_fname, token);
-  }
-  if(child_inode < -1) return -1; // if there was error, abort
-  else {
-    // there was no error, several possibilities:
-    // 1) '/': parent = -1, child = 0
-    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
-    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
-    // in the first case, we set parent=child=0 as special case
-    if(parent_inode==-1 && child_inode==0) parent_inode = 0;
-    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
-    *last_inode = child_inode;
-    return parent_inode;
+    if(flags & BC_ZERO) memset(b->data, 0, sector_size);
+    else if(Disk_Read(sector, b->data) < 0) {
+      pthread_mutex_unlock(&st->lock);
+      return NULL;
+    }
+    b->sector = sector;
+    b->dirty = (flags & BC_ZERO) != 0;
+    bcache_hash_in(st, b);
   }
+  b->pins++;
+  b->referenced = 1;
+  pthread_mutex_unlock(&st->lock);
+  return b->data;
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+// release a sector obtained from bcache_get(); mark it dirty if the
+// caller has modified it
+static void bcache_put(char* data, int dirty)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1; 
-  }
-  dprintf("... new child inode %d\n", child_inode);
-
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-	 child_inode, child->size, child->type, inode_sector);
-
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-	 parent_inode, inode_sector);
-
-  // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n",
-	 parent_inode, parent->size, parent->type);
+  buf_t* b = bcache_buf(data);
+  bstripe_t* st = bcache_stripe(b->sector);
+  pthread_mutex_lock(&st->lock);
+  assert(b->pins > 0);
+  b->pins--;
+  if(dirty) b->dirty = 1;
+  int sector = b->sector;
+  pthread_mutex_unlock(&st->lock);
+  if(dirty) journal_note(sector);
+}
 
-  // get the dirent sector
-  if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
-  }
-  int group = parent->size/DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
-  if(group*DIRENTS_PER_SECTOR == parent->size) {
-    // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    if(newsec < 0) {
-      dprintf("... error: disk is full\n");
-      return -1;
-    }
-    parent->data[group] = newsec;
-    memset(dirent_buffer, 0, SECTOR_SIZE);
-    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-  } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
-      return -1;
-    dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
-  }
-
-  // add the dirent and write to disk
-  int start_entry = group*DIRENTS_PER_SECTOR;
-  offset = parent->size-start_entry;
-  dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
-  strncpy(dirent->fname, file, MAX_NAME);
-  dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
-  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-	  parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
-
-  // update parent inode and write to disk
-  parent->size++;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
-  
-  return 0;
+// return 1 if the sector is in the cache, 0 otherwise
+static int bcache_cached(int sector)
+{
+  bstripe_t* st = bcache_stripe(sector);
+  pthread_mutex_lock(&st->lock);
+  int cached = (bcache_lookup(st, sector) != NULL);
+  pthread_mutex_unlock(&st->lock);
+  return cached;
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
+// the sector has been freed: drop it from the cache without writing
+// it back (unless someone is still holding it)
+static void bcache_discard(int sector)
 {
-  int child_inode;
-  char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  dprintf("the paren_inode is %d\n",parent_inode);
-  if(parent_inode >= 0) {
-    if(child_inode >= 0) {
-      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
-      return -1;
-    } else {
-      if(add_inode(type, parent_inode, last_fname) >= 0) {
-	dprintf("... successfully created file/directory: '%s'\n", pathname);
-	return 0;
-      } else {
-	dprintf("... error: something wrong with adding child inode\n");
-	osErrno = E_CREATE;
-	return -1;
-      }
-    }
-  } else {
-    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
-    osErrno = E_CREATE;
-    return -1;
+  bstripe_t* st = bcache_stripe(sector);
+  pthread_mutex_lock(&st->lock);
+  buf_t* b = bcache_lookup(st, sector);
+  if(b && b->pins == 0) {
+    bcache_unhash(st, b);
+    b->sector = -1;
+    b->dirty = 0;
   }
+  pthread_mutex_unlock(&st->lock);
 }
 
-// remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode)
+static int bcache_cmp_sector(const void* a, const void* b)
 {
- dprintf("entering remove inode function\n");
-  /* YOUR CODE */
-  //get child i_node
-    inode_t* childnode = getInodeHelper(child_inode);
-  
-  //
-  int sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-    //check type validity
-    if (childnode->type != type) 
-    {
-      dprintf("...filetype not valid\n");
-      return -3;
-    } 
-  
-    // check for empty directory
-    else if (childnode->size!=0)
-     { 
-       dprintf("...directory not empty\n");
-       return -2; 
-     }
-    dprintf("... validating type and if directory empty\n");
-    /* considering the child inode is distribute */
-    //remove data from child inode by 
-    for(int i=0;i < MAX_SECTORS_PER_FILE;i++){ //MAX_SECTORS_PER_FILE=30
-    if (childnode->data[i]) 
-    { 
-      //buffer size is 512 bytes
-      char buffer[SECTOR_SIZE];
-      dprintf("... deleting data of child node\n");
-      bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, childnode->data[i]); //it resets the bit at the specific file table position
-      //setting the value of buffer of size 512 bytes to zero
-      memset(buffer,0,SECTOR_SIZE);
-      /*the memory buffer of inode data with the sector size of 512 
-      is set to zero using memset() function because it has a nuilt in loop
-      that will set the buffer size to 0 with faster run time intead of using 
-      a for loop to clear the buffer */
-
-    }
-    }
-    //remove child inode
-    bitmap_reset(INODE_BITMAP_START_SECTOR,INODE_BITMAP_SECTORS, child_inode);
-    /* bitmap_reset is called to perforrm the main function of removing i node 
-    by resetting the bit and putting a pointer to know location. Here 
-    star pointer is at inode bitmap star sector to the size of the bitmap sector 
-    and here the child inode bit is flipped */
-    memset(childnode,0,sizeof(inode_t));
-    /* the memory buffer of childnode in size of the inode 
-      is set to zero to clear the inode table */
-    dprintf("... child inode is removed from i node table\n");
-
-    /* The following four process of fetching parent inode
-    ,parent inode sector,checking for directory parent type
-    and getting the dirent sector
-    has been borrowed from the provided code structure */
-    
-    // disk sector of parent inode is loaded
-    sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-    if(Disk_Read(sector, inode_buffer) < 0) return -1;
-    dprintf("... load inode table for parent inode %d from disk sector %d\n"
-    ,parent_inode, sector);
-
-    // the parent inode is loaded 
-    int inode_start_entry = (sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = parent_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... get parent inode %d (size=%d, type=%d)\n",
-    parent_inode, parent->size, parent->type);
-  
-    //parent inode needs to be a directory to remove the child inode from
-    if (parent->type != 1) { //this means parent inode is not type 1 & not a directory
-        dprintf("... error: parent inode is not directory\n"); 
-        return -2; // parent not directory
-    }
+  return ((Disk_IOVec_t*)a)->sector-((Disk_IOVec_t*)b)->sector;
+}
 
-    // get the dirent sectors 
-    char dirent_buffer[SECTOR_SIZE];
-    for (int j = 0; j < MAX_SECTORS_PER_FILE; j++) {
-    if (parent->data[j]) {
-      if (Disk_Read(parent->data[j], dirent_buffer) < 0) { 
-        return -1;
-       }
-      dprintf("... load disk sector %d for dirent group %d\n", parent->data[j], j + 1);
-    
-    //consider directory over several sectors assigned for directory
-    for (int k = 0; k < DIRENTS_PER_SECTOR; k++) { 
-    dirent_t *dirent = (dirent_t *) (dirent_buffer + (k * sizeof(dirent_t))); //
-    
-    /* The following process is for directory unlink*/
-
-    // remove child dirent 
-    if (dirent->inode == child_inode) { // if child directory is found
-      dprintf("... found match: dirent inode %d, child inode %d\n", dirent->inode, child_inode);
-      memset(dirent, 0, sizeof(dirent_t));//clearing the buffer of directory by setting to zero
-      if (Disk_Write(parent->data[j], dirent_buffer) < 0) { 
-        return -1; //updating disk about parent inode data
-        }
-      if(parent->size > 0){
-      parent->size--; // resetting the parent inode to previous i node 
-      }
-      /* directory inode restored to previous node */
-      if (Disk_Write(sector, inode_buffer) < 0) {
-         return -1; //update disk with new inode position
+// write all dirty buffers back to disk, in the order of the sectors
+// and with a single request; return 0 if successful, -1 otherwise
+static int bcache_flush()
+{
+  Disk_IOVec_t iov[BCACHE_SIZE];
+  int n = 0, ret = 0;
+  for(int s=0; s<BCACHE_STRIPES; s++) pthread_mutex_lock(&bcache[s].lock);
+  for(int s=0; s<BCACHE_STRIPES; s++) {
+    for(int i=0; i<BCACHE_STRIPE_SIZE; i++) {
+      buf_t* b = &bcache[s].bufs[i];
+      if(b->sector >= 0 && b->dirty) {
+	iov[n].sector = b->sector;
+	iov[n].buffer = b->data;
+	n++;
       }
-      dprintf("... update parent inode on disk sector %d\n", sector);
-      return 0; 
-      /* this confirms inode has been remove for the 
-      function delete_helper for 
-      File_Unlink & Dir_Unlink*/
-
-      dprintf("... exiting remove_inode function\n");
-                }
-            }
-        }
     }
-  return -1;
+  }
+  qsort(iov, n, sizeof(Disk_IOVec_t), bcache_cmp_sector);
+  if(Disk_WriteV(iov, n) < 0) ret = -1;
+  else {
+    for(int i=0; i<n; i++) {
+      bcache_buf(iov[i].buffer)->dirty = 0;
+      bcache_stripe(iov[i].sector)->stats.writebacks++;
+    }
+  }
+  for(int s=BCACHE_STRIPES-1; s>=0; s--) pthread_mutex_unlock(&bcache[s].lock);
+  return ret;
 }
-// representing an open file
-typedef struct _open_file {
-  int inode; // pointing to the inode of the file (0 means entry not used)
-  int size;  // file size cached here for convenience
-  int pos;   // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
+// make sure the given sectors are all in the cache; the ones that
+// aren't are read from the disk with a single request, straight into
+// buffers that are set aside (pinned but not yet findable) meanwhile;
+// return 0 if successful, -1 otherwise
+static int bcache_prefetch(const int* sectors, int n)
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode == inode)
-      return 1;
+  Disk_IOVec_t iov[BCACHE_SIZE/2];
+  int nmiss = 0, ret = 0;
+  for(int i=0; i<n && nmiss<BCACHE_SIZE/2; i++) {
+    int dup = 0; // the same sector may be asked for twice
+    for(int j=0; j<nmiss && !dup; j++) dup = (iov[j].sector == sectors[i]);
+    if(dup) continue;
+    bstripe_t* st = bcache_stripe(sectors[i]);
+    pthread_mutex_lock(&st->lock);
+    buf_t* b = bcache_lookup(st, sectors[i]) ? NULL : bcache_victim(st);
+    if(b) b->pins++; // keep it from being picked again for this batch
+    pthread_mutex_unlock(&st->lock);
+    if(!b) continue;
+    iov[nmiss].sector = sectors[i];
+    iov[nmiss].buffer = b->data;
+    nmiss++;
   }
-  return 0;
+  if(nmiss == 0) return 0;
+  if(Disk_ReadV(iov, nmiss) < 0) ret = -1;
+  for(int i=0; i<nmiss; i++) {
+    buf_t* b = bcache_buf(iov[i].buffer);
+    bstripe_t* st = bcache_stripe(iov[i].sector);
+    pthread_mutex_lock(&st->lock);
+    b->pins--;
+    // another thread may have brought the sector in meanwhile
+    if(ret == 0 && !bcache_lookup(st, iov[i].sector)) {
+      b->sector = iov[i].sector;
+      b->dirty = 0;
+      b->referenced = 1;
+      bcache_hash_in(st, b);
+      st->stats.misses++;
+    }
+    pthread_mutex_unlock(&st->lock);
+  }
+  return ret;
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
+// add up the statistics of all stripes
+static void bcache_get_stats(FS_CacheStats_t* stats)
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode <= 0)
-      return i;
+  memset(stats, 0, sizeof(FS_CacheStats_t));
+  stats->size = BCACHE_SIZE;
+  for(int s=0; s<BCACHE_STRIPES; s++) {
+    pthread_mutex_lock(&bcache[s].lock);
+    stats->hits += bcache[s].stats.hits;
+    stats->misses += bcache[s].stats.misses;
+    stats->evictions += bcache[s].stats.evictions;
+    stats->writebacks += bcache[s].stats.writebacks;
+    pthread_mutex_unlock(&bcache[s].lock);
   }
-  return -1;
 }
 
-/* end of internal helper functions, start of API functions */
+static void* fs_aligned_alloc(size_t align, size_t size);
 
-int FS_Boot(char* backstore_fname)
+// empty the cache (at boot time, when the disk content is replaced),
+// making the buffers hold sectors of the current size; return 0 if
+// successful, -1 if out of memory
+static int bcache_reset()
+{
+  // the buffers are aligned to the sector size (or to a page, at most)
+  if(bcache_data_sector_size != sector_size) {
+    free(bcache_data);
+    bcache_data = fs_aligned_alloc(sector_size, (size_t)BCACHE_SIZE*sector_size);
+    bcache_data_sector_size = bcache_data ? sector_size : 0;
+    if(!bcache_data) return -1;
+  }
+  for(int s=0; s<BCACHE_STRIPES; s++) {
+    bstripe_t* st = &bcache[s];
+    memset(st->hash, 0, sizeof(st->hash));
+    for(int i=0; i<BCACHE_STRIPE_SIZE; i++) {
+      st->bufs[i].data = bcache_data+(size_t)(s*BCACHE_STRIPE_SIZE+i)*sector_size;
+      st->bufs[i].sector = -1;
+      st->bufs[i].pins = st->bufs[i].dirty = st->bufs[i].referenced = 0;
+      st->bufs[i].next = NULL;
+    }
+    st->hand = 0;
+    memset(&st->stats, 0, sizeof(st->stats));
+  }
+  return 0;
+}
+
+// LibFS doesn't go to the heap on its hot paths: the structures whose
+// size isn't fixed at compile time come either from an arena, which
+// holds what lives for as long as the file system is booted (the
+// bitmaps) and is reset rather than freed at the next boot, or from
+// pools of power-of-two sized blocks (the directory name indexes),
+// which are put back on a free list when released and handed out
+// again; every block taken from the heap is counted, so that steady
+// state heap traffic shows up in FS_GetAllocStats()
+#define POOL_MIN_SHIFT 4 // the smallest pool block is 16 bytes
+#define POOL_CLASSES 24
+
+typedef union _pool_block {
+  union _pool_block* next; // next free block of the same size
+} pool_block_t;
+
+static pool_block_t* pool_free_list[POOL_CLASSES];
+static char* arena;        // the arena memory
+static size_t arena_size;  // its size in bytes
+static size_t arena_used;  // bytes handed out since the last reset
+static FS_AllocStats_t alloc_stats;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // protects the free lists and the statistics
+
+// take a block from the heap, counting it (with 'pool_lock' held, or
+// at boot time)
+static void* fs_malloc(size_t size)
+{
+  void* p = malloc(size);
+  if(p) {
+    alloc_stats.heap_allocs++;
+    alloc_stats.heap_bytes += size;
+  }
+  return p;
+}
+
+// the same, for a block aligned to 'align' bytes (a power of two)
+static void* fs_aligned_alloc(size_t align, size_t size)
+{
+  size = (size+align-1) & ~(align-1);
+  void* p = aligned_alloc(align, size);
+  if(p) {
+    alloc_stats.heap_allocs++;
+    alloc_stats.heap_bytes += size;
+  }
+  return p;
+}
+
+// make sure the arena can hold 'size' bytes and empty it; the memory
+// is only taken from the heap if the arena has to grow
+static int arena_reset(size_t size)
+{
+  arena_used = 0;
+  if(size <= arena_size) return 0;
+  free(arena);
+  arena = fs_malloc(size);
+  arena_size = arena ? size : 0;
+  return arena ? 0 : -1;
+}
+
+// hand out 'size' zeroed bytes of the arena (aligned for any use);
+// return NULL if the arena is used up
+static void* arena_alloc(size_t size)
+{
+  size = (size+15) & ~(size_t)15;
+  if(arena_used+size > arena_size) return NULL;
+  void* p = arena+arena_used;
+  arena_used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+// the pool a block of 'size' bytes comes from
+static int pool_class(size_t size)
+{
+  int k = 0;
+  while(((size_t)1 << (k+POOL_MIN_SHIFT)) < size) k++;
+  return k;
+}
+
+// get a block of at least 'size' bytes (uninitialized), recycled if
+// possible; return NULL if out of memory
+static void* pool_alloc(size_t size)
+{
+  int k = pool_class(size);
+  if(k >= POOL_CLASSES) return NULL;
+  pthread_mutex_lock(&pool_lock);
+  void* p = pool_free_list[k];
+  if(p) {
+    pool_free_list[k] = pool_free_list[k]->next;
+    alloc_stats.pool_reuses++;
+  } else
+    p = fs_malloc((size_t)1 << (k+POOL_MIN_SHIFT));
+  pthread_mutex_unlock(&pool_lock);
+  return p;
+}
+
+// give back a block obtained from pool_alloc() with the same 'size'
+static void pool_free(void* p, size_t size)
+{
+  if(!p) return;
+  pool_block_t* b = (pool_block_t*)p;
+  int k = pool_class(size);
+  pthread_mutex_lock(&pool_lock);
+  b->next = pool_free_list[k];
+  pool_free_list[k] = b;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// a directory's name index maps every name in the directory to its
+// inode and to the position (slot) of its directory entry, so that
+// finding, adding, or removing an entry doesn't need to scan the
+// directory; the index lives with the directory's in-core inode, is
+// built on first access, and kept up to date by add_inode() and
+// remove_inode(); it's an open-addressing hash table with linear
+// probing, grown by doubling when it gets three quarters full; the
+// index also keeps the positions of the empty dirents (the holes left
+// by removed entries and the unused tail of the last dirent sector)
+// on a stack, so that a new entry takes one of them in O(1)
+#define DINDEX_MIN_CAPACITY 16 // must be a power of two
+
+typedef struct _dindex_slot {
+  char fname[MAX_NAME]; // name of the entry
+  int inode;            // inode of the entry (-1 if the slot is empty)
+  int slot;             // position of the dirent in the directory
+} dindex_slot_t;
+
+typedef struct _dindex {
+  int capacity;         // number of hash slots (a power of two)
+  int count;            // number of names in the index
+  dindex_slot_t* slots;
+  int nholes;           // number of empty dirents on the stack
+  int hole_capacity;    // size of the stack
+  int* holes;           // their positions, the next one to use last
+} dindex_t;
+
+static void dindex_free(dindex_t* ix)
+{
+  if(!ix) return;
+  if(ix->holes) pool_free(ix->holes, ix->hole_capacity*sizeof(int));
+  pool_free(ix->slots, ix->capacity*sizeof(dindex_slot_t));
+  pool_free(ix, sizeof(dindex_t));
+}
+
+// the chunk index of a compressed file gives the first block of each
+// chunk, so that a chunk is found without reading the headers of the
+// ones before it; like a directory's name index, it lives with the
+// in-core inode, is built on first access, and is kept up to date by
+// the writes
+typedef struct _cindex {
+  int nchunks;  // number of chunks of the file
+  int capacity; // size of 'first'
+  int* first;   // first block of each chunk, and the block after the last one
+} cindex_t;
+
+static void cindex_free(cindex_t* ix)
+{
+  if(!ix) return;
+  if(ix->first) pool_free(ix->first, ix->capacity*sizeof(int));
+  pool_free(ix, sizeof(cindex_t));
+}
+
+// the in-core inode table keeps decoded copies of up to ICACHE_SIZE
+// inodes, found through a hash table on the inode number; an inode
+// in use is reference counted (every open file holds a reference for
+// as long as it's open), so that reading or writing an open file
+// needs no access to the inode table at all; modified inodes are
+// written back to the inode table when evicted or, in batches of
+// one inode table sector at a time, when the table is flushed; the
+// table itself is protected by 'icache_lock', while the content of an
+// inode in use is protected by its reader/writer lock (taken by the
+// file operations; directories are covered by the namespace lock)
+#define ICACHE_SIZE 128
+#define ICACHE_BUCKETS 256 // must be a power of two
+
+typedef struct _icache_entry {
+  int inum;          // the inode number (-1 if the entry is free)
+  int refs;          // number of users currently holding the inode
+  int dirty;         // modified since read from the inode table
+  int referenced;    // reference bit for CLOCK
+  struct _icache_entry* next; // next entry in the same hash bucket
+  dindex_t* dindex;  // name index of a directory (NULL until first used)
+  cindex_t* cindex;  // chunk index of a compressed file (NULL until first used)
+  pthread_rwlock_t lock; // readers share the inode's content, writers change it
+  inode_t inode;     // the in-core copy of the inode
+} icache_entry_t;
+
+static icache_entry_t icache[ICACHE_SIZE];
+static icache_entry_t* icache_hash[ICACHE_BUCKETS];
+static int icache_hand; // the CLOCK hand
+#if FSSTATS
+static long icache_hits, icache_misses; // for FS_GetStats()
+#endif
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int icache_bucket(int inum)
+{
+  return (inum*2654435761u) & (ICACHE_BUCKETS-1);
+}
+
+// the inode table sector holding the given inode and the inode's
+// position in it
+static inline int inode_sector(int inum)
+{
+  return INODE_TABLE_START_SECTOR+inum/INODES_PER_SECTOR;
+}
+
+static inline int inode_offset(int inum)
+{
+  return (inum%INODES_PER_SECTOR)*sizeof(inode_t);
+}
+
+static inline icache_entry_t* icache_entry(inode_t* node)
+{
+  return (icache_entry_t*)((char*)node-offsetof(icache_entry_t, inode));
+}
+
+// mark an inode held through iget() as modified (by a holder of its
+// write lock, while others may be taking or releasing references)
+static inline void inode_dirty(inode_t* node)
+{
+  __atomic_store_n(&icache_entry(node)->dirty, 1, __ATOMIC_RELAXED);
+  journal_note(inode_sector(icache_entry(node)->inum));
+}
+
+// lock and unlock the content of an inode held through iget()
+static inline void inode_rdlock(inode_t* node)
+{
+  pthread_rwlock_rdlock(&icache_entry(node)->lock);
+}
+
+static inline void inode_wrlock(inode_t* node)
+{
+  pthread_rwlock_wrlock(&icache_entry(node)->lock);
+}
+
+static inline void inode_unlock(inode_t* node)
+{
+  pthread_rwlock_unlock(&icache_entry(node)->lock);
+}
+
+// write a modified inode back to its (cached) inode table sector;
+// return 0 if successful, -1 otherwise
+static int icache_writeback(icache_entry_t* e)
+{
+  if(!e->dirty) return 0;
+  char* buf = bcache_get(inode_sector(e->inum), 0);
+  if(!buf) return -1;
+  memcpy(buf+inode_offset(e->inum), &e->inode, sizeof(inode_t));
+  bcache_put(buf, 1);
+  e->dirty = 0;
+  return 0;
+}
+
+// pick an entry for a new inode, evicting an unused one by the CLOCK
+// algorithm; NULL if all entries are in use
+static icache_entry_t* icache_victim()
+{
+  for(int n=0; n<2*ICACHE_SIZE; n++) {
+    icache_entry_t* e = &icache[icache_hand];
+    icache_hand = (icache_hand+1)%ICACHE_SIZE;
+    if(e->refs > 0) continue;
+    if(e->inum < 0) return e;
+    if(e->referenced) { e->referenced = 0; continue; }
+    if(icache_writeback(e) < 0) return NULL;
+    icache_entry_t** pp = &icache_hash[icache_bucket(e->inum)];
+    while(*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    e->inum = -1;
+    dindex_free(e->dindex);
+    e->dindex = NULL;
+    cindex_free(e->cindex);
+    e->cindex = NULL;
+    return e;
+  }
+  dprintf("... icache: all inodes are in use\n");
+  return NULL;
+}
+
+// return the in-core copy of the inode, loading it from the inode
+// table if necessary; the inode is held until released by iput();
+// return NULL if there's an error
+static inode_t* iget(int inum)
+{
+  if(inum < 0 || inum >= max_files) return NULL;
+  pthread_mutex_lock(&icache_lock);
+  icache_entry_t* e;
+  for(e = icache_hash[icache_bucket(inum)]; e; e = e->next)
+    if(e->inum == inum) break;
+  STAT(e ? icache_hits++ : icache_misses++);
+  if(!e) {
+    char* buf = NULL;
+    if(!(e = icache_victim()) || !(buf = bcache_get(inode_sector(inum), 0))) {
+      pthread_mutex_unlock(&icache_lock);
+      return NULL;
+    }
+    memcpy(&e->inode, buf+inode_offset(inum), sizeof(inode_t));
+    bcache_put(buf, 0);
+    dprintf("... load inode %d from inode table sector %d\n", inum, inode_sector(inum));
+    e->inum = inum;
+    e->dirty = 0;
+    int h = icache_bucket(inum);
+    e->next = icache_hash[h];
+    icache_hash[h] = e;
+  }
+  e->refs++;
+  e->referenced = 1;
+  pthread_mutex_unlock(&icache_lock);
+  return &e->inode;
+}
+
+// release an inode obtained from iget(); mark it dirty if the caller
+// has modified it
+static void iput(inode_t* node, int dirty)
+{
+  icache_entry_t* e = icache_entry(node);
+  pthread_mutex_lock(&icache_lock);
+  assert(e->refs > 0);
+  e->refs--;
+  if(dirty) e->dirty = 1;
+  pthread_mutex_unlock(&icache_lock);
+  if(dirty) journal_note(inode_sector(e->inum));
+}
+
+// return the in-core copy of the inode, held as by iget(), only if
+// it's cached; NULL otherwise
+static inode_t* icache_peek(int inum)
+{
+  pthread_mutex_lock(&icache_lock);
+  icache_entry_t* e;
+  for(e = icache_hash[icache_bucket(inum)]; e; e = e->next)
+    if(e->inum == inum) break;
+  if(e) e->refs++;
+  pthread_mutex_unlock(&icache_lock);
+  return e ? &e->inode : NULL;
+}
+
+static int icache_cmp_inum(const void* a, const void* b)
+{
+  return (*(icache_entry_t**)a)->inum-(*(icache_entry_t**)b)->inum;
+}
+
+// write all modified inodes back to the inode table; the inodes are
+// sorted so that each inode table sector is updated only once;
+// return 0 if successful, -1 otherwise
+static int icache_flush()
+{
+  icache_entry_t* dirty[ICACHE_SIZE];
+  int ndirty = 0;
+  pthread_mutex_lock(&icache_lock);
+  for(int i=0; i<ICACHE_SIZE; i++)
+    if(icache[i].inum >= 0 && icache[i].dirty) dirty[ndirty++] = &icache[i];
+  qsort(dirty, ndirty, sizeof(icache_entry_t*), icache_cmp_inum);
+
+  for(int i=0; i<ndirty; ) {
+    int sector = inode_sector(dirty[i]->inum);
+    char* buf = bcache_get(sector, 0);
+    if(!buf) {
+      pthread_mutex_unlock(&icache_lock);
+      return -1;
+    }
+    for(; i<ndirty && inode_sector(dirty[i]->inum) == sector; i++) {
+      memcpy(buf+inode_offset(dirty[i]->inum), &dirty[i]->inode, sizeof(inode_t));
+      dirty[i]->dirty = 0;
+    }
+    bcache_put(buf, 1);
+  }
+  pthread_mutex_unlock(&icache_lock);
+  return 0;
+}
+
+// empty the in-core inode table (at boot time)
+static void icache_reset()
+{
+  memset(icache_hash, 0, sizeof(icache_hash));
+  for(int i=0; i<ICACHE_SIZE; i++) {
+    icache[i].inum = -1;
+    icache[i].refs = icache[i].dirty = icache[i].referenced = 0;
+    icache[i].next = NULL;
+    dindex_free(icache[i].dindex);
+    icache[i].dindex = NULL;
+    cindex_free(icache[i].cindex);
+    icache[i].cindex = NULL;
+  }
+  icache_hand = 0;
+}
+
+// the block map translates a block of a file or directory (the
+// sector-sized pieces of its content, counted from zero) to the disk
+// sector holding it, whichever format the inode is stored in; the
+// inode must be held through iget()
+
+// the number of blocks to bring into the buffer cache at once when
+// reading ahead through a file or directory
+#define BMAP_PREFETCH (BCACHE_SIZE/4)
+
+// return the disk sector holding the given block, 0 if the block is
+// not allocated, or -1 if there's an error; if 'run' is not NULL, it's
+// set to the number of blocks from this one on that occupy
+// consecutive sectors
+static int bmap(inode_t* node, int block, int* run)
+{
+  if(block < 0 || node->type == INLINE_FILE) return 0;
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    if(block >= MAX_SECTORS_PER_FILE || !node->data[block]) return 0;
+    if(run) {
+      int n = 1;
+      while(block+n < MAX_SECTORS_PER_FILE && node->data[block+n] == node->data[block]+n) n++;
+      *run = n;
+    }
+    return node->data[block];
+  }
+
+  // walk the extents, reading the indirect ones only if needed
+  char* indirect = NULL;
+  int sector = 0;
+  for(int i=0; i<node->nextents; i++) {
+    extent_t* ext;
+    if(i < INODE_EXTENTS) ext = &node->extent[i];
+    else {
+      if(!indirect && !(indirect = bcache_get(node->indirect, 0))) return -1;
+      ext = (extent_t*)indirect+(i-INODE_EXTENTS);
+    }
+    if(block < ext->length) {
+      if(run) *run = ext->length-block;
+      sector = ext->start+block;
+      break;
+    }
+    block -= ext->length;
+  }
+  if(indirect) bcache_put(indirect, 0);
+  return sector;
+}
+
+// return the number of blocks allocated to an inode (or -1 if there's
+// an error)
+static int bmap_nblocks(inode_t* node)
+{
+  int n = 0;
+  if(node->type == INLINE_FILE) return 0;
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    while(n < MAX_SECTORS_PER_FILE && node->data[n]) n++;
+    return n;
+  }
+  for(int i=0; i<node->nextents && i<INODE_EXTENTS; i++)
+    n += node->extent[i].length;
+  if(node->nextents > INODE_EXTENTS) {
+    char* indirect = bcache_get(node->indirect, 0);
+    if(!indirect) return -1;
+    for(int i=INODE_EXTENTS; i<node->nextents; i++)
+      n += ((extent_t*)indirect)[i-INODE_EXTENTS].length;
+    bcache_put(indirect, 0);
+  }
+  return n;
+}
+
+// find the sectors of up to 'count' blocks, starting from the given
+// one (and stopping at the first unallocated one); return how many
+// were found
+static int bmap_sectors(inode_t* node, int block, int count, int* sectors)
+{
+  int n = 0;
+  while(n < count) {
+    int run, sector = bmap(node, block+n, &run);
+    if(sector <= 0) break;
+    for(int i=0; i<run && n<count; i++) sectors[n++] = sector+i;
+  }
+  return n;
+}
+
+// bring the sectors of up to BMAP_PREFETCH blocks, starting from the
+// given one, into the buffer cache (only the missing sectors are read
+// from the disk, all at once)
+static void bmap_prefetch(inode_t* node, int block, int count)
+{
+  int sectors[BMAP_PREFETCH];
+  if(count > BMAP_PREFETCH) count = BMAP_PREFETCH;
+  bcache_prefetch(sectors, bmap_sectors(node, block, count, sectors));
+}
+
+// FNV-1a hash of a file name
+static inline unsigned dindex_hash(const char* fname)
+{
+  unsigned h = 2166136261u;
+  for(int i=0; i<MAX_NAME && fname[i]; i++)
+    h = (h^(unsigned char)fname[i])*16777619u;
+  return h;
+}
+
+// find the hash slot of the given name; NULL if it's not in the index
+static dindex_slot_t* dindex_find(dindex_t* ix, const char* fname)
+{
+  unsigned mask = ix->capacity-1;
+  for(unsigned i = dindex_hash(fname)&mask; ix->slots[i].inode >= 0; i = (i+1)&mask)
+    if(!strncmp(ix->slots[i].fname, fname, MAX_NAME)) return &ix->slots[i];
+  return NULL;
+}
+
+// add a name to the index (the name must not be there already);
+// return 0 if successful, -1 if out of memory
+static int dindex_insert(dindex_t* ix, const char* fname, int inode, int slot)
+{
+  if(4*(ix->count+1) > 3*ix->capacity) {
+    // grow the table and rehash all names
+    dindex_t bigger = { 2*ix->capacity, 0, pool_alloc(2*ix->capacity*sizeof(dindex_slot_t)) };
+    if(!bigger.slots) return -1;
+    for(int i=0; i<bigger.capacity; i++) bigger.slots[i].inode = -1;
+    for(int i=0; i<ix->capacity; i++)
+      if(ix->slots[i].inode >= 0)
+	dindex_insert(&bigger, ix->slots[i].fname, ix->slots[i].inode, ix->slots[i].slot);
+    pool_free(ix->slots, ix->capacity*sizeof(dindex_slot_t));
+    ix->capacity = bigger.capacity;
+    ix->count = bigger.count;
+    ix->slots = bigger.slots;
+  }
+  unsigned mask = ix->capacity-1;
+  unsigned i = dindex_hash(fname)&mask;
+  while(ix->slots[i].inode >= 0) i = (i+1)&mask;
+  name_copy(ix->slots[i].fname, fname);
+  ix->slots[i].inode = inode;
+  ix->slots[i].slot = slot;
+  ix->count++;
+  return 0;
+}
+
+// remove a name from the index; the following names in the same
+// probe sequence are shifted back so that no tombstones are needed
+static void dindex_remove(dindex_t* ix, dindex_slot_t* s)
+{
+  unsigned mask = ix->capacity-1;
+  unsigned hole = s-ix->slots;
+  for(unsigned i = (hole+1)&mask; ix->slots[i].inode >= 0; i = (i+1)&mask) {
+    unsigned home = dindex_hash(ix->slots[i].fname)&mask;
+    // move the entry into the hole unless its home lies cyclically
+    // within (hole, i]
+    if(((i-home)&mask) >= ((i-hole)&mask)) {
+      ix->slots[hole] = ix->slots[i];
+      hole = i;
+    }
+  }
+  ix->slots[hole].inode = -1;
+  ix->count--;
+}
+
+// push the position of an empty dirent on the stack of holes; return
+// 0 if successful, -1 if out of memory
+static int dindex_hole_push(dindex_t* ix, int slot)
+{
+  if(ix->nholes == ix->hole_capacity) {
+    int capacity = ix->hole_capacity ? 2*ix->hole_capacity : DIRENTS_PER_SECTOR;
+    int* holes = pool_alloc(capacity*sizeof(int));
+    if(!holes) return -1;
+    if(ix->holes) {
+      memcpy(holes, ix->holes, ix->nholes*sizeof(int));
+      pool_free(ix->holes, ix->hole_capacity*sizeof(int));
+    }
+    ix->holes = holes;
+    ix->hole_capacity = capacity;
+  }
+  ix->holes[ix->nholes++] = slot;
+  return 0;
+}
+
+// take the position of an empty dirent; -1 if there's none
+static inline int dindex_hole_pop(dindex_t* ix)
+{
+  return ix->nholes > 0 ? ix->holes[--ix->nholes] : -1;
+}
+
+// forget the holes at or after the given position (the directory has
+// been cut short there)
+static void dindex_hole_trim(dindex_t* ix, int nslots)
+{
+  int n = 0;
+  for(int i=0; i<ix->nholes; i++)
+    if(ix->holes[i] < nslots) ix->holes[n++] = ix->holes[i];
+  ix->nholes = n;
+}
+
+// build the name index of a directory held through iget() from its
+// directory entries; return NULL if there's an error
+static dindex_t* dindex_build(inode_t* dir)
+{
+  icache_entry_t* e = icache_entry(dir);
+  dindex_t* ix = pool_alloc(sizeof(dindex_t));
+  if(!ix) return NULL;
+  ix->capacity = DINDEX_MIN_CAPACITY;
+  while(4*dir->size > 3*ix->capacity) ix->capacity *= 2;
+  ix->count = 0;
+  ix->nholes = ix->hole_capacity = 0;
+  ix->holes = NULL;
+  ix->slots = pool_alloc(ix->capacity*sizeof(dindex_slot_t));
+  if(!ix->slots) { pool_free(ix, sizeof(dindex_t)); return NULL; }
+  for(int i=0; i<ix->capacity; i++) ix->slots[i].inode = -1;
+
+  // every allocated dirent sector is scanned, since directory entries
+  // that have been removed may leave holes; they are brought into the
+  // cache a batch at a time
+  int nblocks = bmap_nblocks(dir);
+  for(int j=0; j<nblocks; j++) {
+    if(j%BMAP_PREFETCH == 0) bmap_prefetch(dir, j, nblocks-j);
+    int sector = bmap(dir, j, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+    if(!buf) { dindex_free(ix); return NULL; }
+    for(int k=0; k<DIRENTS_PER_SECTOR; k++) {
+      dirent_t* dirent = (dirent_t*)buf+k;
+      if(!dirent->fname[0]) {
+	// empty entry
+	if(dindex_hole_push(ix, j*DIRENTS_PER_SECTOR+k) < 0) {
+	  bcache_put(buf, 0);
+	  dindex_free(ix);
+	  return NULL;
+	}
+	continue;
+      }
+      if(!dindex_find(ix, dirent->fname) &&
+	 dindex_insert(ix, dirent->fname, dirent->inode, j*DIRENTS_PER_SECTOR+k) < 0) {
+	bcache_put(buf, 0);
+	dindex_free(ix);
+	return NULL;
+      }
+    }
+    bcache_put(buf, 0);
+  }
+  // the first holes are to be used first
+  for(int i=0, j=ix->nholes-1; i<j; i++, j--) {
+    int t = ix->holes[i]; ix->holes[i] = ix->holes[j]; ix->holes[j] = t;
+  }
+  dprintf("... built name index of inode %d (%d entries, %d holes)\n", e->inum, ix->count, ix->nholes);
+  return ix;
+}
+
+// lookups of different threads may need a directory's name index at
+// the same time; only one of them builds it
+static pthread_mutex_t dindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// return the name index of a directory held through iget(), building
+// it if this is the first access; return NULL if there's an error
+static dindex_t* dir_index(inode_t* dir)
+{
+  icache_entry_t* e = icache_entry(dir);
+  dindex_t* ix = __atomic_load_n(&e->dindex, __ATOMIC_ACQUIRE);
+  if(ix) return ix;
+  pthread_mutex_lock(&dindex_lock);
+  if(!(ix = e->dindex) && (ix = dindex_build(dir)))
+    __atomic_store_n(&e->dindex, ix, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&dindex_lock);
+  return ix;
+}
+
+// check magic number in the superblock and pick up the format version
+// that follows it; return 1 if OK, and 0 if not (or if the version is
+// one we don't know)
+static int check_magic()
+{
+  char* buf = bcache_get(SUPERBLOCK_START_SECTOR, 0);
+  if(!buf) return 0;
+  int ok = (((int*)buf)[SB_MAGIC] == OS_MAGIC);
+  fs_version = ((int*)buf)[SB_VERSION];
+  if(fs_version == 0) fs_version = FS_VERSION_BLOCKLIST;
+  if(fs_version > FS_VERSION_LATEST) ok = 0;
+  bcache_put(buf, 0);
+  return ok;
+}
+
+// the in-memory copy of a bitmap; both the inode bitmap and the
+// sector bitmap are loaded from disk the first time they're used
+// after boot (a program that only reads files never needs them) and
+// written back only on sync, so that an allocation never needs to go
+// to the disk afterwards;
+// the bits are kept in the on-disk order (the first bit is the most
+// significant bit of the first byte) and searched one 64-bit word at
+// a time; each bitmap has its own lock, so that allocating inodes
+// doesn't hold up allocating sectors
+typedef struct _bitmap {
+  int start;        // first disk sector of the bitmap
+  int num;          // number of disk sectors used by the bitmap
+  int nbits;        // number of valid bits in the bitmap
+  int nwords;       // number of 64-bit words covering the valid bits
+  int hint;         // all words before this one are known to be full
+  int loaded;       // set once the bits are there (see bitmap_need())
+  int reserved;     // the first bits, set once loaded regardless of the disk
+  char* dirty;      // one flag per disk sector, set if modified
+  uint64_t* words;  // the bits (num*sector_size bytes)
+  long scans;       // searches for unused bits (for FS_GetStats())
+  long scanned;     // words those went through
+  pthread_mutex_t lock; // protects all of the above once set up
+} bitmap_t;
+
+static bitmap_t inode_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };  // one bit for each inode
+static bitmap_t sector_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER }; // one bit for each disk sector
+
+// convert a 64-bit word between the on-disk byte order (the first
+// byte has the lowest bit indices) and a native integer where bit
+// index 0 is the most significant bit
+static inline uint64_t bitmap_word(uint64_t w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(w);
+#else
+  return w;
+#endif
+}
+
+// the arena space needed by a bitmap stored in 'num' sectors
+#define BITMAP_ARENA_SIZE(num) ((num)*sector_size+(((num)+15) & ~15))
+
+// set up the in-memory bitmap of 'nbits' bits stored in 'num'
+// sectors starting from 'start' sector, in the arena; the content is
+// undefined until either bitmap_init() or bitmap_load() is called
+static int bitmap_setup(bitmap_t* bm, int start, int num, int nbits)
+{
+  bm->start = start;
+  bm->num = num;
+  bm->nbits = nbits;
+  bm->nwords = (nbits+63)/64;
+  bm->hint = 0;
+  bm->words = arena_alloc(num*sector_size);
+  bm->dirty = arena_alloc(num*sizeof(char));
+  if(!bm->words || !bm->dirty) {
+    dprintf("... can't allocate memory for bitmap\n");
+    return -1;
+  }
+  return 0;
+}
+
+// initialize a bitmap; all bits should be set to zero except that
+// the first 'nset' number of bits are set to one; the bitmap is
+// written to disk at the next bitmap_flush()
+static void bitmap_init(bitmap_t* bm, int nset)
+{
+  dprintf("Initializing Bitmap\n");
+  unsigned char* bytes = (unsigned char*)bm->words;
+  memset(bytes, 0, bm->num*sector_size);
+  memset(bytes, 0xff, nset/8); // whole bytes first
+  if(nset%8) bytes[nset/8] = (unsigned char)(0xff << (8-nset%8)); // then the leftover bits
+  memset(bm->dirty, 1, bm->num);
+  bm->hint = 0;
+  bm->loaded = 1;
+}
+
+// have a bitmap loaded from disk the first time it's used; its first
+// 'reserved' bits are then set, even if an older image doesn't have
+// them right
+static void bitmap_load(bitmap_t* bm, int reserved)
+{
+  bm->loaded = 0;
+  bm->reserved = reserved;
+}
+
+static void bitmap_set(bitmap_t* bm, int ibit);
+
+// make sure a bitmap is in memory (with its lock held, or with the
+// file system to ourselves); return 0 if successful, -1 otherwise
+static int bitmap_need(bitmap_t* bm)
+{
+  if(bm->loaded) return 0;
+  if(Disk_ReadRange(bm->start, bm->num, (char*)bm->words) < 0) {
+    dprintf("... failed to load bitmap (start=%d)\n", bm->start);
+    return -1;
+  }
+  memset(bm->dirty, 0, bm->num);
+  bm->hint = 0;
+  bm->loaded = 1;
+  for(int i=0; i<bm->reserved; i++) bitmap_set(bm, i);
+  return 0;
+}
+
+// write all modified sectors of a bitmap back to disk; return 0 if
+// successful, -1 otherwise
+static int bitmap_flush(bitmap_t* bm)
+{
+  int ret = 0;
+  pthread_mutex_lock(&bm->lock);
+  for(int i=0; i<bm->num && ret==0 && bm->loaded; i++) {
+    if(!bm->dirty[i]) continue;
+    if(Disk_Write(bm->start+i, (char*)bm->words+i*sector_size) < 0)
+      ret = -1;
+    else
+      bm->dirty[i] = 0;
+  }
+  pthread_mutex_unlock(&bm->lock);
+  return ret;
+}
+
+// mark the bitmap sector containing bit 'ibit' as modified
+static inline void bitmap_touch(bitmap_t* bm, int ibit)
+{
+  bm->dirty[ibit/(sector_size*8)] = 1;
+  journal_note(bm->start+ibit/(sector_size*8));
+}
+
+// return the i-th bit of a bitmap
+static int bitmap_test(bitmap_t* bm, int ibit)
+{
+  pthread_mutex_lock(&bm->lock);
+  int set = bitmap_need(bm) < 0 || ((bitmap_word(bm->words[ibit/64]) >> (63-ibit%64)) & 1);
+  pthread_mutex_unlock(&bm->lock);
+  return set;
+}
+
+// set the i-th bit of a bitmap (used to reserve bits that must never
+// be handed out, regardless of what's stored on disk); the caller
+// holds the bitmap's lock, or has the file system to itself
+static void bitmap_set(bitmap_t* bm, int ibit)
+{
+  unsigned char* bytes = (unsigned char*)bm->words;
+  if(!(bytes[ibit/8] & (0x80 >> (ibit%8)))) {
+    bytes[ibit/8] |= 0x80 >> (ibit%8);
+    bitmap_touch(bm, ibit);
+  }
+}
+
+// set the first unused bit from a bitmap (flip the first zero
+// appeared in the bitmap to one) and return its location; return -1
+// if the bitmap is already full (no more zeros); the search starts
+// from the hint, since all words before it are known to be full
+static int bitmap_first_unused(bitmap_t* bm)
+{
+  pthread_mutex_lock(&bm->lock);
+  STAT(bm->scans++);
+  for(int w=bitmap_need(bm) < 0 ? bm->nwords : bm->hint; w<bm->nwords; w++) {
+    STAT(bm->scanned++);
+    uint64_t free_bits = ~bitmap_word(bm->words[w]);
+    if(!free_bits) continue;
+    int ibit = w*64+__builtin_clzll(free_bits);
+    if(ibit >= bm->nbits) break; // only padding bits are left
+    bm->words[w] |= bitmap_word(1ULL << (63-ibit%64));
+    bitmap_touch(bm, ibit);
+    bm->hint = w;
+    pthread_mutex_unlock(&bm->lock);
+    dprintf("... bitmap (start=%d) allocated bit %d\n", bm->start, ibit);
+    return ibit;
+  }
+  bm->hint = bm->nwords;
+  pthread_mutex_unlock(&bm->lock);
+  return -1;
+}
+
+// find the first run of unused bits at or after bit 'from'; return
+// its first bit and set 'len' to its length, or return -1 if there's
+// no unused bit left
+static int bitmap_next_run(bitmap_t* bm, int from, int* len)
+{
+  if(from >= bm->nbits) return -1;
+  int w = from/64;
+  STAT(bm->scanned++);
+  uint64_t free_bits = ~bitmap_word(bm->words[w]) & (~0ULL >> (from%64));
+  while(!free_bits) {
+    if(++w >= bm->nwords) return -1;
+    STAT(bm->scanned++);
+    free_bits = ~bitmap_word(bm->words[w]);
+  }
+  int start = w*64+__builtin_clzll(free_bits);
+  if(start >= bm->nbits) return -1; // only padding bits are left
+
+  // the run ends at the next used bit (or at the end of the bitmap)
+  uint64_t used_bits = bitmap_word(bm->words[w]) & (~0ULL >> (start%64));
+  while(!used_bits && ++w < bm->nwords) {
+    STAT(bm->scanned++);
+    used_bits = bitmap_word(bm->words[w]);
+  }
+  int end = used_bits ? w*64+__builtin_clzll(used_bits) : bm->nbits;
+  if(end > bm->nbits) end = bm->nbits;
+  *len = end-start;
+  return start;
+}
+
+// allocate a run of up to 'want' consecutive unused bits; the run
+// starts at 'goal' if that bit is unused (to keep a file's sectors
+// together); otherwise, it's the smallest run that can hold 'want'
+// bits or, if there's none, the largest run there is; return its
+// first bit and set 'got' to its length, or return -1 if the bitmap
+// is full
+static int bitmap_alloc_run(bitmap_t* bm, int want, int goal, int* got)
+{
+  int start = -1, len = 0;
+  pthread_mutex_lock(&bm->lock);
+  if(bitmap_need(bm) < 0) {
+    pthread_mutex_unlock(&bm->lock);
+    return -1;
+  }
+  STAT(bm->scans++);
+  if(goal >= 0 && bitmap_next_run(bm, goal, &len) == goal)
+    start = goal;
+  else {
+    // best fit, stopping early at an exact fit
+    for(int from = bm->hint*64, s, l; (s = bitmap_next_run(bm, from, &l)) >= 0; from = s+l) {
+      if(start < 0 || (l >= want && (len < want || l < len)) || (len < want && l > len)) {
+	start = s;
+	len = l;
+      }
+      if(len == want) break;
+    }
+    if(start < 0) {
+      pthread_mutex_unlock(&bm->lock);
+      return -1;
+    }
+  }
+  if(len > want) len = want;
+  for(int i=start; i<start+len; i++) bitmap_set(bm, i);
+  pthread_mutex_unlock(&bm->lock);
+  dprintf("... bitmap (start=%d) allocated bits %d-%d\n", bm->start, start, start+len-1);
+  *got = len;
+  return start;
+}
+
+// reset the i-th bit of a bitmap; return 0 if successful, -1
+// otherwise
+static int bitmap_reset(bitmap_t* bm, int ibit)
+{
+  dprintf("... bitmap (start=%d) reset bit %d\n", bm->start, ibit);
+  if(ibit < 0 || ibit >= bm->nbits) return -1;
+  int w = ibit/64;
+  pthread_mutex_lock(&bm->lock);
+  if(bitmap_need(bm) < 0) {
+    pthread_mutex_unlock(&bm->lock);
+    return -1;
+  }
+  bm->words[w] &= ~bitmap_word(1ULL << (63-ibit%64));
+  bitmap_touch(bm, ibit);
+  if(w < bm->hint) bm->hint = w; // keep the first-fit order
+  pthread_mutex_unlock(&bm->lock);
+  return 0;
+}
+
+// reset a run of bits of a bitmap (holding the lock once)
+static void bitmap_reset_run(bitmap_t* bm, int start, int len)
+{
+  pthread_mutex_lock(&bm->lock);
+  if(bitmap_need(bm) < 0) len = 0;
+  for(int i=start; i<start+len; i++) {
+    bm->words[i/64] &= ~bitmap_word(1ULL << (63-i%64));
+    bitmap_touch(bm, i);
+  }
+  if(len > 0 && start/64 < bm->hint) bm->hint = start/64;
+  pthread_mutex_unlock(&bm->lock);
+}
+
+// allocate up to 'want' unused bits (holding the lock once) into
+// 'bits', in increasing order; return how many were allocated
+static int bitmap_alloc_some(bitmap_t* bm, int want, int* bits)
+{
+  int n = 0;
+  pthread_mutex_lock(&bm->lock);
+  STAT(bm->scans++);
+  for(int w=bitmap_need(bm) < 0 ? bm->nwords : bm->hint; w<bm->nwords && n<want; w++) {
+    STAT(bm->scanned++);
+    uint64_t free_bits;
+    while(n < want && (free_bits = ~bitmap_word(bm->words[w]))) {
+      int ibit = w*64+__builtin_clzll(free_bits);
+      if(ibit >= bm->nbits) break; // only padding bits are left
+      bm->words[w] |= bitmap_word(1ULL << (63-ibit%64));
+      bitmap_touch(bm, ibit);
+      bits[n++] = ibit;
+    }
+    if(n < want) bm->hint = w+1;
+  }
+  pthread_mutex_unlock(&bm->lock);
+  return n;
+}
+
+// each thread allocates inodes and sectors from a small cache of its
+// own, claimed from the global bitmaps in batches, so that creating
+// and appending files doesn't contend on the bitmap locks; the
+// claimed bits are set in the bitmaps, and the caches are given back
+// before the bitmaps are written (on sync) and when a thread exits,
+// so nothing leaks on disk; the caches are registered in a list, so
+// that they can all be drained on sync or when the disk runs out of
+// space, and forgotten at boot
+#define TCACHE_INODES 8   // inodes claimed at once
+#define TCACHE_SECTORS 64 // sectors claimed at once (in one run)
+
+typedef struct _tcache {
+  pthread_mutex_t lock;  // only contended when the caches are drained
+  int inode[TCACHE_INODES]; // claimed inodes, handed out in order
+  int first_inode, ninodes; // the unused ones: inode[first_inode...]
+  int start, length;     // a claimed run of sectors
+  struct _tcache* next;  // in the list of all caches
+} tcache_t;
+
+static __thread tcache_t* tcache; // the calling thread's cache
+static tcache_t* tcache_list;
+static pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER; // protects the list
+static pthread_key_t tcache_key;  // to release a cache when its thread exits
+static pthread_rwlock_t fs_lock;  // (defined with the entry points)
+
+// give back the inodes and sectors a cache holds (with its lock held)
+static void tcache_release(tcache_t* tc)
+{
+  for(int i=tc->first_inode; i<tc->first_inode+tc->ninodes; i++)
+    bitmap_reset(&inode_bitmap, tc->inode[i]);
+  tc->first_inode = tc->ninodes = 0;
+  bitmap_reset_run(&sector_bitmap, tc->start, tc->length);
+  tc->length = 0;
+}
+
+// give back what all caches hold; 'forget' drops it instead (when the
+// bitmaps are about to be loaded again)
+static void tcache_drain(int forget)
+{
+  pthread_mutex_lock(&tcache_lock);
+  for(tcache_t* tc=tcache_list; tc; tc=tc->next) {
+    pthread_mutex_lock(&tc->lock);
+    if(forget) tc->first_inode = tc->ninodes = tc->length = 0;
+    else tcache_release(tc);
+    pthread_mutex_unlock(&tc->lock);
+  }
+  pthread_mutex_unlock(&tcache_lock);
+}
+
+// the destructor of 'tcache_key': unregister and release a cache
+static void tcache_exit(void* p)
+{
+  tcache_t* tc = (tcache_t*)p;
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_mutex_lock(&tcache_lock);
+  tcache_t** link = &tcache_list;
+  while(*link != tc) link = &(*link)->next;
+  *link = tc->next;
+  pthread_mutex_unlock(&tcache_lock);
+  tcache_release(tc);
+  pthread_rwlock_unlock(&fs_lock);
+  pthread_mutex_destroy(&tc->lock);
+  pool_free(tc, sizeof(tcache_t));
+}
+
+// the calling thread's cache, locked; NULL if out of memory
+static tcache_t* tcache_enter()
+{
+  tcache_t* tc = tcache;
+  if(!tc) {
+    if(!(tc = pool_alloc(sizeof(tcache_t)))) return NULL;
+    memset(tc, 0, sizeof(tcache_t));
+    pthread_mutex_init(&tc->lock, NULL);
+    pthread_mutex_lock(&tcache_lock);
+    tc->next = tcache_list;
+    tcache_list = tc;
+    pthread_mutex_unlock(&tcache_lock);
+    pthread_setspecific(tcache_key, tc);
+    tcache = tc;
+  }
+  pthread_mutex_lock(&tc->lock);
+  return tc;
+}
+
+// allocate an inode; return -1 if the inode table is full
+static int alloc_inode()
+{
+  // with a journal, the logged inode bitmap mustn't claim the inodes
+  // cached by threads (namespace operations are serialized anyway)
+  if(fs_version >= FS_VERSION_JOURNAL) return bitmap_first_unused(&inode_bitmap);
+  tcache_t* tc = tcache_enter();
+  if(!tc) return bitmap_first_unused(&inode_bitmap);
+  if(!tc->ninodes) {
+    tc->first_inode = 0;
+    tc->ninodes = bitmap_alloc_some(&inode_bitmap, TCACHE_INODES, tc->inode);
+    __atomic_fetch_add(&alloc_stats.refills, 1, __ATOMIC_RELAXED);
+  }
+  int inode = -1;
+  if(tc->ninodes) {
+    inode = tc->inode[tc->first_inode++];
+    tc->ninodes--;
+  }
+  pthread_mutex_unlock(&tc->lock);
+  if(inode < 0) {
+    // the other threads may still hold a few
+    tcache_drain(0);
+    inode = bitmap_first_unused(&inode_bitmap);
+  }
+  return inode;
+}
+
+// allocate a run of up to 'want' sectors, starting at 'goal' if
+// possible (see bitmap_alloc_run()); the run comes from the thread's
+// cache if it starts there (or if there's no goal), which is the case
+// when a thread keeps appending to the same file; otherwise, the
+// cache is refilled with a run at least as large as the request
+static int alloc_sectors(int want, int goal, int* got)
+{
+  tcache_t* tc = tcache_enter();
+  if(!tc) return bitmap_alloc_run(&sector_bitmap, want, goal, got);
+  if(!tc->length || (goal >= 0 && goal != tc->start)) {
+    bitmap_reset_run(&sector_bitmap, tc->start, tc->length);
+    tc->start = bitmap_alloc_run(&sector_bitmap, want > TCACHE_SECTORS ? want : TCACHE_SECTORS,
+				 goal, &tc->length);
+    if(tc->start < 0) tc->length = 0;
+    __atomic_fetch_add(&alloc_stats.refills, 1, __ATOMIC_RELAXED);
+  }
+  int start = -1;
+  if(tc->length) {
+    start = tc->start;
+    *got = want < tc->length ? want : tc->length;
+    tc->start += *got;
+    tc->length -= *got;
+  }
+  pthread_mutex_unlock(&tc->lock);
+  if(start < 0) {
+    // the other threads may still hold a few
+    tcache_drain(0);
+    start = bitmap_alloc_run(&sector_bitmap, want, goal, got);
+  }
+  return start;
+}
+
+// add up to 'want' blocks at the end of an inode held through
+// iget() (files and directories only grow at the end); the new blocks
+// are a single run of sectors, placed right after the last block if
+// possible, so that sequential writes produce long extents; return
+// the number of blocks added, -1 if the disk is full (or there's an
+// error), or -2 if the inode can't describe any more blocks
+static int bmap_grow(inode_t* node, int want)
+{
+  int got, start;
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    int nblocks = bmap_nblocks(node);
+    if(nblocks >= MAX_SECTORS_PER_FILE) return -2;
+    if(want > MAX_SECTORS_PER_FILE-nblocks) want = MAX_SECTORS_PER_FILE-nblocks;
+    int goal = nblocks > 0 ? node->data[nblocks-1]+1 : -1;
+    if((start = alloc_sectors(want, goal, &got)) < 0) return -1;
+    for(int i=0; i<got; i++) node->data[nblocks+i] = start+i;
+    inode_dirty(node);
+    return got;
+  }
+
+  // the last extent grows if the allocated run follows it
+  extent_t* last = NULL;
+  char* indirect = NULL;
+  if(node->nextents > INODE_EXTENTS) {
+    if(!(indirect = bcache_get(node->indirect, 0))) return -1;
+    last = (extent_t*)indirect+(node->nextents-1-INODE_EXTENTS);
+  } else if(node->nextents > 0)
+    last = &node->extent[node->nextents-1];
+  int goal = last ? last->start+last->length : -1;
+  if((start = alloc_sectors(want, goal, &got)) < 0) {
+    if(indirect) bcache_put(indirect, 0);
+    return -1;
+  }
+  if(last && start == goal) {
+    last->length += got;
+    if(indirect) bcache_put(indirect, 1);
+    inode_dirty(node);
+    return got;
+  }
+  if(indirect) bcache_put(indirect, 0);
+
+  // otherwise, the run is a new extent; the indirect sector is
+  // allocated when the inode's own extents are used up
+  int err = 0;
+  if(node->nextents >= MAX_EXTENTS) err = -2;
+  else if(node->nextents == INODE_EXTENTS && !node->indirect) {
+    int sector = bitmap_first_unused(&sector_bitmap);
+    char* buf = sector >= 0 ? bcache_get(sector, BC_ZERO) : NULL;
+    if(buf) {
+      bcache_put(buf, 1);
+      node->indirect = sector;
+    } else {
+      if(sector >= 0) bitmap_reset(&sector_bitmap, sector);
+      err = -1;
+    }
+  }
+  extent_t ext = { start, got };
+  if(!err && node->nextents < INODE_EXTENTS)
+    node->extent[node->nextents] = ext;
+  else if(!err) {
+    if((indirect = bcache_get(node->indirect, 0))) {
+      ((extent_t*)indirect)[node->nextents-INODE_EXTENTS] = ext;
+      bcache_put(indirect, 1);
+    } else err = -1;
+  }
+  if(err) {
+    for(int i=start; i<start+got; i++) bitmap_reset(&sector_bitmap, i);
+    return err;
+  }
+  node->nextents++;
+  inode_dirty(node);
+  dprintf("... new extent %d at sectors %d-%d\n", node->nextents-1, start, start+got-1);
+  return got;
+}
+
+// release a sector of a file or directory; the cached copy of the
+// sector (if any) is of no use anymore
+static void bmap_release(int sector)
+{
+  bitmap_reset(&sector_bitmap, sector);
+  bcache_discard(sector);
+  journal_forget(sector);
+}
+
+// release all sectors used by an inode held through iget() (the
+// inode itself is left as it is); return 0 if successful, -1
+// otherwise
+static int bmap_free(inode_t* node)
+{
+  if(node->type == INLINE_FILE) return 0;
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    for(int i=0; i<MAX_SECTORS_PER_FILE; i++)
+      if(node->data[i]) bmap_release(node->data[i]);
+    return 0;
+  }
+  char* indirect = NULL;
+  if(node->nextents > INODE_EXTENTS && !(indirect = bcache_get(node->indirect, 0)))
+    return -1;
+  for(int i=0; i<node->nextents; i++) {
+    extent_t* ext = i < INODE_EXTENTS ? &node->extent[i] :
+      (extent_t*)indirect+(i-INODE_EXTENTS);
+    for(int j=0; j<ext->length; j++) bmap_release(ext->start+j);
+  }
+  if(indirect) bcache_put(indirect, 0);
+  if(node->indirect) bmap_release(node->indirect);
+  return 0;
+}
+
+// release the last block of an inode held through iget(); return 0
+// if successful, -1 otherwise
+static int bmap_shrink(inode_t* node)
+{
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    int nblocks = bmap_nblocks(node);
+    if(nblocks == 0) return 0;
+    bmap_release(node->data[nblocks-1]);
+    node->data[nblocks-1] = 0;
+    inode_dirty(node);
+    return 0;
+  }
+  if(node->nextents == 0) return 0;
+  extent_t* last;
+  char* indirect = NULL;
+  if(node->nextents > INODE_EXTENTS) {
+    if(!(indirect = bcache_get(node->indirect, 0))) return -1;
+    last = (extent_t*)indirect+(node->nextents-1-INODE_EXTENTS);
+  } else
+    last = &node->extent[node->nextents-1];
+  bmap_release(last->start+last->length-1);
+  if(--last->length == 0) {
+    last->start = 0;
+    node->nextents--;
+  }
+  if(indirect) bcache_put(indirect, 1);
+  // the indirect sector goes once the inode's own extents suffice
+  if(node->nextents <= INODE_EXTENTS && node->indirect) {
+    bmap_release(node->indirect);
+    node->indirect = 0;
+  }
+  inode_dirty(node);
+  return 0;
+}
+
+// the codec of compressed files is of the LZ4 kind (byte oriented,
+// with no entropy coding, so that it's about as fast as copying): the
+// compressed form is a series of sequences, each made of a token byte
+// (the number of literals in the high nibble, the length of the match
+// less LZ_MIN_MATCH in the low one, 15 meaning that more length bytes
+// follow), the literals, and the match as a two-byte offset back into
+// the output; the last sequence only has literals
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static inline unsigned lz_hash(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+// the bytes of a length beyond what its nibble holds
+static unsigned char* lz_length(unsigned char* op, int len)
+{
+  for(; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+// compress 'n' bytes (at most 64K) into 'out'; return the size of the
+// compressed form, or 0 if it doesn't fit in 'cap' bytes
+static int lz_compress(const char* in, int n, char* out, int cap)
+{
+  uint16_t table[1 << LZ_HASH_BITS]; // one past the last position of each hash
+  memset(table, 0, sizeof(table));
+  const unsigned char *base = (const unsigned char*)in, *ip = base, *anchor = base;
+  const unsigned char *iend = base+n;
+  unsigned char *op = (unsigned char*)out, *oend = op+cap;
+  while(iend-ip >= LZ_MIN_MATCH) {
+    unsigned h = lz_hash(ip);
+    const unsigned char* ref = base+table[h]-1;
+    table[h] = ip-base+1;
+    if(ref < base || memcmp(ref, ip, LZ_MIN_MATCH)) {
+      ip++;
+      continue;
+    }
+    int len = LZ_MIN_MATCH;
+    while(ip+len < iend && ref[len] == ip[len]) len++;
+    int lit = ip-anchor;
+    if(op+1+lit/255+1+lit+2+(len-LZ_MIN_MATCH)/255+1 > oend) return 0;
+    unsigned char* token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15) op = lz_length(op, lit-15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    int offset = ip-ref;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    int ml = len-LZ_MIN_MATCH;
+    *token |= ml < 15 ? ml : 15;
+    if(ml >= 15) op = lz_length(op, ml-15);
+    ip += len;
+    anchor = ip;
+  }
+  int lit = iend-anchor;
+  if(op+1+lit/255+1+lit > oend) return 0;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if(lit >= 15) op = lz_length(op, lit-15);
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op-(unsigned char*)out;
+}
+
+// decompress 'n' bytes into 'out'; return the size of the content, or
+// -1 if the compressed form is corrupt (or holds more than 'cap' bytes)
+static int lz_decompress(const char* in, int n, char* out, int cap)
+{
+  const unsigned char *ip = (const unsigned char*)in, *iend = ip+n;
+  unsigned char *op = (unsigned char*)out, *oend = op+cap;
+  while(ip < iend) {
+    int token = *ip++;
+    int lit = token >> 4, len = token & 15, b;
+    if(lit == 15)
+      do { if(ip == iend) return -1; lit += b = *ip++; } while(b == 255);
+    if(lit > iend-ip || lit > oend-op) return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if(ip == iend) break; // the last sequence
+    if(iend-ip < 2) return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if(len == 15)
+      do { if(ip == iend) return -1; len += b = *ip++; } while(b == 255);
+    len += LZ_MIN_MATCH;
+    if(offset == 0 || offset > op-(unsigned char*)out || len > oend-op) return -1;
+    const unsigned char* ref = op-offset;
+    if(offset >= len) memcpy(op, ref, len);
+    else for(int i=0; i<len; i++) op[i] = ref[i]; // the match overlaps what it repeats
+    op += len;
+  }
+  return op-(unsigned char*)out;
+}
+
+// the number of blocks taken by a chunk storing 'stored' bytes
+static inline int chunk_blocks(int stored)
+{
+  return (sizeof(chunk_header_t)+stored+sector_size-1)/sector_size;
+}
+
+// make room in a chunk index for the first block of chunk 'c'; return
+// 0 if successful, -1 if out of memory
+static int cindex_grow(cindex_t* ix, int c)
+{
+  if(c < ix->capacity) return 0;
+  int capacity = ix->capacity ? 2*ix->capacity : 16;
+  while(capacity <= c) capacity *= 2;
+  int* first = pool_alloc(capacity*sizeof(int));
+  if(!first) return -1;
+  if(ix->first) {
+    memcpy(first, ix->first, ix->capacity*sizeof(int));
+    pool_free(ix->first, ix->capacity*sizeof(int));
+  }
+  ix->first = first;
+  ix->capacity = capacity;
+  return 0;
+}
+
+// read the header of the chunk starting at the given block of a
+// compressed file; return 0 if successful, -1 otherwise (or if the
+// header makes no sense)
+static int chunk_header(inode_t* node, int block, chunk_header_t* h)
+{
+  int sector = bmap(node, block, NULL);
+  char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+  if(!buf) return -1;
+  memcpy(h, buf, sizeof(chunk_header_t));
+  bcache_put(buf, 0);
+  if(h->size <= 0 || h->size > CHUNK_SIZE || h->stored <= 0 || h->stored > h->size) {
+    dprintf("... bad chunk header at block %d\n", block);
+    return -1;
+  }
+  return 0;
+}
+
+// build the chunk index of a compressed file held through iget()
+static cindex_t* cindex_build(inode_t* node)
+{
+  cindex_t* ix = pool_alloc(sizeof(cindex_t));
+  if(!ix) return NULL;
+  memset(ix, 0, sizeof(cindex_t));
+  int n = (node->size+CHUNK_SIZE-1)/CHUNK_SIZE, block = 0;
+  for(int c=0; c<=n; c++) {
+    chunk_header_t h;
+    if(cindex_grow(ix, c) < 0 || (c < n && chunk_header(node, block, &h) < 0)) {
+      cindex_free(ix);
+      return NULL;
+    }
+    ix->first[c] = block;
+    if(c < n) block += chunk_blocks(h.stored);
+  }
+  ix->nchunks = n;
+  dprintf("... built chunk index of inode %d (%d chunks, %d blocks)\n",
+	  icache_entry(node)->inum, n, block);
+  return ix;
+}
+
+// the reads of different threads may need a file's chunk index at the
+// same time; only one of them builds it
+static pthread_mutex_t cindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// return the chunk index of a compressed file held through iget(),
+// building it if this is the first access; return NULL if there's an
+// error
+static cindex_t* file_chunks(inode_t* node)
+{
+  icache_entry_t* e = icache_entry(node);
+  cindex_t* ix = __atomic_load_n(&e->cindex, __ATOMIC_ACQUIRE);
+  if(ix) return ix;
+  pthread_mutex_lock(&cindex_lock);
+  if(!(ix = e->cindex) && (ix = cindex_build(node)))
+    __atomic_store_n(&e->cindex, ix, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cindex_lock);
+  return ix;
+}
+
+// forget the chunk index of a file (when it no longer matches the
+// blocks, which are then read again)
+static void cindex_drop(inode_t* node)
+{
+  icache_entry_t* e = icache_entry(node);
+  cindex_free(e->cindex);
+  e->cindex = NULL;
+}
+
+// read chunk 'c' of a compressed file into 'out' (CHUNK_SIZE bytes),
+// using 'packed' (CHUNK_MAX_BLOCKS blocks) for the stored form; return
+// the number of bytes of the chunk, or -1 if there's an error
+static int chunk_read(inode_t* node, cindex_t* ix, int c, char* packed, char* out)
+{
+  int block = ix->first[c], nblocks = ix->first[c+1]-block;
+  bmap_prefetch(node, block, nblocks);
+  for(int i=0; i<nblocks; i++) {
+    int sector = bmap(node, block+i, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+    if(!buf) return -1;
+    memcpy(packed+i*sector_size, buf, sector_size);
+    bcache_put(buf, 0);
+  }
+  chunk_header_t* h = (chunk_header_t*)packed;
+  if(h->size > CHUNK_SIZE || chunk_blocks(h->stored) != nblocks) return -1;
+  if(h->stored == h->size) {
+    memcpy(out, packed+sizeof(chunk_header_t), h->size);
+    return h->size;
+  }
+  if(lz_decompress(packed+sizeof(chunk_header_t), h->stored, out, CHUNK_SIZE) != h->size) {
+    dprintf("... chunk %d of inode %d is corrupt\n", c, icache_entry(node)->inum);
+    return -1;
+  }
+  return h->size;
+}
+
+// put 'size' bytes of a chunk in their stored form into 'packed'
+// (kept as they are if they don't compress); return the number of
+// blocks it takes
+static int chunk_pack(const char* data, int size, char* packed)
+{
+  chunk_header_t* h = (chunk_header_t*)packed;
+  char* body = packed+sizeof(chunk_header_t);
+  h->size = size;
+  h->stored = lz_compress(data, size, body, size-1);
+  if(h->stored == 0) {
+    memcpy(body, data, size);
+    h->stored = size;
+  }
+  int nblocks = chunk_blocks(h->stored);
+  memset(body+h->stored, 0, nblocks*sector_size-sizeof(chunk_header_t)-h->stored);
+  return nblocks;
+}
+
+// copy block 'from' of a file to block 'to' (both allocated)
+static int block_copy(inode_t* node, int from, int to)
+{
+  int src = bmap(node, from, NULL), dst = bmap(node, to, NULL);
+  char* in = src > 0 ? bcache_get(src, 0) : NULL;
+  if(!in) return -1;
+  char* out = dst > 0 ? bcache_get(dst, BC_ZERO) : NULL;
+  if(out) {
+    memcpy(out, in, sector_size);
+    bcache_put(out, 1);
+  }
+  bcache_put(in, 0);
+  return out ? 0 : -1;
+}
+
+// make chunk 'c' of a compressed file take 'd' more (or fewer) blocks,
+// moving the blocks of the chunks after it; return 0 if successful,
+// -1 with osErrno set otherwise (if the file can't grow, nothing has
+// changed)
+static int chunk_resize(inode_t* node, cindex_t* ix, int c, int d)
+{
+  int from = ix->first[c+1], end = ix->first[ix->nchunks];
+  if(d > 0) {
+    for(int got = 0; got < d; ) {
+      int r = bmap_grow(node, d-got);
+      if(r < 0) {
+	while(got-- > 0) bmap_shrink(node);
+	osErrno = (r == -2) ? E_FILE_TOO_BIG : E_NO_SPACE;
+	return -1;
+      }
+      got += r;
+    }
+  }
+  int err = 0;
+  if(d > 0)
+    for(int b=end-1; b>=from && !err; b--) err = block_copy(node, b, b+d);
+  else {
+    for(int b=from; b<end && !err; b++) err = block_copy(node, b, b+d);
+    for(int i=0; i<-d && !err; i++) err = bmap_shrink(node);
+  }
+  if(err) {
+    // the blocks no longer match the index
+    cindex_drop(node);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  for(int j=c+1; j<=ix->nchunks; j++) ix->first[j] += d;
+  return 0;
+}
+
+// write the stored form of chunk 'c' (which has the blocks it needs)
+static int chunk_store(inode_t* node, cindex_t* ix, int c, const char* packed)
+{
+  int block = ix->first[c], nblocks = ix->first[c+1]-block;
+  for(int i=0; i<nblocks; i++) {
+    int sector = bmap(node, block+i, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, BC_ZERO) : NULL;
+    if(!buf) return -1;
+    memcpy(buf, packed+i*sector_size, sector_size);
+    bcache_put(buf, 1);
+  }
+  return 0;
+}
+
+// return 1 if the file name is illegal; otherwise, return 0; legal
+// characters for a file name include letters (case sensitive),
+// numbers, dots, dashes, and underscores; and a legal file name
+// should not be more than MAX_NAME-1 in length
+static int illegal_filename(char* name)
+{
+  /* YOUR CODE */
+  int len = strlen(name);
+  //dprintf("Size is %d\n",len); 
+  //dprintf("value is %s\n",name);
+  if(len > MAX_NAME - 1){
+    dprintf("Name is too big\n");
+    return 1;
+  }
+  for(int i = 0; i<len;i++){
+    if(!(isdigit(name[i]) || isalpha(name[i]) || name[i] == '.' || name[i] == '-' || name[i] == '_')){
+      dprintf("name contains illegal charecter\n");
+      return 1;
+    }
+  }
+  
+  return 0; 
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the function returns -1 if no such file is found; it
+// returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char* fname)
+{
+  inode_t* parent = iget(parent_inode);
+  if(!parent) return -2;
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+	 parent_inode, parent->size, parent->type);
+  if(parent->type != 1) {
+    dprintf("... parent not a directory\n");
+    iput(parent, 0);
+    return -2;
+  }
+
+  // look up the name in the directory's name index
+  int child_inode = -1; // not found
+  dindex_t* ix = dir_index(parent);
+  if(!ix) child_inode = -2;
+  else {
+    dindex_slot_t* s = dindex_find(ix, fname);
+    if(s) {
+      child_inode = s->inode;
+      dprintf("... found child_inode=%d\n", child_inode);
+    }
+  }
+  iput(parent, 0);
+  if(child_inode == -1) dprintf("... could not find child inode\n");
+  return child_inode;
+}
+
+// the dentry cache remembers the outcome of recent path resolutions,
+// keyed by the full path string: the parent directory's inode, the
+// last name in the path, and the inode of that name, which may be -1
+// for a name that doesn't exist (a negative entry), so that checking
+// before a create is cheap as well; each entry is also chained by
+// its (parent inode, name) pair, so that add_inode() and
+// remove_inode() can update exactly the entries that depend on the
+// name they change; the entries are recycled in LRU order; since even
+// a lookup reorders the LRU list, every access takes 'dcache_lock'
+#define DCACHE_SIZE 512
+#define DCACHE_BUCKETS 1024 // must be a power of two
+
+typedef struct _dentry {
+  char path[MAX_PATH];  // the full path as given (empty if the entry is free)
+  char fname[MAX_NAME]; // the last name in the path
+  int parent;           // inode of the parent directory
+  int child;            // inode of the last name (-1 if it doesn't exist)
+  struct _dentry* next_path; // next entry in the same path bucket
+  struct _dentry* next_name; // next entry in the same (parent, name) bucket
+  struct _dentry* prev_lru;  // LRU list, most recently used first
+  struct _dentry* next_lru;
+} dentry_t;
+
+static dentry_t dcache[DCACHE_SIZE];
+static dentry_t* dcache_path_hash[DCACHE_BUCKETS];
+static dentry_t* dcache_name_hash[DCACHE_BUCKETS];
+static dentry_t dcache_lru; // head of the LRU list
+#if FSSTATS
+static long dcache_hits, dcache_misses; // for FS_GetStats()
+#endif
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned dcache_path_bucket(const char* path)
+{
+  unsigned h = 2166136261u;
+  while(*path) h = (h^(unsigned char)*path++)*16777619u;
+  return h & (DCACHE_BUCKETS-1);
+}
+
+static inline unsigned dcache_name_bucket(int parent, const char* fname)
+{
+  return (dindex_hash(fname)^(parent*2654435761u)) & (DCACHE_BUCKETS-1);
+}
+
+static void dcache_lru_unlink(dentry_t* d)
+{
+  d->prev_lru->next_lru = d->next_lru;
+  d->next_lru->prev_lru = d->prev_lru;
+}
+
+static void dcache_lru_push(dentry_t* d)
+{
+  d->next_lru = dcache_lru.next_lru;
+  d->prev_lru = &dcache_lru;
+  dcache_lru.next_lru->prev_lru = d;
+  dcache_lru.next_lru = d;
+}
+
+// unlink an entry from both hash chains and mark it free
+static void dcache_drop(dentry_t* d)
+{
+  if(!d->path[0]) return;
+  dentry_t** pp = &dcache_path_hash[dcache_path_bucket(d->path)];
+  while(*pp != d) pp = &(*pp)->next_path;
+  *pp = d->next_path;
+  pp = &dcache_name_hash[dcache_name_bucket(d->parent, d->fname)];
+  while(*pp != d) pp = &(*pp)->next_name;
+  *pp = d->next_name;
+  d->path[0] = '\0';
+}
+
+// look up a path and copy out what's remembered about it (the last
+// name only if 'fname' isn't NULL); return 1 if it's cached, 0 if not
+static int dcache_lookup(const char* path, int* parent, int* child, char* fname)
+{
+  pthread_mutex_lock(&dcache_lock);
+  for(dentry_t* d = dcache_path_hash[dcache_path_bucket(path)]; d; d = d->next_path) {
+    if(!strcmp(d->path, path)) {
+      dcache_lru_unlink(d);
+      dcache_lru_push(d);
+      *parent = d->parent;
+      *child = d->child;
+      if(fname) strcpy(fname, d->fname);
+      STAT(dcache_hits++);
+      pthread_mutex_unlock(&dcache_lock);
+      return 1;
+    }
+  }
+  STAT(dcache_misses++);
+  pthread_mutex_unlock(&dcache_lock);
+  return 0;
+}
+
+// remember the outcome of resolving a path, recycling the least
+// recently used entry
+static void dcache_insert(const char* path, int parent, const char* fname, int child)
+{
+  pthread_mutex_lock(&dcache_lock);
+  dentry_t* d = dcache_lru.prev_lru;
+  dcache_drop(d);
+  strcpy(d->path, path);
+  name_copy(d->fname, fname);
+  d->parent = parent;
+  d->child = child;
+  unsigned h = dcache_path_bucket(path);
+  d->next_path = dcache_path_hash[h];
+  dcache_path_hash[h] = d;
+  h = dcache_name_bucket(parent, fname);
+  d->next_name = dcache_name_hash[h];
+  dcache_name_hash[h] = d;
+  dcache_lru_unlink(d);
+  dcache_lru_push(d);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+// the name in the parent directory now refers to 'child' (-1 if the
+// name has been removed); update all paths that end with it
+static void dcache_update(int parent, const char* fname, int child)
+{
+  pthread_mutex_lock(&dcache_lock);
+  for(dentry_t* d = dcache_name_hash[dcache_name_bucket(parent, fname)]; d; d = d->next_name)
+    if(d->parent == parent && !strncmp(d->fname, fname, MAX_NAME)) d->child = child;
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+// a directory has been removed; drop all paths resolved through it
+// (since the directory must be empty, these can only be negative
+// entries, but its inode may be reused by a new directory)
+static void dcache_purge_dir(int dir)
+{
+  pthread_mutex_lock(&dcache_lock);
+  for(int i=0; i<DCACHE_SIZE; i++)
+    if(dcache[i].path[0] && dcache[i].parent == dir) dcache_drop(&dcache[i]);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+// empty the dentry cache (at boot time)
+static void dcache_reset()
+{
+  memset(dcache_path_hash, 0, sizeof(dcache_path_hash));
+  memset(dcache_name_hash, 0, sizeof(dcache_name_hash));
+  dcache_lru.next_lru = dcache_lru.prev_lru = &dcache_lru;
+  for(int i=0; i<DCACHE_SIZE; i++) {
+    dcache[i].path[0] = '\0';
+    dcache_lru_push(&dcache[i]);
+  }
+}
+
+// walk the absolute path from the root; see follow_path() below
+static int walk_path(char* path, int* last_inode, char* last_fname)
+{
+  if(!path) {
+    dprintf("... invalid path\n");
+    return -1;
+  }
+  if(path[0] != '/') {
+    dprintf("... '%s' not absolute path\n", path);
+    return -1;
+  }
+  
+  // make a copy of the path (skip leading '/'); this is necessary
+  // since the path is going to be modified by strsep()
+  char pathstore[MAX_PATH]; 
+  strncpy(pathstore, path+1, MAX_PATH-1);
+  pathstore[MAX_PATH-1] = '\0'; // for safety
+  char* lpath = pathstore;
+  
+  int parent_inode = -1, child_inode = 0; // start from root
+  
+  // for each file/directory name separated by '/'
+  char* token;
+  while((token = strsep(&lpath, "/")) != NULL) {
+    dprintf("... process token: '%s'\n", token);
+    if(*token == '\0') continue; // multiple '/' ignored
+    if(illegal_filename(token)) {
+      dprintf("... illegal file name: '%s'\n", token);
+      return -1; 
+    }
+    if(child_inode < 0) {
+      // regardless whether child_inode was not found previously, or
+      // there was issues related to the parent (say, not a
+      // directory), or there was a read error, we abort
+      dprintf("... parent inode can't be established\n");
+      return -1;
+    }
+    parent_inode = child_inode;
+    child_inode = find_child_inode(parent_inode, token);
+    if(last_fname) strcpy(last_fname, token);
+  }
+  if(child_inode < -1) return -1; // if there was error, abort
+  else {
+    // there was no error, several possibilities:
+    // 1) '/': parent = -1, child = 0
+    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
+    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
+    // in the first case, we set parent=child=0 as special case
+    if(parent_inode==-1 && child_inode==0) parent_inode = 0;
+    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+    *last_inode = child_inode;
+    return parent_inode;
+  }
+}
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
+// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
+// the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_fname' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path; paths that have been
+// resolved before are answered from the dentry cache
+static int follow_path(char* path, int* last_inode, char* last_fname)
+{
+  int parent;
+  if(path && strlen(path) < MAX_PATH && dcache_lookup(path, &parent, last_inode, last_fname)) {
+    dprintf("... dentry cache hit: parent_inode=%d, child_inode=%d\n", parent, *last_inode);
+    return parent;
+  }
+
+  char fname[MAX_NAME] = "";
+  int parent_inode = walk_path(path, last_inode, fname);
+  if(last_fname && fname[0]) strcpy(last_fname, fname);
+  // only paths that name something in a directory are remembered
+  // (and not '/' itself, or paths that can't be followed)
+  if(parent_inode >= 0 && fname[0] && strlen(path) < MAX_PATH)
+    dcache_insert(path, parent_inode, fname, *last_inode);
+  return parent_inode;
+}
+
+// allocate 'n' inodes into 'inums'; return how many were allocated
+// (a single one comes through the thread's cache, a batch at once
+// from the bitmap)
+static int alloc_inodes(int* inums, int n)
+{
+  if(n == 1) return (inums[0] = alloc_inode()) >= 0;
+  return bitmap_alloc_some(&inode_bitmap, n, inums);
+}
+
+// add new files or directories (determined by 'type') of the given
+// names under the parent directory represented by 'parent_inode'; the
+// parent is loaded once, the inodes are allocated in batches, and
+// each dirent sector is updated once for all the entries going into
+// it; the names must be legal; return the number of entries added
+// (stopping at the first name that already exists, or at an error),
+// -1 if none could be, or -2 if the parent isn't a directory
+static int add_inodes(int type, int parent_inode, char** names, int n)
+{
+  // get the parent inode
+  inode_t* parent = iget(parent_inode);
+  if(!parent) return -1;
+  dprintf("... get parent inode %d (size=%d, type=%d)\n",
+	 parent_inode, parent->size, parent->type);
+  if(parent->type != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    iput(parent, 0);
+    return -2; // parent not directory
+  }
+  // the name index tells whether a name in the batch is there
+  // already, and where the empty dirents are
+  dindex_t* ix = dir_index(parent);
+
+  int inums[64], ninums = 0, next = 0;
+  int added = 0, group = -1, sector = 0;
+  char* dirent_buffer = NULL;
+  for(; added < n; added++) {
+    char* file = names[added];
+    if(!ix && !(ix = dir_index(parent))) break;
+    if(dindex_find(ix, file)) {
+      dprintf("... '%s' already exists\n", file);
+      break;
+    }
+
+    // get a new inode for child
+    if(next == ninums) {
+      next = 0;
+      ninums = alloc_inodes(inums, n-added < 64 ? n-added : 64);
+      if(!ninums) {
+	dprintf("... error: inode table is full\n");
+	break;
+      }
+    }
+    int child_inode = inums[next];
+    dprintf("... new child inode %d\n", child_inode);
+
+    // take an empty dirent, or a new dirent sector if there's none
+    int slot = dindex_hole_pop(ix), grow = (slot < 0);
+    if(grow) {
+      int nblocks = bmap_nblocks(parent);
+      if(nblocks < 0) break;
+      slot = nblocks*DIRENTS_PER_SECTOR;
+    }
+    int g = slot/DIRENTS_PER_SECTOR;
+    if(g != group) {
+      if(dirent_buffer) bcache_put(dirent_buffer, 1);
+      dirent_buffer = NULL;
+      group = g;
+      if(grow) {
+	// new disk sector is needed
+	sector = bmap_grow(parent, 1) > 0 ? bmap(parent, group, NULL) : -1;
+	if(sector <= 0) {
+	  dprintf("... error: disk (or directory) is full\n");
+	  break;
+	}
+	dirent_buffer = bcache_get(sector, BC_ZERO);
+	dprintf("... new disk sector %d for dirent group %d\n", sector, group);
+      } else if((sector = bmap(parent, group, NULL)) > 0) {
+	dirent_buffer = bcache_get(sector, 0);
+	dprintf("... load disk sector %d for dirent group %d\n", sector, group);
+      }
+      if(!dirent_buffer) {
+	if(!grow) dindex_hole_push(ix, slot);
+	break;
+      }
+    }
+    // the rest of a new sector is empty (the first holes on top)
+    for(int k=DIRENTS_PER_SECTOR-1; grow && ix && k>0; k--)
+      if(dindex_hole_push(ix, slot+k) < 0) {
+	// those holes will be found when the index is rebuilt
+	dindex_free(ix);
+	icache_entry(parent)->dindex = ix = NULL;
+      }
+
+    // get the child inode from the in-core inode table and update it
+    inode_t* child = iget(child_inode);
+    if(!child) {
+      if(ix) dindex_hole_push(ix, slot);
+      break;
+    }
+    memset(child, 0, sizeof(inode_t));
+    child->type = type;
+    if(type == 0 && compress_files) child->type = COMPRESSED_FILE;
+    else if(type == 0 && fs_version >= FS_VERSION_INLINE) child->type = INLINE_FILE;
+    dprintf("... update child inode %d (size=%d, type=%d)\n",
+	   child_inode, child->size, child->type);
+    iput(child, 1);
+    next++;
+
+    // add the dirent (and to the parent's name index)
+    dirent_t* dirent = (dirent_t*)dirent_buffer+slot%DIRENTS_PER_SECTOR;
+    name_copy(dirent->fname, file);
+    dirent->inode = child_inode;
+    dcache_update(parent_inode, file, child_inode);
+    if(ix && dindex_insert(ix, file, child_inode, slot) < 0) {
+      // can't keep the index up to date; it will be rebuilt when needed
+      dindex_free(ix);
+      icache_entry(parent)->dindex = ix = NULL;
+    }
+    dprintf("... add dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
+	    slot, dirent->fname, dirent->inode, group, sector);
+
+    // update parent inode
+    parent->size++;
+  }
+  if(dirent_buffer) bcache_put(dirent_buffer, 1);
+  iput(parent, 1);
+  dprintf("... update parent inode %d\n", parent_inode);
+
+  // the inodes allocated but not used go back
+  for(; next<ninums; next++) bitmap_reset(&inode_bitmap, inums[next]);
+  return added > 0 ? added : -1;
+}
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'
+int add_inode(int type, int parent_inode, char* file)
+{
+  int ret = add_inodes(type, parent_inode, &file, 1);
+  return ret == 1 ? 0 : ret;
+}
+
+int delete_helper(int type, char *pathname);
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, char* pathname)
+{
+  int child_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(pathname, &child_inode, last_fname);
+  dprintf("the paren_inode is %d\n",parent_inode);
+  if(parent_inode >= 0) {
+    if(child_inode >= 0) {
+      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
+      osErrno = E_CREATE;
+      return -1;
+    } else {
+      if(add_inode(type, parent_inode, last_fname) >= 0) {
+	dprintf("... successfully created file/directory: '%s'\n", pathname);
+	return 0;
+      } else {
+	dprintf("... error: something wrong with adding child inode\n");
+	osErrno = E_CREATE;
+	return -1;
+      }
+    }
+  } else {
+    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
+    osErrno = E_CREATE;
+    return -1;
+  }
+}
+
+// release the empty dirent sectors at the end of a directory held
+// through iget(), so that it takes no more sectors than its last
+// entry needs (the holes in them are forgotten)
+static void dir_shrink(inode_t* dir)
+{
+  int nblocks = bmap_nblocks(dir), released = 0;
+  while(nblocks > 0) {
+    int sector = bmap(dir, nblocks-1, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+    if(!buf) break;
+    int k = 0;
+    while(k < DIRENTS_PER_SECTOR && !((dirent_t*)buf)[k].fname[0]) k++;
+    bcache_put(buf, 0);
+    if(k < DIRENTS_PER_SECTOR || bmap_shrink(dir) < 0) break;
+    dprintf("... release dirent group %d (disk sector %d)\n", nblocks-1, sector);
+    nblocks--;
+    released++;
+  }
+  dindex_t* ix = icache_entry(dir)->dindex;
+  if(released && ix) dindex_hole_trim(ix, nblocks*DIRENTS_PER_SECTOR);
+}
+
+// remove the child (named 'fname') from parent; the function is
+// called by both File_Unlink() and Dir_Unlink(); the function returns
+// 0 if success, -1 if general error, -2 if directory not empty, -3 if
+// wrong type
+int remove_inode(int type, int parent_inode, int child_inode, char* fname)
+{
+  dprintf("entering remove inode function\n");
+  //get child i_node
+  inode_t* childnode = iget(child_inode);
+  if(!childnode) return -1;
+
+  //check type validity (a compressed file is a file)
+  if ((childnode->type == 1) != (type == 1)) {
+    dprintf("...filetype not valid\n");
+    iput(childnode, 0);
+    return -3;
+  } 
+  // check for empty directory
+  else if (type == 1 && childnode->size != 0) {
+    dprintf("...directory not empty\n");
+    iput(childnode, 0);
+    return -2; 
+  }
+  dprintf("... validating type and if directory empty\n");
+
+  //remove data from child inode
+  dprintf("... deleting data of child node\n");
+  if (bmap_free(childnode) < 0) {
+    iput(childnode, 0);
+    return -1;
+  }
+  cindex_drop(childnode);
+  //remove child inode
+  bitmap_reset(&inode_bitmap, child_inode);
+  /* the in-core child inode is set to zero to clear the inode table
+     once it's written back */
+  memset(childnode,0,sizeof(inode_t));
+  iput(childnode, 1);
+  dprintf("... child inode is removed from i node table\n");
+
+  // the parent inode is loaded 
+  inode_t* parent = iget(parent_inode);
+  if(!parent) return -1;
+  dprintf("... get parent inode %d (size=%d, type=%d)\n",
+	  parent_inode, parent->size, parent->type);
+  
+  //parent inode needs to be a directory to remove the child inode from
+  if (parent->type != 1) { //this means parent inode is not type 1 & not a directory
+    dprintf("... error: parent inode is not directory\n"); 
+    iput(parent, 0);
+    return -2; // parent not directory
+  }
+
+  // find the child's dirent through the parent's name index
+  dindex_t* ix = dir_index(parent);
+  dindex_slot_t* s = ix ? dindex_find(ix, fname) : NULL;
+  if (!s || s->inode != child_inode) {
+    iput(parent, 0);
+    return -1;
+  }
+  int group = s->slot/DIRENTS_PER_SECTOR;
+  int sector = bmap(parent, group, NULL);
+  char* dirent_buffer = sector > 0 ? bcache_get(sector, 0) : NULL;
+  if (!dirent_buffer) {
+    iput(parent, 0);
+    return -1;
+  }
+  dprintf("... load disk sector %d for dirent group %d\n", sector, group);
+
+  // remove child dirent 
+  dirent_t *dirent = (dirent_t *)dirent_buffer + s->slot%DIRENTS_PER_SECTOR;
+  dprintf("... found match: dirent inode %d, child inode %d\n", dirent->inode, child_inode);
+  memset(dirent, 0, sizeof(dirent_t));//clearing the directory entry by setting to zero
+  bcache_put(dirent_buffer, 1);
+  int slot = s->slot;
+  dindex_remove(ix, s);
+  if(dindex_hole_push(ix, slot) < 0) {
+    // the index will be rebuilt when needed
+    dindex_free(ix);
+    icache_entry(parent)->dindex = NULL;
+  }
+  dcache_update(parent_inode, fname, -1);
+  if(type == 1) dcache_purge_dir(child_inode);
+  if(parent->size > 0){
+    parent->size--; // one less entry in the parent directory
+  }
+  // the dirent sectors left empty at the end are released
+  if(group == bmap_nblocks(parent)-1) dir_shrink(parent);
+  iput(parent, 1);
+  dprintf("... update parent inode %d\n", parent_inode);
+  return 0;
+}
+
+// representing an open file; the entries are padded to a cache line,
+// so that threads using different descriptors don't share one
+typedef struct _open_file {
+  int inode; // pointing to the inode of the file (0 means entry not used)
+  int size;  // file size cached here for convenience
+  int pos;   // read/write position
+  inode_t* node; // the in-core inode, held for as long as the file is open
+  int ra_pos;    // where the last read ended (a read from there is sequential)
+  int ra_window; // blocks to read ahead of a sequential read (0 for none)
+  int ra_end;    // the block after the last one read ahead
+  pthread_mutex_t lock; // serializes the calls using this descriptor
+} __attribute__((aligned(CACHE_LINE))) open_file_t;
+
+// the open file table, sized at boot; a descriptor is claimed by
+// atomically clearing its bit in 'fd_free', and the number of
+// descriptors open on each inode is kept in 'open_count', so that
+// neither opening nor unlinking a file needs to scan the table (or to
+// lock it)
+static open_file_t* open_files;
+static int max_open_files;    // the number of entries
+static uint64_t* fd_free;     // one bit per descriptor, set if it's free
+static int fd_words;          // the number of words in 'fd_free'
+static int* open_count;       // open descriptors of each inode (see geometry_setup())
+static int open_count_files;  // the number of entries
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode)
+{
+  return __atomic_load_n(&open_count[inode], __ATOMIC_ACQUIRE) > 0;
+}
+
+// forget all open files and make the table hold 'n' entries (at boot
+// time); return 0 if successful, -1 if out of memory
+static int open_files_setup(int n)
+{
+  if(n <= 0) n = MAX_OPEN_FILES;
+  if(n != max_open_files) {
+    for(int i=0; i<max_open_files; i++)
+      pthread_mutex_destroy(&open_files[i].lock);
+    free(open_files);
+    free(fd_free);
+    fd_words = (n+63)/64;
+    open_files = fs_aligned_alloc(CACHE_LINE, n*sizeof(open_file_t));
+    fd_free = fs_aligned_alloc(CACHE_LINE, fd_words*sizeof(uint64_t));
+    if(!open_files || !fd_free) {
+      free(open_files);
+      free(fd_free);
+      open_files = NULL;
+      fd_free = NULL;
+      max_open_files = 0;
+      return -1;
+    }
+    max_open_files = n;
+    for(int i=0; i<n; i++)
+      pthread_mutex_init(&open_files[i].lock, NULL);
+  }
+  for(int i=0; i<n; i++) {
+    open_files[i].inode = open_files[i].size = open_files[i].pos = 0;
+    open_files[i].node = NULL;
+  }
+  for(int w=0; w<fd_words; w++)
+    fd_free[w] = w < n/64 ? ~0ULL : (1ULL << (n%64))-1;
+  return 0;
+}
+
+// return a new file descriptor not used; -1 if full
+int new_file_fd()
+{
+  for(int w=0; w<fd_words; w++) {
+    uint64_t bits = __atomic_load_n(&fd_free[w], __ATOMIC_RELAXED);
+    while(bits) {
+      uint64_t rest = bits & (bits-1); // claiming the lowest free one
+      if(__atomic_compare_exchange_n(&fd_free[w], &bits, rest, 1,
+				     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return w*64+__builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+// give back a file descriptor obtained from new_file_fd()
+static void free_file_fd(int fd)
+{
+  __atomic_fetch_or(&fd_free[fd/64], 1ULL << (fd%64), __ATOMIC_RELEASE);
+}
+
+// the directory streams; a stream holds the directory's inode, which
+// counts as open (so that the directory can't be removed meanwhile),
+// and a cursor: the position of the next dirent to look at
+#define MAX_DIR_STREAMS 64
+
+typedef struct _dir_stream {
+  int used;      // set while the stream is open
+  int inode;     // the directory's inode
+  int pos;       // the cursor
+  inode_t* node; // the in-core inode, held while the stream is open
+  pthread_mutex_t lock; // serializes the calls using this stream
+} dir_stream_t;
+
+static dir_stream_t dir_streams[MAX_DIR_STREAMS];
+
+// forget all directory streams (at boot time)
+static void dir_streams_reset()
+{
+  for(int i=0; i<MAX_DIR_STREAMS; i++) {
+    dir_streams[i].used = 0;
+    dir_streams[i].node = NULL;
+  }
+}
+
+// allocate the in-memory copies of the inode and sector bitmaps
+static int setup_bitmaps()
+{
+  tcache_drain(1); // what the threads hold belongs to the old bitmaps
+  if(arena_reset(BITMAP_ARENA_SIZE(INODE_BITMAP_SECTORS)+
+		 BITMAP_ARENA_SIZE(SECTOR_BITMAP_SECTORS)) < 0) return -1;
+  if(bitmap_setup(&inode_bitmap, INODE_BITMAP_START_SECTOR,
+		  INODE_BITMAP_SECTORS, max_files) < 0) return -1;
+  if(bitmap_setup(&sector_bitmap, SECTOR_BITMAP_START_SECTOR,
+		  SECTOR_BITMAP_SECTORS, total_sectors) < 0) return -1;
+  return 0;
+}
+
+// have both bitmaps loaded from disk when first used; the root inode
+// and the sectors before the data blocks are always marked as used,
+// even if an older image didn't get them right
+static void load_bitmaps()
+{
+  bitmap_load(&inode_bitmap, 1);
+  bitmap_load(&sector_bitmap, data_start_sector());
+}
+
+// the journal (version 3): each namespace operation is a transaction
+// that logs the images of the metadata sectors it changed (inode
+// table sectors, directory entry sectors, indirect sectors, and the
+// inode bitmap) to the journal, which is committed to the image file
+// right away, while the sectors themselves only reach it at the next
+// sync (the checkpoint, which empties the journal); the sector bitmap
+// isn't logged, since it's rebuilt from the inodes whenever a
+// transaction is replayed at boot; the journal starts with a header
+// sector, followed by the transactions, each one a descriptor sector
+// and the images of its sectors, with consecutive sequence numbers
+// and a checksum so that a torn transaction is ignored; operations
+// adding transactions at the same time share the write to the image
+// file (group commit): whoever finds no commit going on writes all the
+// transactions added so far, and the others wait for it
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_TXN_MAGIC 0x4a54584e
+
+typedef struct {
+  int magic;     // JOURNAL_MAGIC
+  int seq;       // sequence number of the first transaction
+} jheader_t;
+
+typedef struct {
+  int magic;     // JOURNAL_TXN_MAGIC
+  int seq;       // sequence number of the transaction
+  int count;     // number of sector images following
+  unsigned checksum; // of the descriptor (with a zero checksum) and the images
+  int sector[JTXN_SECTORS]; // where the images belong
+} jdesc_t;
+
+_Static_assert(sizeof(jdesc_t) <= SECTOR_SIZE, "journal descriptor too large");
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t committed; // signaled whenever a commit is done
+  int head;       // the journal sector after the last transaction
+  int flushed;    // the journal sectors before it are in the image file
+  int seq;        // the last transaction added
+  int durable;    // the last transaction in the image file
+  int committing; // set while a commit is writing to the image file
+} journal = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static jtxn_t journal_txn;   // the transaction being built (under the namespace lock)
+static char journal_buf[(1+JTXN_SECTORS)*MAX_SECTOR_SIZE]; // its descriptor and images
+
+static unsigned journal_checksum(const char* data, int len, unsigned h)
+{
+  for(int i=0; i<len; i++) h = (h^(unsigned char)data[i])*16777619u;
+  return h;
+}
+
+// the current image of a changed metadata sector: the inode table
+// sectors get the in-core inodes (which are newer), taken under their
+// locks since regular files may be written meanwhile, and the inode
+// bitmap comes from memory (it's only written on sync); return 0 if
+// successful, -1 otherwise
+static int journal_image(int sector, char* image)
+{
+  if(sector >= INODE_BITMAP_START_SECTOR && sector < INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS) {
+    pthread_mutex_lock(&inode_bitmap.lock);
+    int ret = bitmap_need(&inode_bitmap);
+    if(ret == 0)
+      memcpy(image, (char*)inode_bitmap.words+(sector-INODE_BITMAP_START_SECTOR)*sector_size, sector_size);
+    pthread_mutex_unlock(&inode_bitmap.lock);
+    return ret;
+  }
+  char* buf = bcache_get(sector, 0);
+  if(!buf) return -1;
+  memcpy(image, buf, sector_size);
+  bcache_put(buf, 0);
+  if(sector >= INODE_TABLE_START_SECTOR && sector < INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS) {
+    int first = (sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+    for(int inum=first; inum<first+INODES_PER_SECTOR && inum<max_files; inum++) {
+      inode_t* node = icache_peek(inum);
+      if(!node) continue;
+      inode_rdlock(node);
+      memcpy(image+inode_offset(inum), node, sizeof(inode_t));
+      inode_unlock(node);
+      iput(node, 0);
+    }
+  }
+  return 0;
+}
+
+// start a transaction for the namespace operation about to run (with
+// the namespace lock held exclusively)
+static void journal_begin()
+{
+  if(fs_version < FS_VERSION_JOURNAL) return;
+  journal_txn.n = journal_txn.overflow = 0;
+  txn = &journal_txn;
+}
+
+// end the transaction and add it to the journal (still with the
+// namespace lock held); return its sequence number, 0 if there was
+// nothing to log, or -1 if it couldn't be logged (the journal is full
+// or the transaction too large), in which case a checkpoint must be
+// made instead
+static int journal_end()
+{
+  jtxn_t* t = txn;
+  txn = NULL;
+  if(!t) return 0;
+  if(t->overflow) return -1;
+
+  jdesc_t* desc = (jdesc_t*)journal_buf;
+  memset(journal_buf, 0, sector_size);
+  int n = 0;
+  for(int i=0; i<t->n; i++) {
+    int sector = t->sector[i];
+    if(sector >= SECTOR_BITMAP_START_SECTOR && sector < SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS)
+      continue; // rebuilt on replay
+    if(sector >= data_start_sector() && !bitmap_test(&sector_bitmap, sector))
+      continue; // freed, so its content doesn't matter (and imaging it would cache it again)
+    if(journal_image(sector, journal_buf+(1+n)*sector_size) < 0) return -1;
+    desc->sector[n++] = sector;
+  }
+  if(!n) return 0;
+
+  pthread_mutex_lock(&journal.lock);
+  if(journal.head+1+n > JOURNAL_SECTORS) {
+    pthread_mutex_unlock(&journal.lock);
+    dprintf("... journal is full\n");
+    return -1;
+  }
+  desc->magic = JOURNAL_TXN_MAGIC;
+  desc->seq = journal.seq+1;
+  desc->count = n;
+  desc->checksum = journal_checksum(journal_buf, (1+n)*sector_size, 2166136261u);
+  if(Disk_WriteRange(JOURNAL_START_SECTOR+journal.head, 1+n, journal_buf) < 0) {
+    pthread_mutex_unlock(&journal.lock);
+    return -1;
+  }
+  journal.head += 1+n;
+  int seq = ++journal.seq;
+  pthread_mutex_unlock(&journal.lock);
+  dprintf("... journal: transaction %d with %d sectors\n", seq, n);
+  return seq;
+}
+
+// wait until the given transaction is in the image file, committing
+// it (and all the others added by then) unless a commit is under way
+static void journal_wait(int seq)
+{
+  pthread_mutex_lock(&journal.lock);
+  while(journal.durable < seq) {
+    if(journal.committing) {
+      pthread_cond_wait(&journal.committed, &journal.lock);
+      continue;
+    }
+    journal.committing = 1;
+    int from = journal.flushed, to = journal.head, last = journal.seq;
+    pthread_mutex_unlock(&journal.lock);
+    int err = Disk_Commit(JOURNAL_START_SECTOR+from, to-from);
+    pthread_mutex_lock(&journal.lock);
+    journal.committing = 0;
+    if(err < 0) {
+      // the change stays in memory until the next sync
+      dprintf("... journal: commit failed\n");
+      pthread_cond_broadcast(&journal.committed);
+      break;
+    }
+    journal.flushed = to;
+    journal.durable = last;
+    pthread_cond_broadcast(&journal.committed);
+  }
+  pthread_mutex_unlock(&journal.lock);
+}
+
+// empty the journal, with a header for the transactions that follow
+// 'seq' (with the file system to ourselves, once a checkpoint has
+// saved everything the journal holds; the header then only needs to
+// be written through, see fs_sync())
+static int journal_reset(int seq)
+{
+  char buf[MAX_SECTOR_SIZE];
+  memset(buf, 0, sector_size);
+  jheader_t* h = (jheader_t*)buf;
+  h->magic = JOURNAL_MAGIC;
+  h->seq = seq+1;
+  pthread_mutex_lock(&journal.lock);
+  while(journal.committing) pthread_cond_wait(&journal.committed, &journal.lock);
+  journal.head = journal.flushed = 1;
+  journal.seq = journal.durable = seq;
+  pthread_mutex_unlock(&journal.lock);
+  return Disk_Write(JOURNAL_START_SECTOR, buf);
+}
+
+// replay the transactions in the journal onto the disk at boot, in
+// order, until the first one that's missing or torn; the journal is
+// kept (replaying it again is harmless) until the next checkpoint;
+// return the number of transactions replayed, or -1 if the journal is
+// unreadable
+static int journal_recover()
+{
+  static char images[JTXN_SECTORS*MAX_SECTOR_SIZE];
+  char buf[MAX_SECTOR_SIZE];
+  if(Disk_Read(JOURNAL_START_SECTOR, buf) < 0) return -1;
+  jheader_t h = *(jheader_t*)buf;
+  if(h.magic != JOURNAL_MAGIC) {
+    dprintf("... journal header is corrupt\n");
+    return -1;
+  }
+  int pos = 1, seq = h.seq, replayed = 0;
+  while(pos < JOURNAL_SECTORS) {
+    if(Disk_Read(JOURNAL_START_SECTOR+pos, buf) < 0) return -1;
+    jdesc_t* desc = (jdesc_t*)buf;
+    if(desc->magic != JOURNAL_TXN_MAGIC || desc->seq != seq ||
+       desc->count <= 0 || desc->count > JTXN_SECTORS || pos+1+desc->count > JOURNAL_SECTORS)
+      break;
+    int n = desc->count;
+    if(Disk_ReadRange(JOURNAL_START_SECTOR+pos+1, n, images) < 0) return -1;
+    unsigned checksum = desc->checksum;
+    desc->checksum = 0;
+    unsigned h2 = journal_checksum(buf, sector_size, 2166136261u);
+    if(journal_checksum(images, n*sector_size, h2) != checksum) break;
+    for(int i=0; i<n; i++) {
+      int sector = desc->sector[i];
+      if(sector <= SUPERBLOCK_START_SECTOR || sector >= total_sectors ||
+	 Disk_Write(sector, images+i*sector_size) < 0) return -1;
+      bcache_discard(sector);
+    }
+    dprintf("... journal: replayed transaction %d (%d sectors)\n", seq, n);
+    pos += 1+n;
+    seq++;
+    replayed++;
+  }
+  journal.head = journal.flushed = pos;
+  journal.seq = journal.durable = seq-1;
+  return replayed;
+}
+
+// after a replay, the sector bitmap is made of the sectors used by the
+// inodes in use (and the reserved ones)
+static int sector_bitmap_rebuild()
+{
+  bitmap_init(&sector_bitmap, data_start_sector());
+  for(int inum=0; inum<max_files; inum++) {
+    if(!bitmap_test(&inode_bitmap, inum)) continue;
+    inode_t* node = iget(inum);
+    if(!node) return -1;
+    int nblocks = bmap_nblocks(node);
+    for(int block=0, run=0; block<nblocks; block+=run) {
+      int sector = bmap(node, block, &run);
+      if(sector <= 0) break;
+      for(int i=0; i<run; i++) bitmap_set(&sector_bitmap, sector+i);
+    }
+    if(node->type != INLINE_FILE && node->indirect) bitmap_set(&sector_bitmap, node->indirect);
+    iput(node, 0);
+  }
+  dprintf("... rebuilt the sector bitmap\n");
+  return 0;
+}
+
+/* end of internal helper functions, start of API functions */
+
+// the snapshots taken of the disk, by name (an empty name means the
+// entry isn't used); the table only changes with 'fs_lock' held
+// exclusively
+static struct {
+  char name[MAX_NAME];
+  int snap; // the disk's handle of the snapshot
+} snapshots[DISK_SNAPSHOTS];
+
+// return the entry of the named snapshot, or -1 if there's none
+static int find_snapshot(char* name)
+{
+  for(int i=0; i<DISK_SNAPSHOTS; i++)
+    if(snapshots[i].name[0] && !strncmp(snapshots[i].name, name, MAX_NAME)) return i;
+  return -1;
+}
+
+// fill in the default boot options; the disk pages in the image file
+// on demand, since a program that calls FS_Boot() (such as the slow-*
+// tools) may well exit after touching a few sectors; the environment
+// variables LIBFS_DISK_MODE ("lazy", "memory" or "mmap") and
+// LIBFS_SYNC_DATA ("1") let it choose the disk backend and durability,
+// LIBFS_COMPRESS ("1") whether the files it creates are compressed,
+// and LIBFS_SECTOR_SIZE, LIBFS_TOTAL_SECTORS and LIBFS_MAX_FILES the
+// geometry of a file system they format
+void FS_DefaultOptions(FS_Options_t* options)
+{
+  memset(options, 0, sizeof(FS_Options_t));
+  options->disk_mode = DISK_LAZY;
+  char* mode = getenv("LIBFS_DISK_MODE");
+  if(mode && !strcmp(mode, "memory")) options->disk_mode = DISK_MEMORY;
+  if(mode && !strcmp(mode, "mmap")) options->disk_mode = DISK_MMAP;
+  char* sync = getenv("LIBFS_SYNC_DATA");
+  if(sync && !strcmp(sync, "1")) options->sync_data = 1;
+  char* compress = getenv("LIBFS_COMPRESS");
+  if(compress && !strcmp(compress, "1")) options->compress_files = 1;
+  char* geometry;
+  if((geometry = getenv("LIBFS_SECTOR_SIZE"))) options->sector_size = atoi(geometry);
+  if((geometry = getenv("LIBFS_TOTAL_SECTORS"))) options->total_sectors = atoi(geometry);
+  if((geometry = getenv("LIBFS_MAX_FILES"))) options->max_files = atoi(geometry);
+  char* server = getenv("LIBFS_SERVER");
+  options->use_server = !(server && !strcmp(server, "0"));
+}
+
+// pick up the geometry recorded in the superblock of an image file,
+// leaving the given one if the file isn't a file system or predates
+// the geometry being recorded; return -1 if the file can't be opened
+static int read_geometry(char* file, int* ssize, int* nsectors, int* nfiles)
+{
+  FILE* f = fopen(file, "r");
+  if(!f) return -1;
+  int sb[SB_INTS];
+  if(fread(sb, sizeof(int), SB_INTS, f) == SB_INTS && sb[SB_MAGIC] == OS_MAGIC) {
+    *ssize = sb[SB_SECTOR_SIZE] ? sb[SB_SECTOR_SIZE] : SECTOR_SIZE;
+    *nsectors = sb[SB_TOTAL_SECTORS] ? sb[SB_TOTAL_SECTORS] : TOTAL_SECTORS;
+    *nfiles = sb[SB_MAX_FILES] ? sb[SB_MAX_FILES] : MAX_FILES;
+  }
+  fclose(f);
+  return 0;
+}
+
+// make the file system (and the disk made by the next Disk_Init())
+// have the given geometry; the table of open descriptors per inode
+// follows the number of inodes; return 0 if successful, -1 if the
+// geometry is invalid or out of memory
+static int geometry_setup(int ssize, int nsectors, int nfiles)
+{
+  if(nfiles <= 0 || Disk_SetGeometry(ssize, nsectors) < 0) return -1;
+  sector_size = ssize;
+  total_sectors = nsectors;
+  max_files = nfiles;
+  if(max_files != open_count_files) {
+    free(open_count);
+    open_count = fs_malloc(max_files*sizeof(int));
+    open_count_files = open_count ? max_files : 0;
+    if(!open_count) return -1;
+  }
+  memset(open_count, 0, max_files*sizeof(int));
+  return 0;
+}
+
+int FS_Boot(char* backstore_fname)
+{
+  FS_Options_t options;
+  FS_DefaultOptions(&options);
+  return FS_BootWithOptions(backstore_fname, &options);
+}
+
+static int fs_boot(char* backstore_fname, FS_Options_t* options)
 {
   dprintf("FS_Boot('%s'):\n", backstore_fname);
+  boot_count++;
+  FS_Options_t defaults;
+  if(!options) {
+    FS_DefaultOptions(&defaults);
+    options = &defaults;
+  }
+  // the geometry of an existing file system is the one it was
+  // formatted with; the options only say that of a new one
+  int ssize = options->sector_size ? options->sector_size : SECTOR_SIZE;
+  int nsectors = options->total_sectors ? options->total_sectors : TOTAL_SECTORS;
+  int nfiles = options->max_files ? options->max_files : MAX_FILES;
+  read_geometry(backstore_fname, &ssize, &nsectors, &nfiles);
+  if(geometry_setup(ssize, nsectors, nfiles) < 0) {
+    dprintf("... invalid geometry (sector size %d, %d sectors, %d files)\n", ssize, nsectors, nfiles);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(open_files_setup(options->max_open_files) < 0) {
+    dprintf("... can't allocate the open file table\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dir_streams_reset();
+  memset(snapshots, 0, sizeof(snapshots)); // the disk drops them at Disk_Init()
+
   // initialize a new disk (this is a simulated disk)
-  if(Disk_Init() < 0) {
+  if(Disk_SetMode(options->disk_mode) < 0 ||
+     Disk_SetSync(options->sync_data ? DISK_SYNC_DATA : 0) < 0 || Disk_Init() < 0) {
     dprintf("... disk init failed\n");
     osErrno = E_GENERAL;
     return -1;
   }
-  dprintf("... disk initialized\n");
-  
-  // we should copy the filename down; if not, the user may change the
-  // content pointed to by 'backstore_fname' after calling this function
-  strncpy(bs_filename, backstore_fname, 1024);
-  bs_filename[1023] = '\0'; // for safety
-  
-  // we first try to load disk from this file
-  if(Disk_Load(bs_filename) < 0) {
-    dprintf("... load disk from file '%s' failed\n", bs_filename);
+  dprintf("... disk initialized (sector size %d, %d sectors)\n", sector_size, total_sectors);
+  if(bcache_reset() < 0) {
+    dprintf("... can't allocate the buffer cache\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  icache_reset();
+  dcache_reset();
+  
+  // we should copy the filename down; if not, the user may change the
+  // content pointed to by 'backstore_fname' after calling this function
+  strncpy(bs_filename, backstore_fname, 1024);
+  bs_filename[1023] = '\0'; // for safety
+  
+  // we first try to load disk from this file
+  if(Disk_Load(bs_filename) < 0) {
+    dprintf("... load disk from file '%s' failed\n", bs_filename);
+
+    // if we can't open the file; it means the file does not exist, we
+    // need to create a new file system on disk
+    if(diskErrno == E_OPENING_FILE) {
+      dprintf("... couldn't open file, create new file system\n");
+
+      // format superblock
+      fs_version = options->fs_version ? options->fs_version : FS_VERSION_LATEST;
+      if(fs_version < FS_VERSION_BLOCKLIST || fs_version > FS_VERSION_LATEST) {
+	dprintf("... unknown format version %d\n", fs_version);
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      compress_files = options->compress_files && fs_version >= FS_VERSION_COMPRESSED;
+      if(data_start_sector() >= total_sectors) {
+	dprintf("... no room for data (%d sectors, data from sector %d)\n", total_sectors, data_start_sector());
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      char buf[MAX_SECTOR_SIZE];
+      memset(buf, 0, sector_size);
+      int* sb = (int*)buf;
+      sb[SB_MAGIC] = OS_MAGIC;
+      sb[SB_VERSION] = fs_version;
+      // the default geometry is left out, as in the images made before
+      // it was recorded
+      sb[SB_SECTOR_SIZE] = sector_size == SECTOR_SIZE ? 0 : sector_size;
+      sb[SB_TOTAL_SECTORS] = total_sectors == TOTAL_SECTORS ? 0 : total_sectors;
+      sb[SB_MAX_FILES] = max_files == MAX_FILES ? 0 : max_files;
+      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+	dprintf("... failed to format superblock\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      dprintf("... formatted superblock (sector %d, version %d, %d inodes)\n",
+	      SUPERBLOCK_START_SECTOR, fs_version, max_files);
+
+      if(setup_bitmaps() < 0) {
+	osErrno = E_GENERAL;
+	return -1;
+      }
+
+      // format inode bitmap (reserve the first inode to root)
+      bitmap_init(&inode_bitmap, 1);
+      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+	     (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+      
+      // format sector bitmap (reserve the first few sectors to
+      // superblock, inode bitmap, sector bitmap, inode table, and
+      // journal)
+      bitmap_init(&sector_bitmap, data_start_sector());
+      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+	     (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+      
+      // format inode tables
+      for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+	memset(buf, 0, sector_size);
+	if(i==0) {
+	  // the first inode table entry is the root directory
+	  ((inode_t*)buf)->size = 0;
+	  ((inode_t*)buf)->type = 1;
+	}
+	if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
+	  dprintf("... failed to format inode table\n");
+	  osErrno = E_GENERAL;
+	  return -1;
+	}
+      }
+      dprintf("... formatted inode table (start=%d, num=%d)\n",
+	     (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+
+      // format the journal (empty)
+      if(fs_version >= FS_VERSION_JOURNAL && journal_reset(0) < 0) {
+	dprintf("... failed to format journal\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      
+      // we need to synchronize the disk to the backstore file (so
+      // that we don't lose the formatted disk)
+      if(bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0 ||
+	 Disk_Save(bs_filename) < 0) {
+	// if can't write to file, something's wrong with the backstore
+	dprintf("... failed to save disk to file '%s'\n", bs_filename);
+	osErrno = E_GENERAL;
+	return -1;
+      } else {
+	// everything's good now, boot is successful
+	dprintf("... successfully formatted disk, boot successful\n");
+	return 0;
+      }
+    } else {
+      // something wrong loading the file: invalid param or error reading
+      dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
+      osErrno = E_GENERAL; 
+      return -1;
+    }
+  } else {
+    dprintf("... load disk from file '%s' successful\n", bs_filename);
+    
+    // we successfully loaded the disk, we need to do two more checks,
+    // first the disk (which takes the size of the file) must have as
+    // many sectors as the superblock says
+    int nloaded = 0;
+    Disk_GetGeometry(NULL, &nloaded);
+    if(nloaded != total_sectors) {
+      dprintf("... check size of file '%s' failed\n", bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... check size of file '%s' successful\n", bs_filename);
+    
+    // check magic
+    if(check_magic()) {
+      dprintf("... check magic successful (version %d)\n", fs_version);
+      compress_files = options->compress_files && fs_version >= FS_VERSION_COMPRESSED;
+
+      // bring back the operations logged since the last sync
+      int replayed = 0;
+      if(fs_version >= FS_VERSION_JOURNAL && (replayed = journal_recover()) < 0) {
+	dprintf("... failed to recover the journal, boot failed\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
+
+      // both bitmaps are brought into memory when first used; from
+      // then on they are only written back to disk on sync
+      if(setup_bitmaps() < 0) {
+	dprintf("... failed to set up bitmaps, boot failed\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      load_bitmaps();
+      if(replayed > 0 && sector_bitmap_rebuild() < 0) {
+	dprintf("... failed to rebuild the sector bitmap, boot failed\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
+
+      // everything's good by now, boot is successful
+      return 0;
+    } else {      
+      // mismatched magic number
+      dprintf("... check magic failed, boot failed\n");
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+}
+
+static int fs_sync()
+{
+  tcache_drain(0); // so that the bitmaps don't keep the cached bits
+  // the checkpoint: everything logged is written in place and saved
+  // (on the device, with sync_data) before the journal is emptied, and
+  // the empty header is then written through on its own, so that a
+  // crash in between still finds the transactions to replay
+  if(bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0 ||
+     icache_flush() < 0 || bcache_flush() < 0 || Disk_Save(bs_filename) < 0 ||
+     (fs_version >= FS_VERSION_JOURNAL &&
+      (journal_reset(journal.seq) < 0 || Disk_Commit(JOURNAL_START_SECTOR, 1) < 0))) {
+    // if can't write to file, something's wrong with the backstore
+    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+    osErrno = E_GENERAL;
+    return -1;
+  } else {
+    // everything's good now, sync is successful
+    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
+    return 0;
+  }
+}
+
+static int fs_snapshot(char* name)
+{
+  dprintf("FS_Snapshot('%s'):\n", name);
+  if(!name || !name[0] || illegal_filename(name) || find_snapshot(name) >= 0) {
+    dprintf("... bad or existing snapshot name\n");
+    osErrno = E_CREATE;
+    return -1;
+  }
+  int i = 0;
+  while(i < DISK_SNAPSHOTS && snapshots[i].name[0]) i++;
+  if(i == DISK_SNAPSHOTS) {
+    dprintf("... too many snapshots\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+
+  // the snapshot is taken at a checkpoint, so that its image needs no
+  // recovery; from then on, the disk keeps a copy of each sector the
+  // first time it's written
+  if(fs_sync() < 0) return -1;
+  int snap = Disk_Snapshot();
+  if(snap < 0) {
+    dprintf("... the disk can't take a snapshot\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  name_copy(snapshots[i].name, name);
+  snapshots[i].snap = snap;
+  dprintf("... snapshot '%s' taken\n", name);
+  return 0;
+}
+
+static int fs_snapshot_save(char* name, char* file)
+{
+  dprintf("FS_SnapshotSave('%s', '%s'):\n", name, file);
+  int i = name ? find_snapshot(name) : -1;
+  if(i < 0) {
+    dprintf("... no such snapshot\n");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(!file || Disk_SnapshotSave(snapshots[i].snap, file) < 0) {
+    dprintf("... failed to save snapshot to file '%s'\n", file);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+static int fs_snapshot_delete(char* name)
+{
+  dprintf("FS_SnapshotDelete('%s'):\n", name);
+  int i = name ? find_snapshot(name) : -1;
+  if(i < 0) {
+    dprintf("... no such snapshot\n");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  Disk_SnapshotRelease(snapshots[i].snap);
+  snapshots[i].name[0] = '\0';
+  return 0;
+}
+
+static int file_create(char* file)
+{
+  dprintf("File_Create('%s'):\n", file);
+  return create_file_or_directory(0, file);
+}
+
+static int file_unlink(char* file)
+{
+    dprintf(" ... entering file unlink function\n");
+  dprintf("... File_Unlink ('%s'):\n", file);
+  //call delete_helper() to remove directory inod
+  return delete_helper(0, file);//type 0 for file
+  //return -1;
+}
+
+// resolve the directory of a batch once; return its inode, or -1
+// (with osErrno set) if there's no such directory
+static int batch_dir(char* dir)
+{
+  int dir_inode = -1;
+  follow_path(dir, &dir_inode, NULL);
+  if(dir_inode < 0) {
+    dprintf("... no such directory '%s'\n", dir);
+    osErrno = E_NO_SUCH_DIR;
+  }
+  return dir_inode;
+}
+
+static int file_create_batch(char* dir, char** names, int n)
+{
+  dprintf("File_CreateBatch('%s', %d):\n", dir, n);
+  if(n <= 0) return 0;
+  int dir_inode = batch_dir(dir);
+  if(dir_inode < 0) return -1;
+  int legal = 0;
+  while(legal < n && names[legal] && !illegal_filename(names[legal])) legal++;
+  int ret = legal > 0 ? add_inodes(0, dir_inode, names, legal) : -1;
+  if(ret == -2) {
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  if(ret < n) osErrno = E_CREATE;
+  return ret;
+}
+
+static int file_unlink_batch(char* dir, char** names, int n)
+{
+  dprintf("File_UnlinkBatch('%s', %d):\n", dir, n);
+  if(n <= 0) return 0;
+  int dir_inode = batch_dir(dir);
+  if(dir_inode < 0) return -1;
+  inode_t* parent = iget(dir_inode);
+  if(!parent) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int is_dir = (parent->type == 1);
+  dindex_t* ix = is_dir ? dir_index(parent) : NULL;
+  if(!ix) {
+    iput(parent, 0);
+    osErrno = is_dir ? E_GENERAL : E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  // the parent stays held (and its index built) for the whole batch
+  int removed = 0;
+  for(; removed < n; removed++) {
+    char* fname = names[removed];
+    dindex_slot_t* slot = fname ? dindex_find(ix, fname) : NULL;
+    if(!slot) {
+      osErrno = E_NO_SUCH_FILE;
+      break;
+    }
+    if(is_file_open(slot->inode)) {
+      osErrno = E_FILE_IN_USE;
+      break;
+    }
+    int ret = remove_inode(0, dir_inode, slot->inode, fname);
+    if(ret < 0) {
+      // a directory of that name is not a file to unlink (as for File_Unlink())
+      osErrno = ret == -3 ? E_NO_SUCH_FILE : E_GENERAL;
+      break;
+    }
+    dprintf("... file '%s' successfully unlinked\n", fname);
+    if(!(ix = icache_entry(parent)->dindex)) ix = dir_index(parent);
+    if(!ix) break;
+  }
+  iput(parent, 0);
+  return removed > 0 ? removed : -1;
+}
+
+/*int File_Unlink(char* file)
+{
+   int type;
+  char* pathname;
+  int child_inode;
+  char last_fname[MAX_NAME]; // file namee size is 30 byte
+  int parent_inode=follow_path(pathname,&child_inode,last_fname);
+  if (parent_inode>=0){
+    if(child_inode>=0){
+      if(remove_inode(type,parent_inode,child_inode)==0)
+      {
+        dprintf("Successful Removal of file \n ",pathname);
+        return 0;
+      }
+      else if (remove_inode(type, parent_inode,child_inode)==-2)
+      {
+        dprintf("...directory not empty");
+        return -2;
+      }
+      else if (remove_inode(type,parent_inode,child_inode)==-2)
+      {
+        dprintf("...type is wrong");
+        return -3;
+      }
+    }
+    if(child_inode < 1){ 
+        dprintf("...File does not exist");
+        osErrno = E_NO_SUCH_FILE;
+        return -1;
+    }
+    if (is_file_open(child_inode)==0)
+    {
+        dprintf("...File is already open");
+        osErrno = E_FILE_IN_USE;
+        return -1;       
+
+    }
+  
+  }
+
+  return -1;
+}*/
+
+// return the open file entry for the given file descriptor; NULL if
+// the descriptor is not valid
+static open_file_t* get_open_file(int fd)
+{
+  if(fd < 0 || fd >= max_open_files ||
+     __atomic_load_n(&open_files[fd].inode, __ATOMIC_ACQUIRE) <= 0)
+    return NULL;
+  return &open_files[fd];
+}
+
+static int file_open(char* file)
+{
+  dprintf("File_Open('%s'):\n", file);
+  int fd = new_file_fd();
+  if(fd < 0) {
+    dprintf("... max open files reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+
+  int child_inode = -1;
+  follow_path(file, &child_inode, NULL);
+  if(child_inode >= 0) { // child is the one
+    // get the inode from the in-core inode table; the reference is
+    // kept until the file is closed
+    inode_t* child = iget(child_inode);
+    if(!child) { free_file_fd(fd); osErrno = E_GENERAL; return -1; }
+    inode_rdlock(child); // the file may be written through another descriptor
+    int size = child->size, type = child->type;
+    inode_unlock(child);
+    dprintf("... inode %d (size=%d, type=%d)\n", child_inode, size, type);
+
+    if(type == 1) {
+      dprintf("... error: '%s' is not a file\n", file);
+      iput(child, 0);
+      free_file_fd(fd);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+
+    // initialize open file entry and return its index; the entry is
+    // only seen as used once the inode is set
+    open_files[fd].size = size;
+    open_files[fd].pos = 0;
+    open_files[fd].node = child;
+    open_files[fd].ra_pos = open_files[fd].ra_window = open_files[fd].ra_end = 0;
+    __atomic_fetch_add(&open_count[child_inode], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&open_files[fd].inode, child_inode, __ATOMIC_RELEASE);
+    return fd;
+  } else {
+    free_file_fd(fd);
+    dprintf("... file '%s' is not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }  
+}
+
+// sequential reads of an open file are detected (a read starting
+// where the previous one ended) and the blocks that follow are read
+// ahead into the buffer cache by the worker threads, so that the next
+// reads find them there; the window doubles with each sequential read
+// (up to BMAP_PREFETCH blocks) and halves with each random one, and a
+// new batch is read ahead once half of the window has been consumed
+#define RA_MIN_WINDOW 8
+
+static void async_readahead(int inode, int block, int n);
+
+// account for a read through 'f' ending at block 'last' (with the
+// locks of the descriptor and its inode held), and read ahead
+static void file_readahead(open_file_t* f, int last)
+{
+  if(f->pos == f->ra_pos)
+    f->ra_window = f->ra_window ? 2*f->ra_window : RA_MIN_WINDOW;
+  else {
+    f->ra_window /= 2;
+    f->ra_end = 0;
+  }
+  if(f->ra_window > BMAP_PREFETCH) f->ra_window = BMAP_PREFETCH;
+  if(!f->ra_window) return;
+
+  int from = f->ra_end > last+1 ? f->ra_end : last+1;
+  int to = last+1+f->ra_window;
+  int nblocks = (f->node->size+sector_size-1)/sector_size;
+  if(to > nblocks) to = nblocks;
+  if(to-from < f->ra_window/2 && to < nblocks) return; // enough ahead already
+  if(from >= to) return;
+  async_readahead(f->inode, from, to-from);
+  f->ra_end = to;
+}
+
+// make an inline file a regular one, its content moving to its first
+// block; return 0 if successful, -1 with osErrno set otherwise (the
+// file is then left as it was)
+static int inline_spill(inode_t* node)
+{
+  char bytes[INLINE_SIZE];
+  memcpy(bytes, node->bytes, INLINE_SIZE);
+  memset(node->bytes, 0, INLINE_SIZE);
+  node->type = 0;
+  if(node->size > 0) {
+    int r = bmap_grow(node, 1), sector = r > 0 ? bmap(node, 0, NULL) : 0;
+    char* buf = sector > 0 ? bcache_get(sector, BC_ZERO) : NULL;
+    if(!buf) {
+      if(r > 0) bmap_shrink(node);
+      node->type = INLINE_FILE;
+      memcpy(node->bytes, bytes, INLINE_SIZE);
+      osErrno = (r == -2) ? E_FILE_TOO_BIG : (r < 0 ? E_NO_SPACE : E_GENERAL);
+      return -1;
+    }
+    memcpy(buf, bytes, node->size);
+    bcache_put(buf, 1);
+  }
+  inode_dirty(node);
+  dprintf("... inode %d is no longer inline (%d bytes)\n", icache_entry(node)->inum, node->size);
+  return 0;
+}
+
+// a compressed file is read and written a chunk at a time, through
+// buffers for the chunk's content and its stored form; a write stores
+// the chunks it changes again, which moves the blocks of the chunks
+// after them if they take more or fewer blocks than before (an append
+// only ever stores the last chunk again)
+static int cfile_buffers(char** plain, char** packed)
+{
+  *plain = pool_alloc(CHUNK_SIZE);
+  *packed = pool_alloc(CHUNK_MAX_BLOCKS*sector_size);
+  if(*plain && *packed) return 0;
+  pool_free(*plain, CHUNK_SIZE);
+  pool_free(*packed, CHUNK_MAX_BLOCKS*sector_size);
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+static int cfile_read(open_file_t* f, char* data, int size)
+{
+  inode_t* node = f->node;
+  if(size > node->size-f->pos) size = node->size-f->pos;
+  if(size <= 0) return 0;
+  char *plain, *packed;
+  cindex_t* ix = file_chunks(node);
+  if(!ix) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(cfile_buffers(&plain, &packed) < 0) return -1;
+  int count = 0;
+  while(count < size) {
+    int c = (f->pos+count)/CHUNK_SIZE, off = (f->pos+count)%CHUNK_SIZE;
+    int len = node->size-c*CHUNK_SIZE < CHUNK_SIZE ? node->size-c*CHUNK_SIZE : CHUNK_SIZE;
+    int n = len-off < size-count ? len-off : size-count;
+    // a whole chunk is decompressed straight into the user's buffer
+    char* to = (off == 0 && n == len) ? data+count : plain;
+    if(chunk_read(node, ix, c, packed, to) != len) {
+      osErrno = E_GENERAL;
+      break;
+    }
+    if(to == plain) memcpy(data+count, plain+off, n);
+    count += n;
+  }
+  pool_free(plain, CHUNK_SIZE);
+  pool_free(packed, CHUNK_MAX_BLOCKS*sector_size);
+  f->pos += count;
+  return count;
+}
+
+static int cfile_write(open_file_t* f, char* data, int size)
+{
+  inode_t* node = f->node;
+  char *plain, *packed;
+  cindex_t* ix = file_chunks(node);
+  if(!ix) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(cfile_buffers(&plain, &packed) < 0) return -1;
+  int count = 0;
+  while(count < size) {
+    int c = (f->pos+count)/CHUNK_SIZE, off = (f->pos+count)%CHUNK_SIZE;
+    int n = CHUNK_SIZE-off < size-count ? CHUNK_SIZE-off : size-count;
+
+    // the content of the chunk the write leaves as it is comes from
+    // the chunk stored so far; a new chunk starts with no blocks
+    int old = 0;
+    if(c < ix->nchunks) {
+      old = node->size-c*CHUNK_SIZE < CHUNK_SIZE ? node->size-c*CHUNK_SIZE : CHUNK_SIZE;
+      if((off > 0 || off+n < old) && chunk_read(node, ix, c, packed, plain) != old) {
+	osErrno = E_GENERAL;
+	break;
+      }
+    } else {
+      if(cindex_grow(ix, c+1) < 0) {
+	osErrno = E_GENERAL;
+	break;
+      }
+      ix->first[c+1] = ix->first[c];
+      ix->nchunks++;
+    }
+    memcpy(plain+off, data+count, n);
+    int len = off+n > old ? off+n : old;
+    int nblocks = chunk_pack(plain, len, packed);
+    int d = nblocks-(ix->first[c+1]-ix->first[c]);
+    if(d != 0 && chunk_resize(node, ix, c, d) < 0) {
+      if(old == 0 && (ix = icache_entry(node)->cindex)) ix->nchunks--;
+      break;
+    }
+    if(chunk_store(node, ix, c, packed) < 0) {
+      osErrno = E_GENERAL;
+      break;
+    }
+    dprintf("... stored chunk %d of inode %d (%d bytes in %d blocks)\n",
+	    c, icache_entry(node)->inum, len, nblocks);
+    count += n;
+    if(f->pos+count > node->size) {
+      node->size = f->pos+count;
+      inode_dirty(node);
+    }
+  }
+  pool_free(plain, CHUNK_SIZE);
+  pool_free(packed, CHUNK_MAX_BLOCKS*sector_size);
+  f->pos += count;
+  f->size = node->size;
+  return count;
+}
+
+static int file_read(int fd, void* buffer, int size){
+  
+  if(!get_open_file(fd)){// checking whether the file is open or not, return -1 if the file is not open
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  dprintf(".....the initial size is %d\n",size);
+
+  // the inode is resident for as long as the file is open
+  inode_t* node = open_files[fd].node;
+  if(node->type == COMPRESSED_FILE) return cfile_read(&open_files[fd], buffer, size);
+  if(node->type == INLINE_FILE) {
+    if(size > node->size-open_files[fd].pos) size = node->size-open_files[fd].pos;
+    if(size < 0) size = 0;
+    memcpy(buffer, node->bytes+open_files[fd].pos, size);
+    open_files[fd].pos += size;
+    return size;
+  }
+  
+  //memset(buffer,0,size);
+  int count = 0;// this variable will indicate how many bytes we have read, so initially it is 0
+  int beginSector = open_files[fd].pos / sector_size; // figure out which sector we want to read
+  dprintf("the current pos is %d\n",beginSector);
+  int beginByte;// for iterating bytes
+  char *data =(char*) buffer;
+  // never read beyond the end of the file
+  if(size > node->size-open_files[fd].pos) size = node->size-open_files[fd].pos;
+  int tempsize = size;
+
+  // a mapped disk is read in place (below); otherwise, the sectors
+  // spanned by the read are brought into the cache a batch at a time
+  int mapped = (Disk_Map(SUPERBLOCK_START_SECTOR) != NULL);
+  int lastSector = (open_files[fd].pos+size-1)/sector_size;
+  int sector = 0, run = 0, prefetched = 0;
+  if(!mapped && size > 0) file_readahead(&open_files[fd], lastSector);
+
+  while(count < tempsize){// loop until the count value gets larger than the size or that particular file has some data
+    //dprintf("...... size is %d\n",tempsize);
+
+    // the next block is either the next sector of the current extent
+    // or the start of the following one
+    if(run > 0) sector++;
+    else if((sector = bmap(node, beginSector, &run)) <= 0) break;
+    if(!mapped && !prefetched) {
+      bmap_prefetch(node, beginSector, lastSector-beginSector+1);
+      prefetched = BMAP_PREFETCH;
+    }
+
+    // the cached copy is the latest if there's one; if not, a mapped
+    // disk sector can be copied straight to the user's buffer
+    const char *temp = NULL;
+    char *cached = NULL;
+    if(mapped && !bcache_cached(sector))
+      temp = Disk_Map(sector);
+    else
+      temp = cached = bcache_get(sector, 0);
+    if(!temp) break;
+    if(count == 0)// this indicates the first time, so we need to figure out the exact byte position
+      beginByte = open_files[fd].pos % sector_size;
+    else
+      beginByte = 0;// from the second round, we will alwasy begin from the start of a sector
+    /*for(int i = beginByte; i < sector_size; i++){
+      if(count < size)
+	    data[count++] = temp[i];
+    }*/
+    //int i =0;
+    while( beginByte < sector_size && count < size){// loop until we reached the sector size or bytes we have read becomes greater than the size
+      data[count++] = temp[beginByte];
+      beginByte++;
+    }
+    if(cached) bcache_put(cached, 0);
+    beginSector++;
+    run--;
+    if(prefetched) prefetched--;
+  }
+  
+  open_files[fd].pos += count;// update the current position of the file
+  open_files[fd].ra_pos = open_files[fd].pos;
+  //dprintf("...... get outside the loop and count is %d and the position is %d\n",count,open_files[fd].pos);
+  return count;
+}
+
+
+static int file_write(int fd, void* buffer, int size)
+{
+  if(!get_open_file(fd)){
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  // the inode is resident for as long as the file is open
+  inode_t* node = open_files[fd].node;
+  if(node->type == COMPRESSED_FILE) return cfile_write(&open_files[fd], buffer, size);
+  char *data = (char*) buffer;
+  int pos = open_files[fd].pos;
+  if(node->type == INLINE_FILE) {
+    if(pos+size <= INLINE_SIZE) {
+      memcpy(node->bytes+pos, data, size);
+      open_files[fd].pos += size;
+      if(open_files[fd].pos > node->size) node->size = open_files[fd].pos;
+      inode_dirty(node);
+      open_files[fd].size = node->size;
+      return size;
+    }
+    if(inline_spill(node) < 0) return 0;
+  }
+  int oldSize = node->size;
+  int count = 0;
+
+  while(count < size){// loop until all bytes are written (or we run out of space)
+    int block = (pos+count)/sector_size;
+    int beginByte = (pos+count)%sector_size;
+
+    // write over the block if the file has it already (allocated by an
+    // earlier write or reserved); otherwise, the file grows by all the
+    // blocks the rest of the write needs at once
+    int run, sector = bmap(node, block, &run);
+    if(sector < 0) break;
+    if(sector == 0) {
+      int need = (pos+size-1)/sector_size-block+1;
+      int r = bmap_grow(node, need);
+      if(r == -2) {
+	osErrno = E_FILE_TOO_BIG;
+	break;
+      }
+      if(r < 0) {
+	osErrno = E_NO_SPACE;
+	break;
+      }
+      if((sector = bmap(node, block, &run)) <= 0) break;
+    }
+
+    if(beginByte == 0 && size-count >= sector_size) {
+      // whole sectors go straight from the user's buffer to the disk,
+      // as many at once as the extent holds; cached copies of them
+      // are out of date from now on
+      int n = (size-count)/sector_size;
+      if(n > run) n = run;
+      for(int i=0; i<n; i++) bcache_discard(sector+i);
+      if(Disk_WriteRange(sector, n, data+count) < 0) break;
+      dprintf("... wrote sectors %d-%d directly\n", sector, sector+n-1);
+      count += n*sector_size;
+    } else {
+      // a partial sector (the head or the tail of the write) is
+      // modified in the cache; it only needs to be read from the disk
+      // if it holds data of the file
+      int n = sector_size-beginByte;
+      if(n > size-count) n = size-count;
+      char *writeBuffer = bcache_get(sector, block*sector_size >= oldSize ? BC_ZERO : 0);
+      if(!writeBuffer) break;
+      memcpy(writeBuffer+beginByte, data+count, n);
+      bcache_put(writeBuffer, 1);
+      dprintf("... wrote %d bytes to sector %d\n", n, sector);
+      count += n;
+    }
+  }
+
+  open_files[fd].pos += count;
+  // the file only grows if the write went past its end
+  if(open_files[fd].pos > node->size) {
+    node->size = open_files[fd].pos;
+    inode_dirty(node);
+  }
+  open_files[fd].size = node->size;
+  return count;
+}
+
+static int file_reserve(int fd, int bytes)
+{
+  dprintf("File_Reserve(%d, %d):\n", fd, bytes);
+  if(!get_open_file(fd)) {
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(bytes < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // allocate the missing blocks, in as few runs as the free space
+  // allows; the file size doesn't change (the blocks a compressed
+  // file needs aren't known until it's written, so it gets none)
+  inode_t* node = open_files[fd].node;
+  if(node->type == COMPRESSED_FILE) return 0;
+  if(node->type == INLINE_FILE) {
+    if(bytes <= INLINE_SIZE) return 0; // the inode has the room already
+    if(inline_spill(node) < 0) return -1;
+  }
+  int nblocks = bmap_nblocks(node);
+  if(nblocks < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  for(int want = (bytes+sector_size-1)/sector_size-nblocks; want > 0; ) {
+    int r = bmap_grow(node, want);
+    if(r < 0) {
+      dprintf("... can't reserve %d more blocks\n", want);
+      osErrno = (r == -2) ? E_FILE_TOO_BIG : E_NO_SPACE;
+      return -1;
+    }
+    want -= r;
+  }
+  return 0;
+}
+
+void FS_GetCacheStats(FS_CacheStats_t* stats)
+{
+  if(stats && remote >= 0) remote_call(RPC_CACHE_STATS, 0, 0, NULL, 0, stats, sizeof(FS_CacheStats_t));
+  else if(stats) bcache_get_stats(stats);
+}
+
+void FS_GetAllocStats(FS_AllocStats_t* stats)
+{
+  if(!stats) return;
+  if(remote >= 0) {
+    remote_call(RPC_ALLOC_STATS, 0, 0, NULL, 0, stats, sizeof(FS_AllocStats_t));
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  *stats = alloc_stats;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void FS_GetStats(FS_Stats_t* stats)
+{
+  if(!stats) return;
+  if(remote >= 0) {
+    remote_call(RPC_STATS, 0, 0, NULL, 0, stats, sizeof(FS_Stats_t));
+    return;
+  }
+  memset(stats, 0, sizeof(FS_Stats_t));
+  bcache_get_stats(&stats->cache);
+#if FSSTATS
+  for(int i=0; i<STAT_SHARDS; i++) {
+    for(int op=0; op<FS_OPS; op++) {
+      FS_OpStats_t* from = &stat_shards[i].ops[op];
+      FS_OpStats_t* to = &stats->ops[op];
+      to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+      to->errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+      to->bytes += __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+      to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+      for(int b=0; b<FS_LATENCY_BUCKETS; b++)
+	to->latency[b] += __atomic_load_n(&from->latency[b], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_lock(&icache_lock);
+  stats->inode_hits = icache_hits;
+  stats->inode_misses = icache_misses;
+  pthread_mutex_unlock(&icache_lock);
+  pthread_mutex_lock(&dcache_lock);
+  stats->path_hits = dcache_hits;
+  stats->path_misses = dcache_misses;
+  pthread_mutex_unlock(&dcache_lock);
+  bitmap_t* bitmaps[] = { &inode_bitmap, &sector_bitmap };
+  for(int i=0; i<2; i++) {
+    pthread_mutex_lock(&bitmaps[i]->lock);
+    stats->alloc_scans += bitmaps[i]->scans;
+    stats->alloc_words += bitmaps[i]->scanned;
+    pthread_mutex_unlock(&bitmaps[i]->lock);
+  }
+#endif
+  Disk_Stats_t disk;
+  Disk_GetStats(&disk);
+  stats->sector_reads = disk.reads;
+  stats->sector_writes = disk.writes;
+  stats->seeks = disk.seeks;
+  stats->seek_distance = disk.seek_distance;
+}
+
+static int file_seek(int fd, int offset)
+{
+  /* YOUR CODE */
+  dprintf("File_Seek (%d):\n",fd);
+  if(!get_open_file(fd)){
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  // the file may have grown through another descriptor
+  if(offset < 0 || open_files[fd].node->size < offset){
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+
+  open_files[fd].pos = offset;
+  return 0;
+}
+
+static int file_close(int fd)
+{
+  dprintf("File_Close(%d):\n", fd);
+  if(0 > fd || fd >= max_open_files) {
+    dprintf("... fd=%d out of bound\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(open_files[fd].inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  dprintf("... file closed successfully\n");
+  iput(open_files[fd].node, 0);
+  __atomic_fetch_sub(&open_count[open_files[fd].inode], 1, __ATOMIC_RELEASE);
+  open_files[fd].node = NULL;
+  __atomic_store_n(&open_files[fd].inode, 0, __ATOMIC_RELEASE);
+  free_file_fd(fd);
+  return 0;
+}
+
+int delete_helper(int type, char *pathname) {
+    int child_inode = -1;
+    char last_fname[MAX_NAME];// MAX_NAME = 16 bytes
+    int parent_inode = follow_path(pathname, &child_inode, last_fname);
+    if (parent_inode < 0) {
+      dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    if (child_inode == 0) {
+      dprintf("... '%s' is the root directory\n", pathname);
+      osErrno = E_ROOT_DIR;
+      return -1;
+    }
+
+    //first check if file is open 
+    if (is_file_open(child_inode)==1) {
+        /* when file is open the above function 
+        returns 1 and remove inode will not be called */
+        dprintf("... file '%s' is currently open\n", last_fname);
+        osErrno = E_FILE_IN_USE;
+        return -1;
+    }
+    //Check if file or directory exists or not
+    if(child_inode<0) //if childnode is less than zero it means it doesnt exist on the list
+    {
+      dprintf(" ...  or directory does not exist\n");
+      if(type){
+      osErrno = E_NO_SUCH_DIR;
+      }
+      else {
+      osErrno = E_NO_SUCH_FILE;
+      }
+      return  -1;
+    }
+    //Removing file or directory from inode
+    int ret = remove_inode(type, parent_inode, child_inode, last_fname);
+    if (ret == 0) {
+      // inode remove is successful when the above function returns 0
+      if(type){
+	dprintf("... directory '%s' successfully Unlinked\n", pathname);
+      }
+      else {
+	dprintf("... file '%s' successfully Unlinked\n", pathname);
+      }
+      return 0;
+    } 
+    else if (ret == -2) {
+      dprintf("... directory '%s' is not empty.\n", pathname);
+      osErrno = E_DIR_NOT_EMPTY;
+    } 
+    else if (ret == -3) {
+      // there's no file (or directory) of that name, only the other type
+      dprintf("... wrong type '%s'.\n", pathname);
+      osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
+    }
+    else { 
+      dprintf("... file/directory '%s' unable to Unlink\n", pathname);
+      osErrno = E_GENERAL;
+    }
+    return -1;
+}
+static int dir_create(char* path){
+  dprintf("Dir_Create('%s'):\n", path);
+  return create_file_or_directory(1, path);
+}
+
+static int dir_unlink(char* path){
+  /* YOUR CODE */
+dprintf("... entering directory unlink function\n");
+  if (path && strcmp(path, "/") == 0)
+	{
+    dprintf("directory %s is a root directory",path);
+		osErrno = E_ROOT_DIR;
+		return -1;
+	}
+  dprintf("... Dir_Unlink ('%s'):\n", path);
+  //call delete_helper() to remove directory inode
+  return delete_helper(1,path);// type 1 for directory 
+  return -1;
+}
+
+static int dir_size(char* path){
+  /* YOUR CODE */
+  int child_inode;
+  follow_path(path, &child_inode, NULL); // usign this function we find out 
+                                        //the child inode associated with the path
+  if(child_inode >= 0) { 
+    inode_t* directory = iget(child_inode); // load the inode from the given inode no
+    if(!directory) return -1;
+    int size = directory->size * sizeof(dirent_t);
+    iput(directory, 0);
+    return size;
+  }
+  return 0;
+}
+
+static int dir_read(char* path, void* buffer, int size)
+{
+  dprintf("Dir_Read('%s', %d):\n", path, size);
+  int d_inode = -1;
+  follow_path(path, &d_inode, NULL);
+  inode_t* directory = d_inode >= 0 ? iget(d_inode) : NULL;
+  if(!directory || directory->type != 1) {
+    dprintf("... '%s' is not a directory\n", path);
+    if(directory) iput(directory, 0);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  if(directory->size*(int)sizeof(dirent_t) > size) {
+    iput(directory, 0);
+    osErrno = E_BUFFER_TOO_SMALL;
+    return -1;
+  }
+
+  // the entries are copied from the cached dirent sectors straight to
+  // the user's buffer, in the order they're stored and skipping the
+  // holes left by removed entries
+  char* out = (char*)buffer;
+  int count = 0;
+  int nblocks = bmap_nblocks(directory);
+  for(int j=0; j<nblocks && count<directory->size; j++) {
+    if(j%BMAP_PREFETCH == 0) bmap_prefetch(directory, j, nblocks-j);
+    int sector = bmap(directory, j, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+    if(!buf) {
+      iput(directory, 0);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    for(int k=0; k<DIRENTS_PER_SECTOR && count<directory->size; k++) {
+      dirent_t* dirent = (dirent_t*)buf+k;
+      if(!dirent->fname[0]) continue; // empty entry
+      memcpy(out+count*sizeof(dirent_t), dirent, sizeof(dirent_t));
+      count++;
+    }
+    bcache_put(buf, 0);
+  }
+  dprintf("... read %d entries\n", count);
+  iput(directory, 0);
+  return count;
+}
+
+
+		
+
+static int dir_open(char* path)
+{
+  dprintf("Dir_Open('%s'):\n", path);
+  int d_inode = -1;
+  follow_path(path, &d_inode, NULL);
+  inode_t* directory = d_inode >= 0 ? iget(d_inode) : NULL;
+  if(!directory || directory->type != 1) {
+    dprintf("... '%s' is not a directory\n", path);
+    if(directory) iput(directory, 0);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  // claim a free stream; the reference to the inode is kept until the
+  // stream is closed
+  int dd = 0;
+  while(dd < MAX_DIR_STREAMS && __atomic_exchange_n(&dir_streams[dd].used, 1, __ATOMIC_ACQUIRE))
+    dd++;
+  if(dd == MAX_DIR_STREAMS) {
+    dprintf("... max directory streams reached\n");
+    iput(directory, 0);
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+  dir_stream_t* s = &dir_streams[dd];
+  pthread_mutex_lock(&s->lock);
+  s->inode = d_inode;
+  s->pos = 0;
+  s->node = directory;
+  __atomic_fetch_add(&open_count[d_inode], 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->lock);
+  dprintf("... stream %d on inode %d (size=%d)\n", dd, d_inode, directory->size);
+  return dd;
+}
+
+// return up to 'n' entries of the directory from the stream's cursor
+// on, one dirent sector at a time and skipping the empty dirents; the
+// type and size of each entry come from its in-core inode
+static int dir_next(dir_stream_t* s, FS_DirEntry_t* entries, int n)
+{
+  inode_t* directory = s->node;
+  int nblocks = bmap_nblocks(directory);
+  if(nblocks < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int count = 0;
+  while(count < n && s->pos < nblocks*DIRENTS_PER_SECTOR) {
+    int j = s->pos/DIRENTS_PER_SECTOR;
+    if(j%BMAP_PREFETCH == 0 && s->pos%DIRENTS_PER_SECTOR == 0)
+      bmap_prefetch(directory, j, nblocks-j);
+    int sector = bmap(directory, j, NULL);
+    char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+    if(!buf) {
+      osErrno = E_GENERAL;
+      return count > 0 ? count : -1;
+    }
+    for(; count < n && s->pos < (j+1)*DIRENTS_PER_SECTOR; s->pos++) {
+      dirent_t* dirent = (dirent_t*)buf+s->pos%DIRENTS_PER_SECTOR;
+      if(!dirent->fname[0]) continue; // empty entry
+      FS_DirEntry_t* e = &entries[count++];
+      memcpy(e->name, dirent->fname, MAX_NAME);
+      e->name[MAX_NAME-1] = '\0';
+      e->inode = dirent->inode;
+      e->type = e->size = -1;
+      inode_t* child = iget(dirent->inode);
+      if(child) {
+	inode_rdlock(child); // the file may be being written
+	e->type = child->type == 1 ? 1 : 0;
+	e->size = child->size;
+	inode_unlock(child);
+	iput(child, 0);
+      }
+    }
+    bcache_put(buf, 0);
+  }
+  dprintf("... read %d entries, cursor at %d\n", count, s->pos);
+  return count;
+}
+
+static int dir_seek(dir_stream_t* s, int cursor)
+{
+  if(cursor < 0) {
+    dprintf("... cursor %d out of bound\n", cursor);
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  s->pos = cursor;
+  return 0;
+}
+
+static int dir_close(dir_stream_t* s)
+{
+  dprintf("Dir_Close(%d):\n", (int)(s-dir_streams));
+  iput(s->node, 0);
+  __atomic_fetch_sub(&open_count[s->inode], 1, __ATOMIC_RELEASE);
+  s->node = NULL;
+  __atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* the checker (FS_Check()): with the file system to itself, and synced
+   so that the disk has all of it, the checker makes three passes, the
+   first two spread over CHECK_THREADS threads: the inode table is
+   copied, a batch of sectors at a time, and each inode checked on its
+   own; the directory tree is walked from the root, the threads taking
+   the directories to read from a shared queue, each inode being
+   claimed (and its sectors marked used) by the first entry reaching
+   it, atomically, so that any other entry naming it is a bad one;
+   what was reached is then compared with the bitmaps, which are
+   rewritten from it if asked to repair */
+
+#define CHECK_THREADS 8
+#define CHECK_BATCH 64 // inode table sectors read at once
+// the most runs of sectors an inode may have (see check_runs())
+#define CHECK_RUNS (MAX_SECTORS_PER_FILE+INODE_EXTENTS+MAX_SECTOR_SIZE/sizeof(extent_t)+1)
+
+// a repair to make to a directory
+typedef struct {
+  int dir;
+  int slot; // the entry to drop, or -1 to set the size
+  int size;
+} check_fix_t;
+
+static struct {
+  inode_t* inodes;        // the copy of the inode table
+  char* bad;              // set for the inodes whose content is bad
+  unsigned char* reached; // the inodes reached (in the inode bitmap's layout)
+  unsigned char* used;    // the sectors used (in the sector bitmap's layout)
+  int next;               // the next inode table sector to copy
+  pthread_mutex_t lock;   // protects the queue and the repairs
+  pthread_cond_t work;    // signaled when a directory is queued, or the walk is over
+  int* queue;             // the directories to read (each one queued once at most)
+  int qhead, qcount;
+  int active;             // directories being read
+  check_fix_t* fixes;     // the repairs found
+  int nfixes, fix_capacity;
+  int error;              // set if something couldn't be read (or allocated)
+  FS_CheckReport_t report;
+} check = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+#define CHECK_COUNT(field, n) __atomic_add_fetch(&check.report.field, (n), __ATOMIC_RELAXED)
+
+static inline void check_fail()
+{
+  __atomic_store_n(&check.error, 1, __ATOMIC_RELAXED);
+}
+
+// set bit 'i' of 'bits' (laid out as the bitmaps) atomically; return
+// whether it was set already
+static inline int check_claim(unsigned char* bits, int i)
+{
+  unsigned char mask = 0x80 >> (i%8);
+  return (__atomic_fetch_or(&bits[i/8], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static inline int check_bit(const unsigned char* bits, int i)
+{
+  return (bits[i/8] >> (7-i%8)) & 1;
+}
+
+// the runs of sectors holding the data of an inode (from the copy of
+// the inode table, the indirect extents being read into 'buf'),
+// followed by its indirect sector, if any, as a run of one; return
+// the number of data runs (with 'nruns' counting the indirect sector
+// as well), -1 if the inode is bad (its type, its size, or a run
+// outside the data sectors), or -2 if it can't be read
+static int check_runs(inode_t* node, extent_t* runs, char* buf, int* nruns, long* nblocks)
+{
+  int first = data_start_sector();
+  int n = 0;
+  long blocks = 0;
+  *nruns = 0;
+  *nblocks = 0;
+  switch(node->type) {
+  case 0: case 1: break;
+  case COMPRESSED_FILE:
+    if(fs_version < FS_VERSION_COMPRESSED) return -1;
+    break;
+  case INLINE_FILE:
+    return fs_version >= FS_VERSION_INLINE && node->size >= 0 && node->size <= INLINE_SIZE ? 0 : -1;
+  default:
+    return -1;
+  }
+  if(node->size < 0) return -1;
+
+  if(fs_version == FS_VERSION_BLOCKLIST) {
+    for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+      int sector = node->data[i];
+      if(!sector) continue;
+      // the blocks come first, with no hole in between
+      if(sector < first || sector >= total_sectors || i != blocks) return -1;
+      if(n > 0 && runs[n-1].start+runs[n-1].length == sector) runs[n-1].length++;
+      else {
+	runs[n].start = sector;
+	runs[n].length = 1;
+	n++;
+      }
+      blocks++;
+    }
+    *nruns = n;
+  } else {
+    if(node->nextents < 0 || node->nextents > MAX_EXTENTS) return -1;
+    if(node->indirect && (node->indirect < first || node->indirect >= total_sectors)) return -1;
+    if(node->nextents > INODE_EXTENTS && (!node->indirect || Disk_Read(node->indirect, buf) < 0))
+      return node->indirect ? -2 : -1;
+    for(int i=0; i<node->nextents; i++) {
+      extent_t* ext = i < INODE_EXTENTS ? &node->extent[i] : (extent_t*)buf+(i-INODE_EXTENTS);
+      if(ext->length < 0) return -1;
+      if(!ext->length) continue;
+      if(ext->start < first || ext->start > total_sectors-ext->length) return -1;
+      runs[n++] = *ext;
+      blocks += ext->length;
+    }
+    *nruns = n;
+    if(node->indirect) {
+      runs[*nruns].start = node->indirect;
+      runs[*nruns].length = 1;
+      (*nruns)++;
+    }
+  }
+  if(node->type == 0 && node->size > blocks*sector_size) return -1;
+  *nblocks = blocks;
+  return n;
+}
+
+// the first pass: copy the inode table and check each inode
+static void* check_table(void* arg)
+{
+  extent_t runs[CHECK_RUNS];
+  char buf[MAX_SECTOR_SIZE];
+  char* table = malloc(CHECK_BATCH*sector_size);
+  if(!table) {
+    check_fail();
+    return NULL;
+  }
+  for(;;) {
+    int first = __atomic_fetch_add(&check.next, CHECK_BATCH, __ATOMIC_RELAXED);
+    if(first >= INODE_TABLE_SECTORS) break;
+    int n = INODE_TABLE_SECTORS-first < CHECK_BATCH ? INODE_TABLE_SECTORS-first : CHECK_BATCH;
+    if(Disk_ReadRange(INODE_TABLE_START_SECTOR+first, n, table) < 0) {
+      check_fail();
+      break;
+    }
+    for(int inum=first*INODES_PER_SECTOR; inum<(first+n)*INODES_PER_SECTOR && inum<max_files; inum++) {
+      inode_t* node = &check.inodes[inum];
+      memcpy(node, table+(inode_sector(inum)-INODE_TABLE_START_SECTOR-first)*sector_size+inode_offset(inum),
+	     sizeof(inode_t));
+      int nruns;
+      long nblocks;
+      int ret = check_runs(node, runs, buf, &nruns, &nblocks);
+      if(ret == -2) check_fail();
+      check.bad[inum] = ret < 0;
+    }
+  }
+  free(table);
+  return NULL;
+}
+
+// note a repair to make
+static void check_fix(int dir, int slot, int size)
+{
+  pthread_mutex_lock(&check.lock);
+  if(check.nfixes == check.fix_capacity) {
+    int capacity = check.fix_capacity ? 2*check.fix_capacity : 64;
+    check_fix_t* fixes = realloc(check.fixes, capacity*sizeof(check_fix_t));
+    if(!fixes) {
+      pthread_mutex_unlock(&check.lock);
+      check_fail();
+      return;
+    }
+    check.fixes = fixes;
+    check.fix_capacity = capacity;
+  }
+  check.fixes[check.nfixes++] = (check_fix_t){ dir, slot, size };
+  pthread_mutex_unlock(&check.lock);
+}
+
+// claim an inode named by a directory entry (or the root): mark its
+// sectors used and queue it if it's a directory; return -1 if the
+// inode is bad or was claimed already
+static int check_reach(int inum, extent_t* runs, char* buf)
+{
+  if(check.bad[inum] || check_claim(check.reached, inum)) return -1;
+  inode_t* node = &check.inodes[inum];
+  int nruns;
+  long nblocks;
+  if(check_runs(node, runs, buf, &nruns, &nblocks) < 0) check_fail(); // it was fine in the first pass
+  int shared = 0, sectors = 0;
+  for(int i=0; i<nruns; i++) {
+    for(int j=0; j<runs[i].length; j++)
+      shared += check_claim(check.used, runs[i].start+j);
+    sectors += runs[i].length;
+  }
+  CHECK_COUNT(inodes, 1);
+  CHECK_COUNT(sectors, sectors);
+  if(shared) CHECK_COUNT(shared_sectors, shared);
+  if(node->type == 1) {
+    CHECK_COUNT(directories, 1);
+    pthread_mutex_lock(&check.lock);
+    check.queue[check.qhead+check.qcount++] = inum;
+    pthread_cond_signal(&check.work);
+    pthread_mutex_unlock(&check.lock);
+  }
+  return 0;
+}
+
+// an entry of the directory being read
+typedef struct {
+  int slot;
+  dirent_t* dirent;
+} check_entry_t;
+
+// by name, then slot
+static int check_cmp_entry(const void* a, const void* b)
+{
+  const check_entry_t* x = (const check_entry_t*)a;
+  const check_entry_t* y = (const check_entry_t*)b;
+  int c = strncmp(x->dirent->fname, y->dirent->fname, MAX_NAME);
+  return c ? c : x->slot-y->slot;
+}
+
+// read a directory and claim the inodes its entries name
+static void check_dir(int dir, extent_t* runs, char* buf)
+{
+  inode_t* node = &check.inodes[dir];
+  int nruns;
+  long nblocks;
+  int n = check_runs(node, runs, buf, &nruns, &nblocks);
+  int nslots = nblocks*DIRENTS_PER_SECTOR;
+  char* data = malloc(nblocks*sector_size+1);
+  check_entry_t* entries = malloc(nslots*sizeof(check_entry_t)+1);
+  if(n < 0 || !data || !entries) {
+    check_fail();
+    free(data);
+    free(entries);
+    return;
+  }
+  for(int i=0, block=0; i<n; block+=runs[i].length, i++) {
+    if(Disk_ReadRange(runs[i].start, runs[i].length, data+(size_t)block*sector_size) < 0) {
+      check_fail();
+      free(data);
+      free(entries);
+      return;
+    }
+  }
+
+  // the entries in use (the others are holes), by name, so that a
+  // name given twice is told apart
+  int count = 0;
+  for(int slot=0; slot<nslots; slot++) {
+    dirent_t* dirent = (dirent_t*)(data+(slot/DIRENTS_PER_SECTOR)*sector_size)+slot%DIRENTS_PER_SECTOR;
+    if(!dirent->fname[0]) continue;
+    entries[count].slot = slot;
+    entries[count].dirent = dirent;
+    count++;
+  }
+  qsort(entries, count, sizeof(check_entry_t), check_cmp_entry);
 
-    // if we can't open the file; it means the file does not exist, we
-    // need to create a new file system on disk
-    if(diskErrno == E_OPENING_FILE) {
-      dprintf("... couldn't open file, create new file system\n");
+  int good = 0;
+  for(int i=0; i<count; i++) {
+    dirent_t* dirent = entries[i].dirent;
+    if(memchr(dirent->fname, 0, MAX_NAME) && !illegal_filename(dirent->fname) &&
+       (i == 0 || strncmp(dirent->fname, entries[i-1].dirent->fname, MAX_NAME)) &&
+       dirent->inode >= 0 && dirent->inode < max_files && check_reach(dirent->inode, runs, buf) == 0) {
+      good++;
+      continue;
+    }
+    dprintf("... bad entry %d of directory %d\n", entries[i].slot, dir);
+    CHECK_COUNT(bad_dirents, 1);
+    check_fix(dir, entries[i].slot, 0);
+  }
+  if(count != node->size) {
+    dprintf("... directory %d has %d entries, not %d\n", dir, count, node->size);
+    CHECK_COUNT(bad_sizes, 1);
+  }
+  if(good != node->size) check_fix(dir, -1, good);
+  free(data);
+  free(entries);
+}
 
-      // format superblock
-      char buf[SECTOR_SIZE];
-      memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
-      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
-	dprintf("... failed to format superblock\n");
-	osErrno = E_GENERAL;
+// the second pass: read the directories queued until there's none
+// left, and none being read that could queue more
+static void* check_walk(void* arg)
+{
+  extent_t runs[CHECK_RUNS];
+  char buf[MAX_SECTOR_SIZE];
+  pthread_mutex_lock(&check.lock);
+  for(;;) {
+    while(!check.qcount && check.active) pthread_cond_wait(&check.work, &check.lock);
+    if(!check.qcount) break;
+    int dir = check.queue[check.qhead++];
+    check.qcount--;
+    check.active++;
+    pthread_mutex_unlock(&check.lock);
+    check_dir(dir, runs, buf);
+    pthread_mutex_lock(&check.lock);
+    if(--check.active == 0 && !check.qcount) pthread_cond_broadcast(&check.work);
+  }
+  pthread_mutex_unlock(&check.lock);
+  return NULL;
+}
+
+// run a pass on CHECK_THREADS threads, the calling one included
+static void check_pass(void* (*pass)(void*))
+{
+  pthread_t threads[CHECK_THREADS-1];
+  int n = 0;
+  while(n < CHECK_THREADS-1 && !pthread_create(&threads[n], NULL, pass, NULL)) n++;
+  pass(NULL);
+  while(n > 0) pthread_join(threads[--n], NULL);
+}
+
+// the third pass: count the bits of the bitmaps that are wrong, and
+// the inodes marked in use but not reached (the bitmaps are loaded)
+static void check_bitmaps()
+{
+  unsigned char* bits = (unsigned char*)inode_bitmap.words;
+  for(int i=0; i<max_files; i++) {
+    int marked = check_bit(bits, i);
+    if(marked == check_bit(check.reached, i)) continue;
+    check.report.inode_bitmap_errors++;
+    if(marked && check.bad[i]) check.report.bad_inodes++;
+    else if(marked) check.report.lost_inodes++;
+  }
+  bits = (unsigned char*)sector_bitmap.words;
+  for(int i=0; i<SECTOR_BITMAP_SIZE; i++) {
+    unsigned char diff = bits[i] ^ check.used[i];
+    if(i == total_sectors/8) diff &= (unsigned char)(0xff << (8-total_sectors%8)); // the leftover bits
+    check.report.sector_bitmap_errors += __builtin_popcount(diff);
+  }
+}
+
+// make the repairs found: drop the bad entries, fix the sizes, free the
+// inodes marked in use but not reached, rewrite the bitmaps, and sync
+static int check_repair()
+{
+  for(int i=0; i<check.nfixes; i++) {
+    check_fix_t* fix = &check.fixes[i];
+    inode_t* node = iget(fix->dir);
+    if(!node) return -1;
+    if(fix->slot >= 0) {
+      int sector = bmap(node, fix->slot/DIRENTS_PER_SECTOR, NULL);
+      char* buf = sector > 0 ? bcache_get(sector, 0) : NULL;
+      if(!buf) {
+	iput(node, 0);
 	return -1;
       }
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+      memset((dirent_t*)buf+fix->slot%DIRENTS_PER_SECTOR, 0, sizeof(dirent_t));
+      bcache_put(buf, 1);
+    } else node->size = fix->size;
+    // the name index will be rebuilt when needed
+    icache_entry_t* e = icache_entry(node);
+    dindex_free(e->dindex);
+    e->dindex = NULL;
+    iput(node, 1);
+  }
 
-      // format inode bitmap (reserve the first inode to root)
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
-      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-	     (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
-      
-      // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-		  DATABLOCK_START_SECTOR);
-      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-	     (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
-      
-      // format inode tables
-      for(int i=0; i<INODE_TABLE_SECTORS; i++) {
-	memset(buf, 0, SECTOR_SIZE);
-	if(i==0) {
-	  // the first inode table entry is the root directory
-	  ((inode_t*)buf)->size = 0;
-	  ((inode_t*)buf)->type = 1;
-	}
-	if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
-	  dprintf("... failed to format inode table\n");
-	  osErrno = E_GENERAL;
-	  return -1;
-	}
-      }
-      dprintf("... formatted inode table (start=%d, num=%d)\n",
-	     (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
-      
-      // we need to synchronize the disk to the backstore file (so
-      // that we don't lose the formatted disk)
-      if(Disk_Save(bs_filename) < 0) {
-	// if can't write to file, something's wrong with the backstore
-	dprintf("... failed to save disk to file '%s'\n", bs_filename);
-	osErrno = E_GENERAL;
-	return -1;
-      } else {
-	// everything's good now, boot is successful
-	dprintf("... successfully formatted disk, boot successful\n");
-	memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-	return 0;
+  // the inodes not reached are cleared, as if removed
+  unsigned char* bits = (unsigned char*)inode_bitmap.words;
+  for(int i=0; i<max_files; i++) {
+    if(!check_bit(bits, i) || check_bit(check.reached, i)) continue;
+    inode_t* node = iget(i);
+    if(!node) return -1;
+    cindex_drop(node);
+    memset(node, 0, sizeof(inode_t));
+    iput(node, 1);
+  }
+
+  bitmap_t* bitmaps[] = { &inode_bitmap, &sector_bitmap };
+  unsigned char* from[] = { check.reached, check.used };
+  int sizes[] = { INODE_BITMAP_SIZE, SECTOR_BITMAP_SIZE };
+  for(int i=0; i<2; i++) {
+    pthread_mutex_lock(&bitmaps[i]->lock);
+    memcpy(bitmaps[i]->words, from[i], sizes[i]);
+    memset(bitmaps[i]->dirty, 1, bitmaps[i]->num);
+    bitmaps[i]->hint = 0;
+    pthread_mutex_unlock(&bitmaps[i]->lock);
+  }
+
+  // the paths resolved through the entries dropped are forgotten
+  pthread_mutex_lock(&dcache_lock);
+  dcache_reset();
+  pthread_mutex_unlock(&dcache_lock);
+  dprintf("... repaired the file system\n");
+  return fs_sync();
+}
+
+static int fs_check(int repair, FS_CheckReport_t* report)
+{
+  dprintf("FS_Check(%d):\n", repair);
+  memset(report, 0, sizeof(FS_CheckReport_t));
+  if(fs_sync() < 0) return -1;
+
+  memset(&check.report, 0, sizeof(FS_CheckReport_t));
+  check.next = check.qhead = check.qcount = check.active = 0;
+  check.nfixes = check.fix_capacity = 0;
+  check.fixes = NULL;
+  check.error = 0;
+  check.inodes = malloc(max_files*sizeof(inode_t));
+  check.bad = calloc(max_files, 1);
+  check.reached = calloc(INODE_BITMAP_SIZE, 1);
+  check.used = calloc(SECTOR_BITMAP_SIZE, 1);
+  check.queue = malloc(max_files*sizeof(int));
+  pthread_mutex_lock(&inode_bitmap.lock);
+  int loaded = bitmap_need(&inode_bitmap) == 0;
+  pthread_mutex_unlock(&inode_bitmap.lock);
+  pthread_mutex_lock(&sector_bitmap.lock);
+  loaded = loaded && bitmap_need(&sector_bitmap) == 0;
+  pthread_mutex_unlock(&sector_bitmap.lock);
+
+  int ret = -1;
+  if(check.inodes && check.bad && check.reached && check.used && check.queue && loaded) {
+    check_pass(check_table);
+    if(!check.error && (check.bad[0] || check.inodes[0].type != 1)) {
+      dprintf("... the root directory is bad\n");
+      check.report.bad_inodes = 1;
+    } else if(!check.error) {
+      extent_t runs[CHECK_RUNS];
+      char buf[MAX_SECTOR_SIZE];
+      int reserved = data_start_sector();
+      for(int i=0; i<reserved; i++) check_claim(check.used, i);
+      check_reach(0, runs, buf);
+      check_pass(check_walk);
+      if(!check.error) {
+	check_bitmaps();
+	FS_CheckReport_t* r = &check.report;
+	ret = (r->bad_dirents || r->bad_sizes || r->shared_sectors ||
+	       r->inode_bitmap_errors || r->sector_bitmap_errors) ? 1 : 0;
+	dprintf("... checked %d inodes, %d directories, %d sectors\n", r->inodes, r->directories, r->sectors);
+	if(ret && repair && check_repair() < 0) ret = -1;
       }
-    } else {
-      // something wrong loading the file: invalid param or error reading
-      dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
-      osErrno = E_GENERAL; 
-      return -1;
-    }
-  } else {
-    dprintf("... load disk from file '%s' successful\n", bs_filename);
-    
-    // we successfully loaded the disk, we need to do two more checks,
-    // first the file size must be exactly the size as expected (thiis
-    // supposedly should be folded in Disk_Load(); and it's not)
-    int sz = 0;
-    FILE* f = fopen(bs_filename, "r");
-    if(f) {
-      fseek(f, 0, SEEK_END);
-      sz = ftell(f);
-      fclose(f);
-    }
-    if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-      dprintf("... check size of file '%s' failed\n", bs_filename);
-      osErrno = E_GENERAL;
-      return -1;
     }
-    dprintf("... check size of file '%s' successful\n", bs_filename);
-    
-    // check magic
-    if(check_magic()) {
-      // everything's good by now, boot is successful
-      dprintf("... check magic successful\n");
-      memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-      return 0;
-    } else {      
-      // mismatched magic number
-      dprintf("... check magic failed, boot failed\n");
-      osErrno = E_GENERAL;
-      return -1;
+  }
+  *report = check.report;
+  free(check.inodes);
+  free(check.bad);
+  free(check.reached);
+  free(check.used);
+  free(check.queue);
+  free(check.fixes);
+  if(ret < 0) osErrno = E_GENERAL;
+  return ret;
+}
+
+/* the entry points: the functions above expect the caller to hold the
+   right locks, and the ones below take them, always in this order:
+
+   - 'fs_lock', shared by all calls and taken exclusively to boot and
+     to sync, so these see a quiescent file system;
+   - 'ns_lock', shared by the calls looking up names and taken
+     exclusively by the ones adding or removing names;
+   - the lock of a file descriptor, serializing the calls using it;
+   - the lock of an inode, shared by readers and taken exclusively by
+     writers, so that reads of a file scale with the threads;
+   - 'dindex_lock' and 'icache_lock', then the leaf locks of the
+     bitmaps, the buffer cache stripes, the path cache and the pools.
+*/
+
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+// initialize the locks embedded in the caches and tables (once)
+static void fs_locks_init()
+{
+  for(int s=0; s<BCACHE_STRIPES; s++)
+    pthread_mutex_init(&bcache[s].lock, NULL);
+  for(int i=0; i<ICACHE_SIZE; i++)
+    pthread_rwlock_init(&icache[i].lock, NULL);
+  for(int i=0; i<MAX_DIR_STREAMS; i++)
+    pthread_mutex_init(&dir_streams[i].lock, NULL);
+  pthread_key_create(&tcache_key, tcache_exit);
+}
+
+static void ns_enter(int exclusive)
+{
+  pthread_rwlock_rdlock(&fs_lock);
+  if(exclusive) pthread_rwlock_wrlock(&ns_lock);
+  else pthread_rwlock_rdlock(&ns_lock);
+}
+
+static void ns_leave()
+{
+  pthread_rwlock_unlock(&ns_lock);
+  pthread_rwlock_unlock(&fs_lock);
+}
+
+// make a namespace operation durable, once the locks are released
+// (see journal_end())
+static void journal_commit(int seq)
+{
+  if(seq > 0) journal_wait(seq);
+  else if(seq < 0) FS_Sync();
+}
+
+// lock the open file 'fd' and its inode (exclusively if 'write');
+// NULL (with osErrno set) if the file isn't open
+static open_file_t* fd_enter(int fd, int write)
+{
+  pthread_rwlock_rdlock(&fs_lock);
+  open_file_t* f = get_open_file(fd);
+  if(f) {
+    pthread_mutex_lock(&f->lock);
+    if(f->inode <= 0) { // closed meanwhile
+      pthread_mutex_unlock(&f->lock);
+      f = NULL;
     }
   }
+  if(!f) {
+    pthread_rwlock_unlock(&fs_lock);
+    osErrno = E_BAD_FD;
+    return NULL;
+  }
+  if(write) inode_wrlock(f->node);
+  else inode_rdlock(f->node);
+  return f;
+}
+
+static void fd_leave(open_file_t* f)
+{
+  inode_unlock(f->node);
+  pthread_mutex_unlock(&f->lock);
+  pthread_rwlock_unlock(&fs_lock);
+}
+
+int FS_BootWithOptions(char* backstore_fname, FS_Options_t* options)
+{
+  pthread_once(&locks_once, fs_locks_init);
+  if(remote_connect(backstore_fname, options) == 0) return 0;
+  pthread_rwlock_wrlock(&fs_lock);
+  int ret = fs_boot(backstore_fname, options);
+  pthread_rwlock_unlock(&fs_lock);
+  return ret;
 }
 
 int FS_Sync()
 {
-  if(Disk_Save(bs_filename) < 0) {
-    // if can't write to file, something's wrong with the backstore
-    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
-    osErrno = E_GENERAL;
-    return -1;
-  } else {
-    // everything's good now, sync is successful
-    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
-    return 0;
+  if(remote >= 0) return remote_call(RPC_SYNC, 0, 0, NULL, 0, NULL, 0);
+  STAT_BEGIN();
+  pthread_rwlock_wrlock(&fs_lock);
+  int ret = fs_sync();
+  pthread_rwlock_unlock(&fs_lock);
+  return STAT_END(FS_OP_SYNC, ret);
+}
+
+int FS_Snapshot(char* name)
+{
+  if(remote >= 0) return remote_path(RPC_SNAPSHOT, name);
+  pthread_rwlock_wrlock(&fs_lock);
+  int ret = fs_snapshot(name);
+  pthread_rwlock_unlock(&fs_lock);
+  return ret;
+}
+
+// the file system goes on being used while the image is written
+int FS_SnapshotSave(char* name, char* file)
+{
+  if(remote >= 0) {
+    char* names[] = { file };
+    return remote_batch(RPC_SNAPSHOT_SAVE, name, names, 1);
   }
+  pthread_rwlock_rdlock(&fs_lock);
+  int ret = fs_snapshot_save(name, file);
+  pthread_rwlock_unlock(&fs_lock);
+  return ret;
+}
+
+int FS_SnapshotDelete(char* name)
+{
+  if(remote >= 0) return remote_path(RPC_SNAPSHOT_DELETE, name);
+  pthread_rwlock_wrlock(&fs_lock);
+  int ret = fs_snapshot_delete(name);
+  pthread_rwlock_unlock(&fs_lock);
+  return ret;
+}
+
+// the checker has the file system to itself
+int FS_Check(int repair, FS_CheckReport_t* report)
+{
+  FS_CheckReport_t r;
+  memset(&r, 0, sizeof(r));
+  int ret;
+  if(remote >= 0) ret = remote_call(RPC_CHECK, 0, repair, NULL, 0, &r, sizeof(r));
+  else {
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = fs_check(repair, &r);
+    pthread_rwlock_unlock(&fs_lock);
+  }
+  if(report) *report = r;
+  return ret;
 }
 
 int File_Create(char* file)
 {
-  dprintf("File_Create('%s'):\n", file);
-  return create_file_or_directory(0, file);
+  if(remote >= 0) return remote_path(RPC_FILE_CREATE, file);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = file_create(file);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_FILE_CREATE, ret);
 }
 
 int File_Unlink(char* file)
 {
-    dprintf(" ... entering file unlink function\n");
-  dprintf("... File_Unlink ('%s'):\n", file);
-  //call delete_helper() to remove directory inod
-  return delete_helper(0, file);//type 0 for file
-  //return -1;
+  if(remote >= 0) return remote_path(RPC_FILE_UNLINK, file);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = file_unlink(file);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_FILE_UNLINK, ret);
 }
 
-/*int File_Unlink(char* file)
+int File_CreateBatch(char* dir, char** names, int n)
 {
-   int type;
-  char* pathname;
-  int child_inode;
-  char last_fname[MAX_NAME]; // file namee size is 30 byte
-  int parent_inode=follow_path(pathname,&child_inode,last_fname);
-  if (parent_inode>=0){
-    if(child_inode>=0){
-      if(remove_inode(type,parent_inode,child_inode)==0)
-      {
-        dprintf("Successful Removal of file \n ",pathname);
-        return 0;
-      }
-      else if (remove_inode(type, parent_inode,child_inode)==-2)
-      {
-        dprintf("...directory not empty");
-        return -2;
-      }
-      else if (remove_inode(type,parent_inode,child_inode)==-2)
-      {
-        dprintf("...type is wrong");
-        return -3;
-      }
-    }
-    if(child_inode < 1){ 
-        dprintf("...File does not exist");
-        osErrno = E_NO_SUCH_FILE;
-        return -1;
-    }
-    if (is_file_open(child_inode)==0)
-    {
-        dprintf("...File is already open");
-        osErrno = E_FILE_IN_USE;
-        return -1;       
+  if(remote >= 0) return remote_batch(RPC_FILE_CREATE_BATCH, dir, names, n);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = file_create_batch(dir, names, n);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_FILE_CREATE_BATCH, ret);
+}
+
+int File_UnlinkBatch(char* dir, char** names, int n)
+{
+  if(remote >= 0) return remote_batch(RPC_FILE_UNLINK_BATCH, dir, names, n);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = file_unlink_batch(dir, names, n);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_FILE_UNLINK_BATCH, ret);
+}
+
+int File_Open(char* file)
+{
+  if(remote >= 0) return remote_path(RPC_FILE_OPEN, file);
+  STAT_BEGIN();
+  ns_enter(0);
+  int ret = file_open(file);
+  ns_leave();
+  return STAT_END(FS_OP_FILE_OPEN, ret);
+}
+
+int File_Read(int fd, void* buffer, int size)
+{
+  if(remote >= 0) return remote_io(RPC_FILE_READ, fd, buffer, size);
+  STAT_BEGIN();
+  open_file_t* f = fd_enter(fd, 0);
+  if(!f) return STAT_END(FS_OP_FILE_READ, -1);
+  int ret = file_read(fd, buffer, size);
+  fd_leave(f);
+  return STAT_END(FS_OP_FILE_READ, ret);
+}
+
+int File_Write(int fd, void* buffer, int size)
+{
+  if(remote >= 0) return remote_io(RPC_FILE_WRITE, fd, buffer, size);
+  STAT_BEGIN();
+  open_file_t* f = fd_enter(fd, 1);
+  if(!f) return STAT_END(FS_OP_FILE_WRITE, -1);
+  int ret = file_write(fd, buffer, size);
+  fd_leave(f);
+  return STAT_END(FS_OP_FILE_WRITE, ret);
+}
+
+int File_Reserve(int fd, int bytes)
+{
+  if(remote >= 0) return remote_call(RPC_FILE_RESERVE, fd, bytes, NULL, 0, NULL, 0);
+  STAT_BEGIN();
+  open_file_t* f = fd_enter(fd, 1);
+  if(!f) return STAT_END(FS_OP_FILE_RESERVE, -1);
+  int ret = file_reserve(fd, bytes);
+  fd_leave(f);
+  return STAT_END(FS_OP_FILE_RESERVE, ret);
+}
+
+int File_Seek(int fd, int offset)
+{
+  if(remote >= 0) return remote_call(RPC_FILE_SEEK, fd, offset, NULL, 0, NULL, 0);
+  STAT_BEGIN();
+  open_file_t* f = fd_enter(fd, 0);
+  if(!f) return STAT_END(FS_OP_FILE_SEEK, -1);
+  int ret = file_seek(fd, offset);
+  fd_leave(f);
+  return STAT_END(FS_OP_FILE_SEEK, ret);
+}
+
+int File_Close(int fd)
+{
+  if(remote >= 0) return remote_call(RPC_FILE_CLOSE, fd, 0, NULL, 0, NULL, 0);
+  STAT_BEGIN();
+  pthread_rwlock_rdlock(&fs_lock);
+  // wait for the calls still using the descriptor
+  open_file_t* f = get_open_file(fd);
+  if(f) pthread_mutex_lock(&f->lock);
+  int ret = file_close(fd);
+  if(f) pthread_mutex_unlock(&f->lock);
+  pthread_rwlock_unlock(&fs_lock);
+  return STAT_END(FS_OP_FILE_CLOSE, ret);
+}
+
+int Dir_Create(char* path)
+{
+  if(remote >= 0) return remote_path(RPC_DIR_CREATE, path);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = dir_create(path);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_DIR_CREATE, ret);
+}
+
+int Dir_Unlink(char* path)
+{
+  if(remote >= 0) return remote_path(RPC_DIR_UNLINK, path);
+  STAT_BEGIN();
+  ns_enter(1);
+  journal_begin();
+  int ret = dir_unlink(path);
+  int seq = journal_end();
+  ns_leave();
+  journal_commit(seq);
+  return STAT_END(FS_OP_DIR_UNLINK, ret);
+}
+
+int Dir_Size(char* path)
+{
+  if(remote >= 0) return remote_path(RPC_DIR_SIZE, path);
+  STAT_BEGIN();
+  ns_enter(0);
+  int ret = dir_size(path);
+  ns_leave();
+  return STAT_END(FS_OP_DIR_SIZE, ret);
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+  if(remote >= 0)
+    return remote_call(RPC_DIR_READ, 0, size, path, path ? strlen(path)+1 : 0, buffer, size);
+  STAT_BEGIN();
+  ns_enter(0);
+  int ret = dir_read(path, buffer, size);
+  ns_leave();
+  return STAT_END(FS_OP_DIR_READ, ret);
+}
 
+int Dir_Open(char* path)
+{
+  if(remote >= 0) return remote_path(RPC_DIR_OPEN, path);
+  STAT_BEGIN();
+  ns_enter(0);
+  int ret = dir_open(path);
+  ns_leave();
+  return STAT_END(FS_OP_DIR_OPEN, ret);
+}
+
+// lock the directory stream 'dd' (with the namespace lock shared,
+// since the stream reads the directory's entries); return NULL if the
+// stream isn't open
+static dir_stream_t* dir_stream_enter(int dd)
+{
+  ns_enter(0);
+  dir_stream_t* s = (dd >= 0 && dd < MAX_DIR_STREAMS) ? &dir_streams[dd] : NULL;
+  if(s) {
+    pthread_mutex_lock(&s->lock);
+    if(!s->used || !s->node) { // not open, or closed meanwhile
+      pthread_mutex_unlock(&s->lock);
+      s = NULL;
     }
-  
   }
+  if(!s) {
+    ns_leave();
+    osErrno = E_BAD_FD;
+  }
+  return s;
+}
+
+static void dir_stream_leave(dir_stream_t* s)
+{
+  pthread_mutex_unlock(&s->lock);
+  ns_leave();
+}
+
+int Dir_Next(int dd, FS_DirEntry_t* entries, int n)
+{
+  if(remote >= 0)
+    return remote_call(RPC_DIR_NEXT, dd, n, NULL, 0, entries, n > 0 ? n*sizeof(FS_DirEntry_t) : 0);
+  STAT_BEGIN();
+  dir_stream_t* s = dir_stream_enter(dd);
+  if(!s) return STAT_END(FS_OP_DIR_NEXT, -1);
+  int ret = dir_next(s, entries, n);
+  dir_stream_leave(s);
+  return STAT_END(FS_OP_DIR_NEXT, ret);
+}
+
+int Dir_Tell(int dd)
+{
+  if(remote >= 0) return remote_call(RPC_DIR_TELL, dd, 0, NULL, 0, NULL, 0);
+  dir_stream_t* s = dir_stream_enter(dd);
+  if(!s) return -1;
+  int ret = s->pos;
+  dir_stream_leave(s);
+  return ret;
+}
+
+int Dir_Seek(int dd, int cursor)
+{
+  if(remote >= 0) return remote_call(RPC_DIR_SEEK, dd, cursor, NULL, 0, NULL, 0);
+  dir_stream_t* s = dir_stream_enter(dd);
+  if(!s) return -1;
+  int ret = dir_seek(s, cursor);
+  dir_stream_leave(s);
+  return ret;
+}
+
+int Dir_Close(int dd)
+{
+  if(remote >= 0) return remote_call(RPC_DIR_CLOSE, dd, 0, NULL, 0, NULL, 0);
+  STAT_BEGIN();
+  dir_stream_t* s = dir_stream_enter(dd);
+  if(!s) return STAT_END(FS_OP_DIR_CLOSE, -1);
+  int ret = dir_close(s);
+  dir_stream_leave(s);
+  return STAT_END(FS_OP_DIR_CLOSE, ret);
+}
+
+/* asynchronous requests: a queue of submitted requests feeds a pool of
+   worker threads (started with the first request), which go through
+   the entry points above and queue the outcome for File_Reap(); the
+   requests in flight, counted from their submission to their reaping,
+   never exceed the depth of the queues, so completions always fit;
+   the workers also take the read-ahead of sequential reads off the
+   readers, from a queue of its own (dropping read-ahead that doesn't
+   fit, since it's only a hint) */
 
-  return -1;
-}*/
+#define ASYNC_THREADS 4
+#define ASYNC_DEPTH 128
+#define RA_DEPTH 16
 
-int File_Open(char* file)
-{
-  dprintf("File_Open('%s'):\n", file);
-  int fd = new_file_fd();
-  if(fd < 0) {
-    dprintf("... max open files reached\n");
-    osErrno = E_TOO_MANY_OPEN_FILES;
-    return -1;
-  }
+typedef struct {
+  int inode;       // the file read ahead
+  unsigned boot;   // the boot it belongs to
+  int block;       // the first block to bring into the cache
+  int n;           // and the number of them (up to BMAP_PREFETCH)
+} readahead_t;
 
-  int child_inode;
-  follow_path(file, &child_inode, NULL);
-  if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-	    child_inode, child->size, child->type);
-
-    if(child->type != 0) {
-      dprintf("... error: '%s' is not a file\n", file);
-      osErrno = E_GENERAL;
-      return -1;
-    }
+static struct {
+  pthread_mutex_t lock;  // protects all of the below
+  pthread_cond_t work;   // signaled when a request is submitted
+  pthread_cond_t done;   // signaled when a request completes
+  FS_Request_t sq[ASYNC_DEPTH];    // the submitted requests (a ring)
+  int sq_head, sq_count;
+  FS_Completion_t cq[ASYNC_DEPTH]; // their completions (a ring)
+  int cq_head, cq_count;
+  int inflight;          // submitted but not reaped yet
+  readahead_t rq[RA_DEPTH]; // read-ahead to do (a ring)
+  int rq_head, rq_count;
+  int nthreads;          // the workers started
+} aio = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static pthread_once_t aio_once = PTHREAD_ONCE_INIT;
 
-    // initialize open file entry and return its index
-    open_files[fd].inode = child_inode;
-    open_files[fd].size = child->size;
-    open_files[fd].pos = 0;
-    return fd;
-  } else {
-    dprintf("... file '%s' is not found\n", file);
-    osErrno = E_NO_SUCH_FILE;
+// carry out a request like File_Read() or File_Write(); with an
+// offset, the fd's position is left as it was
+static int async_run(FS_Request_t* r)
+{
+  if(r->op != FS_READ && r->op != FS_WRITE) {
+    osErrno = E_GENERAL;
     return -1;
-  }  
+  }
+  int op = r->op == FS_READ ? FS_OP_FILE_READ : FS_OP_FILE_WRITE;
+  STAT_BEGIN();
+  open_file_t* f = fd_enter(r->fd, r->op == FS_WRITE);
+  if(!f) return STAT_END(op, -1);
+  int pos = f->pos;
+  int ret = r->offset >= 0 ? file_seek(r->fd, r->offset) : 0;
+  if(ret >= 0)
+    ret = r->op == FS_READ ? file_read(r->fd, r->buffer, r->size) :
+      file_write(r->fd, r->buffer, r->size);
+  if(r->offset >= 0) f->pos = pos;
+  fd_leave(f);
+  return STAT_END(op, ret);
 }
 
-int File_Read(int fd, void* buffer, int size){
-  
-  if(open_files[fd].inode == 0){// checking whether the file is open or not, return -1 if the file is not open
-    osErrno = E_BAD_FD;
-    return -1;
+// read ahead for a file, unless the file system was booted again
+// since or the file was closed; the blocks are mapped to sectors only
+// now, with the inode locked, since the file may have been truncated,
+// or unlinked and its inode reused, since the read-ahead was queued
+// (the sectors it had then may be free, or another file's)
+static void readahead_run(readahead_t* ra)
+{
+  ns_enter(0);
+  if(ra->boot == boot_count && is_file_open(ra->inode)) {
+    inode_t* node = iget(ra->inode);
+    if(node) {
+      // the inode lock keeps writers of the file from racing with
+      // the sectors being read
+      int sectors[BMAP_PREFETCH];
+      inode_rdlock(node);
+      bcache_prefetch(sectors, bmap_sectors(node, ra->block, ra->n, sectors));
+      inode_unlock(node);
+      iput(node, 0);
+    }
   }
+  ns_leave();
+}
 
-  dprintf(".....the initial size is %d\n",size);
- // inode_t* node = getInodeHelper(child_inode);
-
-  // this portion of the code is copied from add_inode function as we need the same functionality
-  int f_inode = open_files[fd].inode;
-
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+f_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-	
-	
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = f_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* node = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  
-  //memset(buffer,0,size);
-  int count = 0;// this variable will indicate how many bytes we have read, so initially it is 0
-  int beginSector = open_files[fd].pos / 512; // figure out which sector we want to read
-  dprintf("the current pos is %d\n",beginSector);
-  int beginByte;// for iterating bytes
-  char *temp = calloc(512,sizeof(char));
-  char *data =(char*) buffer;
-  int tempsize = size;
+static void* async_worker(void* arg)
+{
+  pthread_mutex_lock(&aio.lock);
+  for(;;) {
+    while(!aio.sq_count && !aio.rq_count) pthread_cond_wait(&aio.work, &aio.lock);
+    if(!aio.sq_count) {
+      readahead_t ra = aio.rq[aio.rq_head];
+      aio.rq_head = (aio.rq_head+1)%RA_DEPTH;
+      aio.rq_count--;
+      pthread_mutex_unlock(&aio.lock);
+      readahead_run(&ra);
+      pthread_mutex_lock(&aio.lock);
+      continue;
+    }
+    FS_Request_t r = aio.sq[aio.sq_head];
+    aio.sq_head = (aio.sq_head+1)%ASYNC_DEPTH;
+    aio.sq_count--;
+    pthread_mutex_unlock(&aio.lock);
 
-  /*if(node->data[0])
-    dprintf("...got something\n");*/
+    FS_Completion_t c = { r.user, async_run(&r), 0 };
+    if(c.result < 0) c.error = osErrno;
 
-  while(count < tempsize && node->data[beginSector]){// loop until the count value gets larger than the size or that particular file has some data
-    //dprintf("...... size is %d\n",tempsize);
+    pthread_mutex_lock(&aio.lock);
+    aio.cq[(aio.cq_head+aio.cq_count)%ASYNC_DEPTH] = c;
+    aio.cq_count++;
+    pthread_cond_broadcast(&aio.done);
+  }
+  return NULL;
+}
 
-    Disk_Read(node->data[beginSector],temp);
-    if(count == 0)// this indicates the first time, so we need to figure out the exact byte position
-      beginByte = open_files[fd].pos % 512;
-    else
-      beginByte = 0;// from the second round, we will alwasy begin from the start of a sector
-    /*for(int i = beginByte; i < 512; i++){
-      if(count < size)
-	    data[count++] = temp[i];
-    }*/
-    //int i =0;
-    while( beginByte < 512 && count < size){// loop until we reached the sector size or bytes we have read becomes greater than the size
-      data[count++] = temp[beginByte];
-      beginByte++;
-    }
-	beginSector++;
- 
+static void async_start()
+{
+  for(int i=0; i<ASYNC_THREADS; i++) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, async_worker, NULL)) break;
+    pthread_detach(thread);
+    aio.nthreads++;
   }
-  
-  open_files[fd].pos += count;// update the current position of the file
-  //dprintf("...... get outside the loop and count is %d and the position is %d\n",count,open_files[fd].pos);
-  return count;
 }
 
+// queue the read-ahead of some blocks of a file (with the file
+// system lock held)
+static void async_readahead(int inode, int block, int n)
+{
+  pthread_once(&aio_once, async_start);
+  pthread_mutex_lock(&aio.lock);
+  if(aio.nthreads && aio.rq_count < RA_DEPTH) {
+    readahead_t* ra = &aio.rq[(aio.rq_head+aio.rq_count)%RA_DEPTH];
+    ra->inode = inode;
+    ra->boot = boot_count;
+    ra->block = block;
+    ra->n = n < BMAP_PREFETCH ? n : BMAP_PREFETCH;
+    aio.rq_count++;
+    pthread_cond_signal(&aio.work);
+  }
+  pthread_mutex_unlock(&aio.lock);
+}
 
-int File_Write(int fd, void* buffer, int size)
+int File_Submit(FS_Request_t* requests, int count)
 {
-  /* YOUR CODE */
- if(open_files[fd].inode == 0){
-    osErrno = E_BAD_FD;
+  if(remote >= 0) return remote_submit(requests, count);
+  pthread_once(&aio_once, async_start);
+  pthread_mutex_lock(&aio.lock);
+  if(!aio.nthreads) {
+    pthread_mutex_unlock(&aio.lock);
+    osErrno = E_GENERAL;
     return -1;
   }
- // int child_inode = open_files[fd].inode;
-  //dprintf(".....the initial size is %d\n",size);
- // inode_t* node = getInodeHelper(child_inode);
-
+  int n = 0;
+  for(; n<count && aio.inflight<ASYNC_DEPTH; n++) {
+    aio.sq[(aio.sq_head+aio.sq_count)%ASYNC_DEPTH] = requests[n];
+    aio.sq_count++;
+    aio.inflight++;
+  }
+  if(n) pthread_cond_broadcast(&aio.work);
+  pthread_mutex_unlock(&aio.lock);
+  if(!n && count > 0) {
+    osErrno = E_QUEUE_FULL;
+    return -1;
+  }
+  return n;
+}
 
-  int f_inode = open_files[fd].inode;
+int File_Reap(FS_Completion_t* done, int max, int min)
+{
+  pthread_mutex_lock(&aio.lock);
+  if(min > max) min = max;
+  if(min > aio.inflight) min = aio.inflight;
+  while(aio.cq_count < min) pthread_cond_wait(&aio.done, &aio.lock);
+  int n = 0;
+  for(; n<max && aio.cq_count; n++) {
+    done[n] = aio.cq[aio.cq_head];
+    aio.cq_head = (aio.cq_head+1)%ASYNC_DEPTH;
+    aio.cq_count--;
+    aio.inflight--;
+  }
+  pthread_mutex_unlock(&aio.lock);
+  return n;
+}
 
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+f_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+/* the server: FS_Serve() accepts the connections of the programs
+   booting the image, through a Unix socket named after it, and a
+   thread for each connection reads its requests, makes the calls
+   through the entry points above and sends back the replies, in the
+   order of the requests; a client only uses the file descriptors and
+   directory streams it opened, and the ones it leaves open when it
+   disconnects are closed; on the client's side, the entry points
+   forward the calls to the server (with 'remote' the connection),
+   one at a time but for File_Submit(), whose requests are sent ahead
+   of their replies */
 
-  
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = f_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* node = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  
-  //memset(buffer,0,size);
-  int count = 0;
-  int beginSector = open_files[fd].pos / SECTOR_SIZE;
-  //dprintf("the current position in write function is %d\n",beginSector);
-  int beginByte;
-  //char *temp = calloc(512,sizeof(char));
-  char *temp =(char*) buffer;
-  //dprintf("....the data buffer is %s",data);
-  int tempsize = size;
+#define RPC_MAX_DATA (16<<20) // the most data a request or a reply carries
+#define RPC_MAX_IO (1<<20)    // reads and writes go through in pieces of this size
+#define RPC_WINDOW (64<<10)   // the data File_Submit() leaves in flight
 
-  while(count < size){// loop until the bytes written is less than the size
-    //dprintf("....the count is every loop is %d\n",count);
-    int firstUnused = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    //dprintf(".... the new sector is %d\n",newsec);
-    node->data[beginSector] = firstUnused;
-    char *writeBuffer = calloc(512,sizeof(char));
-    if(count == 0)
-      beginByte = open_files[fd].pos % 512;
-    else
-      beginByte = 0;
-    /*for(int j=beginByte; j< 512; j++){
-      if(tempsize > 0){
-        newbuf[j] = data[count++];
-        tempsize --;
-      }
-    }*/
-    dprintf("the new sector where will be written %d\n",node->data[beginSector]); 
-    while( beginByte < 512 && tempsize > 0){
-      writeBuffer[beginByte] = temp[count++];
-      beginByte++;
-      tempsize--;
-    }
-    dprintf("Written the following: %s\n", writeBuffer);
-    Disk_Write(node->data[beginSector++], writeBuffer);
-    //printf("...the value of count is %d\n",count);    
-    
+static struct {
+  int socket;         // the listening socket (-1 if not serving)
+  volatile int stop;  // set by FS_ServeStop()
+} server = { -1 };
 
-  }
-  open_files[fd].pos += count;
-  node->size += count;
-  open_files[fd].size += count;
-  Disk_Write(inode_sector, inode_buffer);
+typedef struct {
+  int socket;
+  unsigned char* fds; // one flag for each file descriptor, set if the client opened it
+  unsigned char dds[MAX_DIR_STREAMS]; // ... and for each directory stream
+  char* in;           // the data of the request
+  int incap;
+  char* out;          // the data of the reply
+  int outcap;
+} rpc_conn_t;
 
-  return count;
+static pthread_mutex_t remote_lock = PTHREAD_MUTEX_INITIALIZER; // one call at a time on 'remote'
 
-  //return -1;
+static int rpc_address(char* image, struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  return snprintf(addr->sun_path, sizeof(addr->sun_path), "%s.sock", image) <
+    (int)sizeof(addr->sun_path) ? 0 : -1;
 }
 
-int File_Seek(int fd, int offset)
+static int rpc_write(int s, const void* buf, int len)
 {
-  /* YOUR CODE */
-  dprintf("File_Seek (%d):\n",fd);
-  if(offset < 0 || open_files[fd].size < offset){
-    osErrno = E_SEEK_OUT_OF_BOUNDS;
-    return -1;
+  for(const char* p = buf; len > 0; ) {
+    ssize_t n = send(s, p, len, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n;
+    len -= n;
   }
-  
-  if(open_files[fd].inode = 0){
-    osErrno = E_BAD_FD;
-    return -1;
+  return 0;
+}
+
+static int rpc_read(int s, void* buf, int len)
+{
+  for(char* p = buf; len > 0; ) {
+    ssize_t n = recv(s, p, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1; // an error, or the other side is gone
+    p += n;
+    len -= n;
   }
+  return 0;
+}
 
-  open_files[fd].pos = offset;
+static int rpc_send_request(int s, rpc_request_t* q, const void* data)
+{
+  if(rpc_write(s, q, sizeof(rpc_request_t)) < 0) return -1;
+  return q->len > 0 ? rpc_write(s, data, q->len) : 0;
+}
+
+// receive a reply, its data going to 'out' (up to 'cap' bytes, the
+// rest is dropped)
+static int rpc_recv_reply(int s, rpc_reply_t* p, void* out, int cap)
+{
+  if(rpc_read(s, p, sizeof(rpc_reply_t)) < 0 || p->len < 0) return -1;
+  int n = p->len < cap ? p->len : cap;
+  if(n > 0 && rpc_read(s, out, n) < 0) return -1;
+  char rest[256];
+  for(int m; n < p->len; n += m) {
+    m = p->len-n < (int)sizeof(rest) ? p->len-n : (int)sizeof(rest);
+    if(rpc_read(s, rest, m) < 0) return -1;
+  }
   return 0;
 }
 
-int File_Close(int fd)
+// connect to the server of the image, if there's one and the options
+// allow it; return -1 if the file system is to be booted here instead
+static int remote_connect(char* image, FS_Options_t* options)
 {
-  dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
-    dprintf("... fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
+  if(remote >= 0) {
+    close(remote);
+    remote = -1;
+  }
+  struct sockaddr_un addr;
+  if(!options || !options->use_server || !image || rpc_address(image, &addr) < 0) return -1;
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s < 0) return -1;
+  if(connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(s); // no server (or a socket left over by one)
     return -1;
   }
-  if(open_files[fd].inode <= 0) {
-    dprintf("... fd=%d not an open file\n", fd);
-    osErrno = E_BAD_FD;
+  dprintf("... connected to the server of '%s'\n", image);
+  remote = s;
+  return 0;
+}
+
+// make a call through the server, with 'len' bytes of 'data'; the
+// data of the reply goes to 'out' (up to 'cap' bytes)
+static int remote_call(int op, int fd, int arg, const void* data, int len, void* out, int cap)
+{
+  rpc_request_t q = { op, fd, arg, -1, len > 0 ? len : 0 };
+  rpc_reply_t p;
+  pthread_mutex_lock(&remote_lock);
+  int ret = (rpc_send_request(remote, &q, data) < 0 || rpc_recv_reply(remote, &p, out, cap) < 0) ? -1 : 0;
+  pthread_mutex_unlock(&remote_lock);
+  if(ret < 0) {
+    dprintf("... lost the connection to the server\n");
+    osErrno = E_GENERAL;
     return -1;
   }
+  if(p.result < 0) osErrno = p.error;
+  return p.result;
+}
 
-  dprintf("... file closed successfully\n");
-  open_files[fd].inode = 0;
-  return 0;
+static int remote_path(int op, char* path)
+{
+  return remote_call(op, 0, 0, path, path ? strlen(path)+1 : 0, NULL, 0);
 }
 
-inode_t *getInodeHelper(int child_inode){
-//int child_inode;
-  //follow_path(file, &child_inode, NULL);
-  //if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+// File_Read() or File_Write() through the server, in pieces
+static int remote_io(int op, int fd, void* buffer, int size)
+{
+  int done = 0;
+  do {
+    int n = size-done < RPC_MAX_IO ? size-done : RPC_MAX_IO;
+    char* p = (char*)buffer+done;
+    int r = (op == RPC_FILE_READ) ? remote_call(op, fd, n, NULL, 0, p, n) :
+      remote_call(op, fd, n, p, n, NULL, 0);
+    if(r < 0) return done > 0 ? done : -1;
+    done += r;
+    if(r < n) break; // the end of the file, or no more space
+  } while(done < size);
+  return done;
+}
 
-    // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-	    child_inode, child->size, child->type);
-    return child;
- // }
+// a call on 'n' names in a directory (or on a name and a file, for
+// FS_SnapshotSave()), sent as a list of strings
+static int remote_batch(int op, char* dir, char** names, int n)
+{
+  int len = (dir ? strlen(dir) : 0)+1;
+  for(int i=0; i<n; i++) len += (names[i] ? strlen(names[i]) : 0)+1;
+  char* data = malloc(len);
+  if(!data) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  char* p = stpcpy(data, dir ? dir : "")+1;
+  for(int i=0; i<n; i++) p = stpcpy(p, names[i] ? names[i] : "")+1;
+  int ret = remote_call(op, 0, n, data, len, NULL, 0);
+  free(data);
+  return ret;
 }
 
-int delete_helper(int type, char *pathname) {
-    int child_inode;
-    char last_fname[MAX_NAME];// MAX_NAME = 16 bytes
-    int parent_inode = follow_path(pathname, &child_inode, last_fname);
+// the bytes a request of File_Submit() reads or writes
+static inline int rpc_io_size(FS_Request_t* r)
+{
+  return r->size <= 0 ? 0 : (r->size < RPC_MAX_IO ? r->size : RPC_MAX_IO);
+}
 
-    //first check if file is open 
-    if (is_file_open(child_inode)==1) {
-        /* when file is open the above function 
-        returns 1 and remove inode will not be called */
-        dprintf("... file '%s' is currently open\n", last_fname);
-        osErrno = E_FILE_IN_USE;
-        return -1;
-    }
-    //Check if file or directory exists or not
-    if(child_inode<0) //if childnode is less than zero it means it doesnt exist on the list
-    {
-      dprintf(" ...  or directory does not exist\n");
-      if(type){
-      osErrno = E_NO_SUCH_FILE;
-      }
+// the requests of File_Submit() are sent while the data in flight
+// fits in the window (or if none is in flight), so that neither side
+// waits with the socket's buffers full; the completions are queued
+// for File_Reap() as if the workers had made them
+static int remote_submit(FS_Request_t* requests, int count)
+{
+  pthread_mutex_lock(&aio.lock);
+  int n = ASYNC_DEPTH-aio.inflight;
+  if(n > count) n = count;
+  if(n < 0) n = 0;
+  aio.inflight += n;
+  pthread_mutex_unlock(&aio.lock);
+  if(!n && count > 0) {
+    osErrno = E_QUEUE_FULL;
+    return -1;
+  }
+
+  FS_Completion_t done[ASYNC_DEPTH];
+  int sent = 0, received = 0, inflight = 0, broken = 0;
+  pthread_mutex_lock(&remote_lock);
+  while(received < n) {
+    FS_Request_t* r = &requests[sent < n ? sent : n-1];
+    if(sent < n && !broken && (sent == received || inflight+rpc_io_size(r) <= RPC_WINDOW)) {
+      int size = rpc_io_size(r);
+      rpc_request_t q = { r->op == FS_READ ? RPC_FILE_READ : (r->op == FS_WRITE ? RPC_FILE_WRITE : -1),
+			  r->fd, r->size <= 0 ? r->size : size, r->offset, r->op == FS_WRITE ? size : 0 };
+      if(rpc_send_request(remote, &q, r->buffer) < 0) broken = 1;
       else {
-      osErrno = E_NO_SUCH_DIR;
+	inflight += size;
+	sent++;
       }
-      return  -1;
+      continue;
     }
-    //Removing file or directory from inode
-    if (parent_inode >= 0) {
-      if (child_inode >= 0) {
-      if (remove_inode(type, parent_inode, child_inode)==0) {
-      // inode remove is successful when the above function returns 0
-      if(type){
-      dprintf("... directory '%s' successfully Unlinked\n", pathname);
-      }
-      else {
-        dprintf("... file '%s' successfully Unlinked\n", pathname);
-      }
-      return 0;
-      dprintf("DONE UNLINKING");
-      } 
-      else {
-      if (remove_inode(type, parent_inode, child_inode) == -2) {
-      dprintf("... directory '%s' is not empty.\n", pathname);
-      osErrno = E_DIR_NOT_EMPTY;
-      } 
-      else if (remove_inode(type, parent_inode, child_inode) == -3) {
-      dprintf("... wrong type '%s'.\n", pathname);
-      osErrno = E_GENERAL;
-      }
-      else { 
-      dprintf("... file/directory '%s' unable to Unlink\n", pathname);
-      osErrno = E_GENERAL;
-      }
-      return -1;
-       }
-      } 
-      } 
-    
-}
-int Dir_Create(char* path){
-  dprintf("Dir_Create('%s'):\n", path);
-  return create_file_or_directory(1, path);
+    r = &requests[received];
+    rpc_reply_t p;
+    done[received].user = r->user;
+    if(received < sent && !broken &&
+       rpc_recv_reply(remote, &p, r->op == FS_READ ? r->buffer : NULL, r->op == FS_READ ? rpc_io_size(r) : 0) == 0) {
+      done[received].result = p.result;
+      done[received].error = p.result < 0 ? p.error : 0;
+    } else {
+      broken = 1;
+      done[received].result = -1;
+      done[received].error = E_GENERAL;
+    }
+    inflight -= rpc_io_size(r);
+    received++;
+  }
+  pthread_mutex_unlock(&remote_lock);
+
+  pthread_mutex_lock(&aio.lock);
+  for(int i=0; i<n; i++) {
+    aio.cq[(aio.cq_head+aio.cq_count)%ASYNC_DEPTH] = done[i];
+    aio.cq_count++;
+  }
+  pthread_cond_broadcast(&aio.done);
+  pthread_mutex_unlock(&aio.lock);
+  return n;
 }
 
-int Dir_Unlink(char* path){
-  /* YOUR CODE */
-dprintf("... entering directory unlink function\n");
-  if (path == "/")
-	{
-    dprintf("directory %s is a root directory",path);
-		osErrno = E_ROOT_DIR;
-		return -1;
-	}
-  dprintf("... Dir_Unlink ('%s'):\n", path);
-  //call delete_helper() to remove directory inode
-  return delete_helper(1,path);// type 1 for directory 
-  return -1;
+// make sure a buffer of a connection holds 'size' bytes
+static int rpc_room(char** buf, int* cap, int size)
+{
+  if(size <= *cap) return 0;
+  char* p = realloc(*buf, size);
+  if(!p) return -1;
+  *buf = p;
+  *cap = size;
+  return 0;
 }
 
-int Dir_Size(char* path){
-  /* YOUR CODE */
-  int child_inode;
-  follow_path(path, &child_inode, NULL); // usign this function we find out 
-                                        //the child inode associated with the path
-  if(child_inode >= 0) { 
-    inode_t* directory = getInodeHelper(child_inode); // load the inode from the given inode no
-    return directory->size * sizeof(dirent_t);
+// the data a reply to the request may carry
+static int rpc_reply_room(rpc_request_t* q)
+{
+  int n = q->arg > 0 ? q->arg : 0;
+  switch(q->op) {
+  case RPC_FILE_READ: return n < RPC_MAX_IO ? n : RPC_MAX_IO;
+  case RPC_DIR_READ: return n < RPC_MAX_DATA ? n : RPC_MAX_DATA;
+  case RPC_DIR_NEXT: return n < RPC_MAX_DATA/(int)sizeof(FS_DirEntry_t) ? n*sizeof(FS_DirEntry_t) : RPC_MAX_DATA;
+  case RPC_CACHE_STATS: return sizeof(FS_CacheStats_t);
+  case RPC_ALLOC_STATS: return sizeof(FS_AllocStats_t);
+  case RPC_STATS: return sizeof(FS_Stats_t);
+  case RPC_CHECK: return sizeof(FS_CheckReport_t);
   }
   return 0;
 }
 
-int Dir_Read(char* path, void* buffer, int size)
+// a batch call: the directory, then 'n' names, in the request's data
+static int serve_batch(rpc_request_t* q, char* data)
 {
-  dprintf("entered in Dir_Read fucntion\n"); 
-  /*int child_inode;
-  follow_path(path,&child_inode,NULL);
-
-  inode_t* directory = getInodeHelper(child_inode);*/
-
-
- int d_inode;
-	char fname[MAX_NAME];
-	follow_path(path, &d_inode, fname);
+  if(q->arg < 0 || q->arg > q->len) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  char** names = malloc((q->arg+1)*sizeof(char*));
+  if(!names) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // the data ends with a null, so a missing name reads as ""
+  char* end = data+q->len;
+  char* p = data+strlen(data)+1;
+  for(int i=0; i<q->arg; i++) {
+    names[i] = p < end ? p : end;
+    if(p < end) p += strlen(p)+1;
+  }
+  int ret = q->op == RPC_FILE_CREATE_BATCH ? File_CreateBatch(data, names, q->arg) :
+    File_UnlinkBatch(data, names, q->arg);
+  free(names);
+  return ret;
+}
 
-	//load child inode sector
-	int inode_sector = INODE_TABLE_START_SECTOR+d_inode/INODES_PER_SECTOR;
-	char inode_buffer[SECTOR_SIZE];
-	if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-	dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-	
-	
-	// get the child inode
-	int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-	int offset = d_inode-inode_start_entry;
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	inode_t* directory = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+// make a call for a client; the request's data ('len' bytes and a
+// null) is in 'data', and the reply's goes to 'out'
+static int serve_call(rpc_conn_t* c, rpc_request_t* q, char* data, char* out, int* outlen)
+{
+  char* path = q->len ? data : NULL;
+  int fd_ok = q->fd >= 0 && q->fd < max_open_files && c->fds[q->fd];
+  int dd_ok = q->fd >= 0 && q->fd < MAX_DIR_STREAMS && c->dds[q->fd];
+  int ret;
+  *outlen = 0;
+  switch(q->op) {
+  case RPC_SYNC: return FS_Sync();
+  case RPC_SNAPSHOT: return FS_Snapshot(path);
+  case RPC_SNAPSHOT_SAVE: return FS_SnapshotSave(data, data+strlen(data)+1);
+  case RPC_SNAPSHOT_DELETE: return FS_SnapshotDelete(path);
+  case RPC_FILE_CREATE: return File_Create(path);
+  case RPC_FILE_UNLINK: return File_Unlink(path);
+  case RPC_FILE_CREATE_BATCH:
+  case RPC_FILE_UNLINK_BATCH: return serve_batch(q, data);
+  case RPC_FILE_OPEN:
+    if((ret = File_Open(path)) >= 0) c->fds[ret] = 1;
+    return ret;
+  case RPC_FILE_READ:
+  case RPC_FILE_WRITE:
+    if(fd_ok) {
+      // the way File_Submit() makes its requests, at an offset or not
+      FS_Request_t r = { q->op == RPC_FILE_READ ? FS_READ : FS_WRITE, q->fd, q->offset };
+      r.buffer = q->op == RPC_FILE_READ ? out : data;
+      r.size = q->op == RPC_FILE_READ ? (q->arg < RPC_MAX_IO ? q->arg : RPC_MAX_IO) :
+	(q->arg < q->len ? q->arg : q->len);
+      ret = async_run(&r);
+      if(q->op == RPC_FILE_READ && ret > 0) *outlen = ret;
+      return ret;
+    }
+    break;
+  case RPC_FILE_RESERVE:
+    if(fd_ok) return File_Reserve(q->fd, q->arg);
+    break;
+  case RPC_FILE_SEEK:
+    if(fd_ok) return File_Seek(q->fd, q->arg);
+    break;
+  case RPC_FILE_CLOSE:
+    if(fd_ok) {
+      if((ret = File_Close(q->fd)) == 0) c->fds[q->fd] = 0;
+      return ret;
+    }
+    break;
+  case RPC_DIR_CREATE: return Dir_Create(path);
+  case RPC_DIR_UNLINK: return Dir_Unlink(path);
+  case RPC_DIR_SIZE: return Dir_Size(path);
+  case RPC_DIR_READ:
+    ret = Dir_Read(path, out, rpc_reply_room(q));
+    if(ret > 0) *outlen = ret*sizeof(dirent_t);
+    return ret;
+  case RPC_DIR_OPEN:
+    if((ret = Dir_Open(path)) >= 0) c->dds[ret] = 1;
+    return ret;
+  case RPC_DIR_NEXT:
+    if(dd_ok) {
+      ret = Dir_Next(q->fd, (FS_DirEntry_t*)out, rpc_reply_room(q)/sizeof(FS_DirEntry_t));
+      if(ret > 0) *outlen = ret*sizeof(FS_DirEntry_t);
+      return ret;
+    }
+    break;
+  case RPC_DIR_TELL:
+    if(dd_ok) return Dir_Tell(q->fd);
+    break;
+  case RPC_DIR_SEEK:
+    if(dd_ok) return Dir_Seek(q->fd, q->arg);
+    break;
+  case RPC_DIR_CLOSE:
+    if(dd_ok) {
+      if((ret = Dir_Close(q->fd)) == 0) c->dds[q->fd] = 0;
+      return ret;
+    }
+    break;
+  case RPC_CACHE_STATS:
+    FS_GetCacheStats((FS_CacheStats_t*)out);
+    *outlen = sizeof(FS_CacheStats_t);
+    return 0;
+  case RPC_ALLOC_STATS:
+    FS_GetAllocStats((FS_AllocStats_t*)out);
+    *outlen = sizeof(FS_AllocStats_t);
+    return 0;
+  case RPC_STATS:
+    FS_GetStats((FS_Stats_t*)out);
+    *outlen = sizeof(FS_Stats_t);
+    return 0;
+  case RPC_CHECK:
+    *outlen = sizeof(FS_CheckReport_t);
+    return FS_Check(q->arg, (FS_CheckReport_t*)out);
+  default:
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  osErrno = E_BAD_FD; // not opened by the client
+  return -1;
+}
 
+static void* serve_client(void* arg)
+{
+  rpc_conn_t* c = (rpc_conn_t*)arg;
+  rpc_request_t q;
+  while(rpc_read(c->socket, &q, sizeof(q)) == 0) {
+    if(q.len < 0 || q.len > RPC_MAX_DATA) break; // not a client
+    if(rpc_room(&c->in, &c->incap, q.len+1) < 0 || rpc_room(&c->out, &c->outcap, rpc_reply_room(&q)) < 0) break;
+    if(q.len > 0 && rpc_read(c->socket, c->in, q.len) < 0) break;
+    c->in[q.len] = '\0';
+    rpc_reply_t p;
+    p.result = serve_call(c, &q, c->in, c->out, &p.len);
+    p.error = p.result < 0 ? osErrno : 0;
+    if(rpc_write(c->socket, &p, sizeof(p)) < 0 || (p.len > 0 && rpc_write(c->socket, c->out, p.len) < 0))
+      break;
+  }
+  dprintf("... client %d disconnected\n", c->socket);
+  for(int fd=0; fd<max_open_files; fd++)
+    if(c->fds[fd]) File_Close(fd);
+  for(int dd=0; dd<MAX_DIR_STREAMS; dd++)
+    if(c->dds[dd]) Dir_Close(dd);
+  close(c->socket);
+  free(c->in);
+  free(c->out);
+  free(c->fds);
+  free(c);
+  return NULL;
+}
 
-  if(Dir_Size(path) > size){
-    osErrno = E_BUFFER_TOO_SMALL;
-    dprintf("here");
-	    return -1;
+int FS_Serve()
+{
+  struct sockaddr_un addr;
+  if(remote >= 0 || !open_files || rpc_address(bs_filename, &addr) < 0) {
+    dprintf("... no file system booted here to serve\n");
+    osErrno = E_GENERAL;
+    return -1;
   }
-  //dprintf("size ok\n");
-  char *buf =calloc(512,sizeof(char));//allocating buffer memory initially to zero
-  int i = 0;
-  int count = 0;
-  char *temp = calloc(512,sizeof(char));//allocating the buffer to zero later to 
-                                        // fill this memory with directory data[] content 
-  if(directory->data[0]){
-   dprintf("got something\n");
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // the socket may be left over by a server that's gone, not by one
+  // that's running
+  if(connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    dprintf("... '%s' is already served\n", bs_filename);
+    close(s);
+    osErrno = E_GENERAL;
+    return -1;
   }
-  while(directory->data[i]){
-    dprintf("entered in the while loop\n");
-    Disk_Read(directory->data[i], temp);
-    dprintf("%s\n", temp);// cannot find anything in the temp, so cannot proceed further
-    i++;
+  close(s);
+  unlink(addr.sun_path);
+  if((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+     bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, 64) < 0) {
+    dprintf("... can't listen on '%s'\n", addr.sun_path);
+    if(s >= 0) close(s);
+    osErrno = E_GENERAL;
+    return -1;
   }
+  server.stop = 0;
+  server.socket = s;
+  dprintf("... serving '%s' on '%s'\n", bs_filename, addr.sun_path);
 
-  return -1;
+  while(!server.stop) {
+    int cs = accept(s, NULL, NULL);
+    if(cs < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      break; // stopped (or broken)
+    }
+    rpc_conn_t* c = calloc(1, sizeof(rpc_conn_t));
+    pthread_t thread;
+    if(c) {
+      c->socket = cs;
+      c->fds = calloc(max_open_files, 1);
+    }
+    if(!c || !c->fds || pthread_create(&thread, NULL, serve_client, c)) {
+      close(cs);
+      if(c) free(c->fds);
+      free(c);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  server.socket = -1;
+  close(s);
+  unlink(addr.sun_path);
+  return FS_Sync();
 }
 
-
-		
+// (may be called from a signal handler)
+void FS_ServeStop()
+{
+  server.stop = 1;
+  if(server.socket >= 0) shutdown(server.socket, SHUT_RDWR);
+}
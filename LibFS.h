@@ -20,27 +20,179 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_QUEUE_FULL,
 } FS_Error_t;
     
 // used for errors
-extern int osErrno;
+extern __thread int osErrno; // per thread
 
 // a few file system parameters
 
 // the total number of files and directories in the file system has a
-// maximum limit of 1000
+// maximum limit of 1000 (unless the file system is formatted with
+// another one, see FS_Options_t)
 #define MAX_FILES 1000
 
-// each file can have a maximum of 30 sectors; we treat the data
-// blocks of the file/director the same as sectors
+// in the original (version 1) disk format, each file can have a
+// maximum of 30 sectors; we treat the data blocks of the
+// file/director the same as sectors
 #define MAX_SECTORS_PER_FILE 30
 
-// the size of a file or directory is limited
+// the size of a file or directory is limited (only in version 1; since
+// version 2, files are stored as extents and can be much larger); this
+// is with the default sector size, the limit follows the one the file
+// system is formatted with
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
+// buffer cache statistics, used to size the cache for a workload
+typedef struct {
+    int size;        // number of sectors the cache can hold
+    long hits;       // lookups satisfied from the cache
+    long misses;     // lookups that had to read (or zero) a sector
+    long evictions;  // sectors dropped to make room for others
+    long writebacks; // dirty sectors written back to the disk
+} FS_CacheStats_t;
+
+// heap usage of the file system (a debugging aid: in steady state,
+// none of the counters should grow)
+typedef struct {
+    long heap_allocs; // blocks taken from the heap
+    long heap_bytes;  // total size of those blocks
+    long pool_reuses; // allocations served by recycling a released block instead
+    long refills;     // batches of inodes or sectors claimed by a thread's allocation cache
+} FS_AllocStats_t;
+
+// what the file system has been doing since the program started, as
+// given by FS_GetStats(); apart from the buffer cache statistics, the
+// counters are only kept if the library is built with FSSTATS set to 1
+// (the default), and read as zeros otherwise
+
+// the calls counted, each on its own
+typedef enum {
+    FS_OP_FILE_CREATE,
+    FS_OP_FILE_OPEN,
+    FS_OP_FILE_READ,       // including the reads of File_Submit()
+    FS_OP_FILE_WRITE,      // including the writes of File_Submit()
+    FS_OP_FILE_SEEK,
+    FS_OP_FILE_RESERVE,
+    FS_OP_FILE_CLOSE,
+    FS_OP_FILE_UNLINK,
+    FS_OP_FILE_CREATE_BATCH,
+    FS_OP_FILE_UNLINK_BATCH,
+    FS_OP_DIR_CREATE,
+    FS_OP_DIR_UNLINK,
+    FS_OP_DIR_SIZE,
+    FS_OP_DIR_READ,
+    FS_OP_DIR_OPEN,
+    FS_OP_DIR_NEXT,
+    FS_OP_DIR_CLOSE,
+    FS_OP_SYNC,
+    FS_OPS                 // the number of them
+} FS_StatOp_t;
+
+// latency[0] counts the calls that took less than a microsecond, and
+// latency[i] the ones that took from 2^(i-1) up to 2^i microseconds
+// (the last bucket also has the ones that took longer)
+#define FS_LATENCY_BUCKETS 24
+
+typedef struct {
+    long calls;
+    long errors;     // calls that returned -1
+    long bytes;      // bytes read or written (File_Read(), File_Write())
+    long total_ns;   // time spent in the calls, in nanoseconds
+    long latency[FS_LATENCY_BUCKETS];
+} FS_OpStats_t;
+
+typedef struct {
+    FS_OpStats_t ops[FS_OPS]; // indexed by FS_StatOp_t
+    FS_CacheStats_t cache;    // the buffer cache, as from FS_GetCacheStats()
+    long inode_hits;          // inodes found in the inode cache
+    long inode_misses;        // ... and read from the inode table
+    long path_hits;           // paths resolved from the path cache
+    long path_misses;         // ... and by walking the directories
+    long alloc_scans;         // searches of the bitmaps for free inodes or sectors
+    long alloc_words;         // 64-bit words of the bitmaps those searches went through
+    long sector_reads;        // sectors read from the disk
+    long sector_writes;       // sectors written to it
+    long seeks;               // transfers not following the previous one on the disk
+    long seek_distance;       // the sectors those jumped over (in total)
+} FS_Stats_t;
+
+// boot options
+typedef struct {
+    int disk_mode;   // disk backend, one of Disk_Mode_t in LibDisk.h
+    int sync_data;   // if set, FS_Sync() waits until the data is on the device
+    int compress_files; // if set, the files created store their data compressed (only
+                        // in the disk format of version 4 and later)
+    int fs_version;  // disk format of a newly created file system (0 for the latest)
+    int max_open_files; // size of the open file table (0 for the default, 256)
+    // the geometry of a newly created file system (0 for the defaults,
+    // SECTOR_SIZE, TOTAL_SECTORS and MAX_FILES); an existing one keeps
+    // the geometry it was formatted with
+    int sector_size;    // a power of two, up to MAX_SECTOR_SIZE
+    int total_sectors;
+    int max_files;
+    int use_server;  // if set, and a server of the image is running (see FS_Serve()),
+                     // the calls are made by the server instead (the other
+                     // options are then the server's own)
+} FS_Options_t;
+
 // file system generic calls
+void FS_DefaultOptions(FS_Options_t *options);
 int FS_Boot(char *path);
+int FS_BootWithOptions(char *path, FS_Options_t *options);
 int FS_Sync();
+void FS_GetCacheStats(FS_CacheStats_t *stats);
+void FS_GetAllocStats(FS_AllocStats_t *stats);
+void FS_GetStats(FS_Stats_t *stats);
+
+// snapshots: FS_Snapshot() syncs the file system and keeps it as it
+// is then under the given name (a legal file name); a snapshot costs
+// nothing until the file system changes, and then a copy of each
+// sector the first time it's written; FS_SnapshotSave() writes the
+// image of a snapshot to a file (which can then be booted, say by
+// another program) while the file system goes on being used; the
+// snapshots last until deleted, or until the next boot
+int FS_Snapshot(char *name);
+int FS_SnapshotSave(char *name, char *file);
+int FS_SnapshotDelete(char *name);
+
+// the file system server: FS_Serve() makes the file system booted (not
+// through a server itself) available to other processes, through the
+// Unix socket named after the image ("<image>.sock"), until
+// FS_ServeStop() is called (from a signal handler, say); it then
+// syncs the file system and returns; a program booting the image
+// while it's served (with the default options) is connected to the
+// server, which then makes all its calls, the file descriptors and
+// directory streams it opens being its own and closed if it
+// disconnects; a connection handles one call at a time, but the
+// requests of File_Submit() are sent to the server all at once
+int FS_Serve();
+void FS_ServeStop();
+
+// the checker: FS_Check() syncs the file system, then walks the
+// directory tree from the root and cross-checks what it reaches with
+// the inode table and both bitmaps; with 'repair' set, it drops the
+// bad directory entries, fixes the directory sizes, frees the inodes
+// not reached and rewrites the bitmaps (sectors used by more than one
+// file are reported but left as they are); it returns 0 if the file
+// system was consistent, 1 if it wasn't, or -1 if it couldn't be
+// checked (or the root directory itself is bad, which can't be repaired)
+typedef struct {
+    int inodes;          // inodes reached from the root (itself included)
+    int directories;     // ... of which directories
+    int sectors;         // data sectors those use
+    int bad_dirents;     // entries with a bad or duplicate name, or naming an inode
+                         // out of range, bad, or already named by another entry
+    int bad_inodes;      // inodes marked in use whose content is bad
+    int lost_inodes;     // inodes marked in use but not reached
+    int bad_sizes;       // directories whose size isn't their number of entries
+    int shared_sectors;  // sectors used by more than one inode
+    int inode_bitmap_errors;  // bits of the inode bitmap that were wrong
+    int sector_bitmap_errors; // ... and of the sector bitmap
+} FS_CheckReport_t;
+
+int FS_Check(int repair, FS_CheckReport_t *report);
 
 // file ops
 int File_Create(char *file);
@@ -48,8 +200,48 @@ int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
 int File_Seek(int fd, int offset);
+// allocate the space for the first 'bytes' bytes of an open file ahead
+// of writing them (the file size stays the same); the space is kept
+// as sequential on the disk as possible
+int File_Reserve(int fd, int bytes);
 int File_Close(int fd);
 int File_Unlink(char *file);
+// create or unlink the files of the given names (not paths) in the
+// directory 'dir', resolving it once; return the number of files
+// created or unlinked, which is less than 'n' if the batch stopped at
+// a name that couldn't be (osErrno tells why), or -1 if none could be
+int File_CreateBatch(char *dir, char **names, int n);
+int File_UnlinkBatch(char *dir, char **names, int n);
+
+// asynchronous file ops: File_Submit() queues reads and writes that a
+// pool of worker threads carries out, and File_Reap() collects their
+// outcome; requests may complete in any order, even on the same fd
+typedef enum {
+    FS_READ,
+    FS_WRITE,
+} FS_Op_t;
+
+typedef struct {
+    int op;       // one of FS_Op_t
+    int fd;       // an open file
+    int offset;   // where to read or write; -1 for the fd's position (which then moves)
+    void* buffer;
+    int size;
+    void* user;   // handed back with the completion
+} FS_Request_t;
+
+typedef struct {
+    void* user;   // as in the request
+    int result;   // what File_Read() or File_Write() would return
+    int error;    // osErrno if the request failed
+} FS_Completion_t;
+
+// queue 'count' requests; return the number queued (fewer if the
+// queue fills up), or -1 if none could be
+int File_Submit(FS_Request_t *requests, int count);
+// collect up to 'max' completions, waiting until at least 'min' are
+// there (or no request is left to complete); return their number
+int File_Reap(FS_Completion_t *done, int max, int min);
 
 // directory ops
 int Dir_Create(char *path);
@@ -57,4 +249,23 @@ int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// directory streams: Dir_Open() resolves a directory once, and each
+// Dir_Next() returns up to 'n' of its entries from where the previous
+// one stopped, along with their type and size (0 at the end of the
+// directory, -1 if there's an error); Dir_Tell() gives the cursor of
+// a stream, which Dir_Seek() brings back, even on another stream of
+// the same directory, and which stays valid as entries come and go
+typedef struct {
+    char name[16]; // the entry's name
+    int inode;     // its inode
+    int type;      // 0 for a file, 1 for a directory
+    int size;      // the size of a file, or the number of entries of a directory
+} FS_DirEntry_t;
+
+int Dir_Open(char *path);
+int Dir_Next(int dd, FS_DirEntry_t *entries, int n);
+int Dir_Tell(int dd);
+int Dir_Seek(int dd, int cursor);
+int Dir_Close(int dd);
+
 #endif /* __LibFS_h__ */
@@ -0,0 +1,509 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+// the microbenchmarks of the file system, and the replay of traces of
+// calls; each benchmark formats a fresh file system on the disk image
+// (which is overwritten), and every measure is printed as one line of
+// JSON, with what FS_GetStats() counted meanwhile (the latencies are
+// the upper bounds of the histogram buckets, in microseconds)
+//
+// a trace has one call per line, with a slot number standing for a
+// file descriptor (blank lines and lines starting with '#' are
+// skipped):
+//
+//   create <path>          File_Create()
+//   unlink <path>          File_Unlink()
+//   mkdir <path>           Dir_Create()
+//   rmdir <path>           Dir_Unlink()
+//   open <slot> <path>     File_Open()
+//   read <slot> <size>     File_Read()
+//   write <slot> <size>    File_Write()
+//   seek <slot> <offset>   File_Seek()
+//   close <slot>           File_Close()
+//   sync                   FS_Sync()
+
+#define MAX_CHUNK 65536
+#define FILE_BYTES (8<<20) // the file of the read and write benchmarks
+#define MAX_THREADS 64
+#define MAX_SLOTS 256
+
+static char* disk;
+static FILE* out;
+static int max_threads = 8;
+static char chunk[MAX_CHUNK];
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-o results] [-t max_threads] disk [create|rw|depth|fanout|sync|threads ...]\n"
+	 "       %s [-o results] -r trace disk\n", prog, prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+// a small random number generator (xorshift), with a state per thread
+static unsigned next_rand(unsigned long long* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (unsigned)(*state >> 32);
+}
+
+// format a fresh file system on the disk image; without other
+// settings (see FS_DefaultOptions()), it's larger than the default one
+static void fresh_disk()
+{
+  FS_Options_t options;
+  FS_DefaultOptions(&options);
+  if(!options.total_sectors) options.total_sectors = 1<<17;
+  if(!options.max_files) options.max_files = 16384;
+  unlink(disk);
+  if(FS_BootWithOptions(disk, &options) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    exit(2);
+  }
+}
+
+static void fail(char* what, char* path)
+{
+  printf("ERROR: can't %s '%s' (error %d)\n", what, path, osErrno);
+  exit(3);
+}
+
+// the upper bound of the latency (in microseconds) under which the
+// fraction 'p' of the calls of an operation took
+static long percentile(FS_OpStats_t* s, double p)
+{
+  long seen = 0;
+  for(int b=0; b<FS_LATENCY_BUCKETS; b++) {
+    seen += s->latency[b];
+    if(seen > 0 && seen >= p*s->calls) return 1L << b;
+  }
+  return 0;
+}
+
+// print a measure: 'ops' calls moving 'bytes' bytes in 'secs'
+// seconds; 'op' is the operation whose latencies are given (-1 for
+// none), and 'before' what FS_GetStats() gave at the start
+static void result(char* test, char* param, long value, long ops, long bytes, double secs,
+		   int op, FS_Stats_t* before)
+{
+  FS_Stats_t s;
+  FS_GetStats(&s);
+  long lookups = (s.cache.hits-before->cache.hits)+(s.cache.misses-before->cache.misses);
+  fprintf(out, "{\"test\":\"%s\",\"%s\":%ld,\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f",
+	  test, param, value, ops, secs, secs > 0 ? ops/secs : 0);
+  if(bytes) fprintf(out, ",\"mb_per_sec\":%.2f", secs > 0 ? bytes/secs/(1<<20) : 0);
+  if(op >= 0) {
+    FS_OpStats_t d = s.ops[op];
+    d.calls -= before->ops[op].calls;
+    d.errors -= before->ops[op].errors;
+    for(int b=0; b<FS_LATENCY_BUCKETS; b++) d.latency[b] -= before->ops[op].latency[b];
+    fprintf(out, ",\"errors\":%ld,\"p50_us\":%ld,\"p99_us\":%ld",
+	    d.errors, percentile(&d, 0.5), percentile(&d, 0.99));
+  }
+  fprintf(out, ",\"cache_hit\":%.3f,\"sector_reads\":%ld,\"sector_writes\":%ld,\"seeks\":%ld}\n",
+	  lookups ? (double)((s.cache.hits-before->cache.hits))/lookups : 0,
+	  s.sector_reads-before->sector_reads, s.sector_writes-before->sector_writes,
+	  s.seeks-before->seeks);
+  fflush(out);
+}
+
+// create and unlink files in a directory, one at a time and in batches
+static void bench_create()
+{
+  int n = 5000;
+  char path[64];
+  char** names = malloc(n*sizeof(char*));
+  for(int i=0; i<n; i++) {
+    names[i] = malloc(16);
+    sprintf(names[i], "f%d", i);
+  }
+  fresh_disk();
+  if(Dir_Create("/c") < 0) fail("create directory", "/c");
+
+  FS_Stats_t before;
+  FS_GetStats(&before);
+  double t = now();
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/c/%s", names[i]);
+    if(File_Create(path) < 0) fail("create file", path);
+  }
+  result("create", "files", n, n, 0, now()-t, FS_OP_FILE_CREATE, &before);
+  FS_GetStats(&before);
+  t = now();
+  for(int i=0; i<n; i++) {
+    sprintf(path, "/c/%s", names[i]);
+    if(File_Unlink(path) < 0) fail("unlink file", path);
+  }
+  result("unlink", "files", n, n, 0, now()-t, FS_OP_FILE_UNLINK, &before);
+
+  FS_GetStats(&before);
+  t = now();
+  if(File_CreateBatch("/c", names, n) != n) fail("create the batch in", "/c");
+  result("create_batch", "files", n, n, 0, now()-t, FS_OP_FILE_CREATE_BATCH, &before);
+  FS_GetStats(&before);
+  t = now();
+  if(File_UnlinkBatch("/c", names, n) != n) fail("unlink the batch in", "/c");
+  result("unlink_batch", "files", n, n, 0, now()-t, FS_OP_FILE_UNLINK_BATCH, &before);
+
+  for(int i=0; i<n; i++) free(names[i]);
+  free(names);
+}
+
+// sequential and random reads and writes of a file, in chunks of
+// several sizes
+static void bench_rw()
+{
+  int sizes[] = { 512, 4096, 65536 };
+  for(int k=0; k<(int)(sizeof(sizes)/sizeof(int)); k++) {
+    int size = sizes[k], n = FILE_BYTES/size;
+    fresh_disk();
+    if(File_Create("/f") < 0) fail("create file", "/f");
+    int fd = File_Open("/f");
+    if(fd < 0) fail("open file", "/f");
+
+    FS_Stats_t before;
+    FS_GetStats(&before);
+    double t = now();
+    for(int i=0; i<n; i++)
+      if(File_Write(fd, chunk, size) != size) fail("write file", "/f");
+    result("seq_write", "chunk", size, n, (long)n*size, now()-t, FS_OP_FILE_WRITE, &before);
+
+    File_Seek(fd, 0);
+    FS_GetStats(&before);
+    t = now();
+    for(int i=0; i<n; i++)
+      if(File_Read(fd, chunk, size) != size) fail("read file", "/f");
+    result("seq_read", "chunk", size, n, (long)n*size, now()-t, FS_OP_FILE_READ, &before);
+
+    // the random offsets are aligned on the chunks
+    unsigned long long rng = 88172645463325252ULL;
+    FS_GetStats(&before);
+    t = now();
+    for(int i=0; i<n; i++) {
+      File_Seek(fd, (next_rand(&rng)%n)*size);
+      if(File_Read(fd, chunk, size) != size) fail("read file", "/f");
+    }
+    result("rand_read", "chunk", size, n, (long)n*size, now()-t, FS_OP_FILE_READ, &before);
+
+    FS_GetStats(&before);
+    t = now();
+    for(int i=0; i<n; i++) {
+      File_Seek(fd, (next_rand(&rng)%n)*size);
+      if(File_Write(fd, chunk, size) != size) fail("write file", "/f");
+    }
+    result("rand_write", "chunk", size, n, (long)n*size, now()-t, FS_OP_FILE_WRITE, &before);
+    File_Close(fd);
+  }
+}
+
+// open a file at the bottom of directories of several depths; the
+// path cache answers most of the lookups, so paths to many files are
+// opened in turn, to see the walk as well
+static void bench_depth()
+{
+  int depths[] = { 1, 2, 4, 8, 16 };
+  int files = 1000, n = 20000;
+  char path[256];
+  fresh_disk();
+  for(int k=0; k<(int)(sizeof(depths)/sizeof(int)); k++) {
+    int len = sprintf(path, "/%d", depths[k]);
+    if(Dir_Create(path) < 0) fail("create directory", path);
+    for(int d=1; d<depths[k]; d++) {
+      len += sprintf(path+len, "/d");
+      if(Dir_Create(path) < 0) fail("create directory", path);
+    }
+    for(int i=0; i<files; i++) {
+      sprintf(path+len, "/f%d", i);
+      if(File_Create(path) < 0) fail("create file", path);
+    }
+
+    FS_Stats_t before;
+    FS_GetStats(&before);
+    double t = now();
+    for(int i=0; i<n; i++) {
+      sprintf(path+len, "/f%d", i%files);
+      int fd = File_Open(path);
+      if(fd < 0) fail("open file", path);
+      File_Close(fd);
+    }
+    result("path_depth", "depth", depths[k], n, 0, now()-t, FS_OP_FILE_OPEN, &before);
+  }
+}
+
+// look up files at random in directories of several sizes
+static void bench_fanout()
+{
+  int fanouts[] = { 10, 100, 1000, 10000 };
+  int n = 20000;
+  char path[64];
+  fresh_disk();
+  for(int k=0; k<(int)(sizeof(fanouts)/sizeof(int)); k++) {
+    sprintf(path, "/%d", fanouts[k]);
+    if(Dir_Create(path) < 0) fail("create directory", path);
+    for(int i=0; i<fanouts[k]; i++) {
+      sprintf(path, "/%d/f%d", fanouts[k], i);
+      if(File_Create(path) < 0) fail("create file", path);
+    }
+
+    unsigned long long rng = 88172645463325252ULL;
+    FS_Stats_t before;
+    FS_GetStats(&before);
+    double t = now();
+    for(int i=0; i<n; i++) {
+      sprintf(path, "/%d/f%d", fanouts[k], next_rand(&rng)%fanouts[k]);
+      int fd = File_Open(path);
+      if(fd < 0) fail("open file", path);
+      File_Close(fd);
+    }
+    result("dir_fanout", "entries", fanouts[k], n, 0, now()-t, FS_OP_FILE_OPEN, &before);
+  }
+}
+
+// sync after writing to more and more files
+static void bench_sync()
+{
+  int counts[] = { 1, 10, 100, 1000 };
+  char path[64];
+  fresh_disk();
+  for(int k=0; k<(int)(sizeof(counts)/sizeof(int)); k++) {
+    for(int i=0; i<counts[k]; i++) {
+      sprintf(path, "/s%d", i);
+      if(k == 0 || i >= counts[k-1])
+	if(File_Create(path) < 0) fail("create file", path);
+      int fd = File_Open(path);
+      if(fd < 0) fail("open file", path);
+      if(File_Write(fd, chunk, 1024) != 1024) fail("write file", path);
+      File_Close(fd);
+    }
+    FS_Stats_t before;
+    FS_GetStats(&before);
+    double t = now();
+    if(FS_Sync() < 0) fail("sync disk", disk);
+    result("sync", "dirty_files", counts[k], 1, 0, now()-t, FS_OP_SYNC, &before);
+  }
+}
+
+typedef struct {
+  int id;
+  int n;
+} worker_t;
+
+// random reads of 4K from a file of the thread's own
+static void* read_worker(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  char path[64], buf[4096];
+  sprintf(path, "/r%d", w->id);
+  int fd = File_Open(path);
+  if(fd < 0) fail("open file", path);
+  unsigned long long rng = 88172645463325252ULL+w->id;
+  int blocks = (1<<20)/sizeof(buf);
+  for(int i=0; i<w->n; i++) {
+    File_Seek(fd, (next_rand(&rng)%blocks)*sizeof(buf));
+    if(File_Read(fd, buf, sizeof(buf)) != sizeof(buf)) fail("read file", path);
+  }
+  File_Close(fd);
+  return NULL;
+}
+
+// files created in a directory of the thread's own
+static void* create_worker(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  char path[64];
+  for(int i=0; i<w->n; i++) {
+    sprintf(path, "/t%d/f%d", w->id, i);
+    if(File_Create(path) < 0) fail("create file", path);
+  }
+  return NULL;
+}
+
+static double run_workers(int nthreads, int n, void* (*fn)(void*))
+{
+  pthread_t threads[MAX_THREADS];
+  worker_t workers[MAX_THREADS];
+  double t = now();
+  for(int i=0; i<nthreads; i++) {
+    workers[i].id = i;
+    workers[i].n = n;
+    pthread_create(&threads[i], NULL, fn, &workers[i]);
+  }
+  for(int i=0; i<nthreads; i++) pthread_join(threads[i], NULL);
+  return now()-t;
+}
+
+// how reads and creates scale with the threads
+static void bench_threads()
+{
+  int n = 20000, files = 500;
+  char path[64];
+  for(int nthreads=1; nthreads<=max_threads; nthreads*=2) {
+    fresh_disk();
+    for(int i=0; i<nthreads; i++) {
+      sprintf(path, "/r%d", i);
+      if(File_Create(path) < 0) fail("create file", path);
+      int fd = File_Open(path);
+      if(fd < 0) fail("open file", path);
+      for(int b=0; b<(1<<20)/MAX_CHUNK; b++)
+	if(File_Write(fd, chunk, MAX_CHUNK) != MAX_CHUNK) fail("write file", path);
+      File_Close(fd);
+      sprintf(path, "/t%d", i);
+      if(Dir_Create(path) < 0) fail("create directory", path);
+    }
+
+    FS_Stats_t before;
+    FS_GetStats(&before);
+    double t = run_workers(nthreads, n, read_worker);
+    result("threads_read", "threads", nthreads, (long)nthreads*n, (long)nthreads*n*4096, t,
+	   FS_OP_FILE_READ, &before);
+    FS_GetStats(&before);
+    t = run_workers(nthreads, files, create_worker);
+    result("threads_create", "threads", nthreads, (long)nthreads*files, 0, t,
+	   FS_OP_FILE_CREATE, &before);
+  }
+}
+
+// replay a trace on the file system of the disk image (as it is), and
+// give the figures of each operation used, then of the whole trace
+static void replay(char* trace)
+{
+  static const struct {
+    char* name;
+    int op;
+  } ops[] = {
+    { "create", FS_OP_FILE_CREATE }, { "unlink", FS_OP_FILE_UNLINK },
+    { "mkdir", FS_OP_DIR_CREATE }, { "rmdir", FS_OP_DIR_UNLINK },
+    { "open", FS_OP_FILE_OPEN }, { "read", FS_OP_FILE_READ },
+    { "write", FS_OP_FILE_WRITE }, { "seek", FS_OP_FILE_SEEK },
+    { "close", FS_OP_FILE_CLOSE }, { "sync", FS_OP_SYNC },
+  };
+  int nops = sizeof(ops)/sizeof(ops[0]);
+  FILE* f = fopen(trace, "r");
+  if(!f) {
+    printf("ERROR: can't open trace '%s'\n", trace);
+    exit(2);
+  }
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    exit(2);
+  }
+
+  int slots[MAX_SLOTS];
+  for(int i=0; i<MAX_SLOTS; i++) slots[i] = -1;
+  char* buf = malloc(1<<20);
+  memset(buf, 'x', 1<<20);
+  char line[512], cmd[16], path[256];
+  long count = 0, bytes = 0, lineno = 0;
+  FS_Stats_t before;
+  FS_GetStats(&before);
+  double t = now();
+  while(fgets(line, sizeof(line), f)) {
+    lineno++;
+    if(sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#') continue;
+    int slot = 0, arg = 0, ok = 1;
+    if(!strcmp(cmd, "create")) ok = sscanf(line, "%*s %255s", path) == 1 && File_Create(path) >= 0;
+    else if(!strcmp(cmd, "unlink")) ok = sscanf(line, "%*s %255s", path) == 1 && File_Unlink(path) >= 0;
+    else if(!strcmp(cmd, "mkdir")) ok = sscanf(line, "%*s %255s", path) == 1 && Dir_Create(path) >= 0;
+    else if(!strcmp(cmd, "rmdir")) ok = sscanf(line, "%*s %255s", path) == 1 && Dir_Unlink(path) >= 0;
+    else if(!strcmp(cmd, "sync")) ok = FS_Sync() >= 0;
+    else if(!strcmp(cmd, "open")) {
+      ok = sscanf(line, "%*s %d %255s", &slot, path) == 2 && slot >= 0 && slot < MAX_SLOTS &&
+	(slots[slot] = File_Open(path)) >= 0;
+    } else if(sscanf(line, "%*s %d %d", &slot, &arg) >= 1 && slot >= 0 && slot < MAX_SLOTS) {
+      int fd = slots[slot];
+      if(arg < 0 || arg > (1<<20)) arg = 1<<20;
+      if(!strcmp(cmd, "read")) ok = (arg = File_Read(fd, buf, arg)) >= 0;
+      else if(!strcmp(cmd, "write")) ok = (arg = File_Write(fd, buf, arg)) >= 0;
+      else if(!strcmp(cmd, "seek")) ok = File_Seek(fd, arg) >= 0;
+      else if(!strcmp(cmd, "close")) ok = File_Close(fd) >= 0;
+      else {
+	printf("ERROR: unknown call '%s' at line %ld of '%s'\n", cmd, lineno, trace);
+	exit(2);
+      }
+      if(ok && (!strcmp(cmd, "read") || !strcmp(cmd, "write"))) bytes += arg;
+    } else {
+      printf("ERROR: bad call '%s' at line %ld of '%s'\n", cmd, lineno, trace);
+      exit(2);
+    }
+    count++; // the calls that failed are counted by FS_GetStats()
+  }
+  double secs = now()-t;
+  fclose(f);
+  free(buf);
+
+  FS_Stats_t s;
+  FS_GetStats(&s);
+  for(int i=0; i<nops; i++) {
+    FS_OpStats_t d = s.ops[ops[i].op];
+    d.calls -= before.ops[ops[i].op].calls;
+    if(!d.calls) continue;
+    d.errors -= before.ops[ops[i].op].errors;
+    d.total_ns -= before.ops[ops[i].op].total_ns;
+    for(int b=0; b<FS_LATENCY_BUCKETS; b++) d.latency[b] -= before.ops[ops[i].op].latency[b];
+    fprintf(out, "{\"test\":\"replay\",\"op\":\"%s\",\"ops\":%ld,\"errors\":%ld,\"seconds\":%.6f,"
+	    "\"p50_us\":%ld,\"p99_us\":%ld}\n", ops[i].name, d.calls, d.errors, d.total_ns*1e-9,
+	    percentile(&d, 0.5), percentile(&d, 0.99));
+  }
+  result("replay", "lines", lineno, count, bytes, secs, -1, &before);
+}
+
+int main(int argc, char *argv[])
+{
+  char* trace = NULL;
+  int opt;
+  out = stdout;
+  while((opt = getopt(argc, argv, "o:t:r:")) != -1) {
+    if(opt == 'o') {
+      if(!(out = fopen(optarg, "w"))) {
+	printf("ERROR: can't open file '%s' for the results\n", optarg);
+	return -1;
+      }
+    } else if(opt == 't') {
+      max_threads = atoi(optarg);
+      if(max_threads < 1 || max_threads > MAX_THREADS) usage(argv[0]);
+    } else if(opt == 'r') trace = optarg;
+    else usage(argv[0]);
+  }
+  if(optind >= argc) usage(argv[0]);
+  disk = argv[optind++];
+  memset(chunk, 'x', sizeof(chunk));
+
+  if(trace) {
+    if(optind < argc) usage(argv[0]);
+    replay(trace);
+    return 0;
+  }
+
+  static const struct {
+    char* name;
+    void (*run)();
+  } benches[] = {
+    { "create", bench_create }, { "rw", bench_rw }, { "depth", bench_depth },
+    { "fanout", bench_fanout }, { "sync", bench_sync }, { "threads", bench_threads },
+  };
+  int nbenches = sizeof(benches)/sizeof(benches[0]);
+  for(int i=optind; i<argc; i++) {
+    int k = 0;
+    while(k < nbenches && strcmp(argv[i], benches[k].name)) k++;
+    if(k == nbenches) usage(argv[0]);
+  }
+  for(int k=0; k<nbenches; k++) {
+    int wanted = (optind == argc);
+    for(int i=optind; i<argc; i++) wanted |= !strcmp(argv[i], benches[k].name);
+    if(wanted) benches[k].run();
+  }
+  return 0;
+}
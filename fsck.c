@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// check the file system on a disk (see FS_Check()), repairing it with
+// -r; the exit status is 0 if the file system was consistent, 1 if it
+// wasn't (repaired or not), and negative if it couldn't be checked
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int repair = 0, arg = 1;
+  if(arg < argc && !strcmp(argv[arg], "-r")) { repair = 1; arg++; }
+  if(argc-arg > 1) usage(argv[0]);
+  char *diskfile = (arg < argc) ? argv[arg] : "default-disk";
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  FS_CheckReport_t r;
+  int ret = FS_Check(repair, &r);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if(ret < 0) {
+    printf("ERROR: can't check file system on disk '%s'%s\n", diskfile,
+	   r.bad_inodes ? " (bad root directory)" : "");
+    return -2;
+  }
+
+  printf("%d inodes (%d directories), %d sectors, checked in %.3f s\n",
+	 r.inodes, r.directories, r.sectors,
+	 (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)*1e-9);
+  if(ret == 0) {
+    printf("file system on disk '%s' is consistent\n", diskfile);
+    return 0;
+  }
+  printf("bad directory entries:   %d\n", r.bad_dirents);
+  printf("bad inodes:              %d\n", r.bad_inodes);
+  printf("lost inodes:             %d\n", r.lost_inodes);
+  printf("bad directory sizes:     %d\n", r.bad_sizes);
+  printf("shared sectors:          %d%s\n", r.shared_sectors,
+	 repair && r.shared_sectors ? " (not repaired)" : "");
+  printf("inode bitmap errors:     %d\n", r.inode_bitmap_errors);
+  printf("sector bitmap errors:    %d\n", r.sector_bitmap_errors);
+  printf("file system on disk '%s' %s\n", diskfile, repair ? "repaired" : "is not consistent (repair with -r)");
+  return 1;
+}
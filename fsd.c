@@ -0,0 +1,48 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// the file system server: boots the disk once and serves it (see
+// FS_Serve()) until interrupted, so that the other programs using the
+// disk meanwhile don't boot and sync it themselves
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+static void stop(int sig)
+{
+  FS_ServeStop();
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc > 2) usage(argv[0]);
+  char *diskfile = (argc == 2) ? argv[1] : "default-disk";
+
+  // the server boots the disk itself, even if another one serves it
+  // (FS_Serve() then fails)
+  FS_Options_t options;
+  FS_DefaultOptions(&options);
+  options.use_server = 0;
+  if(FS_BootWithOptions(diskfile, &options) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if(FS_Serve() < 0) {
+    printf("ERROR: can't serve file system from file '%s'\n", diskfile);
+    return -2;
+  }
+  return 0;
+}
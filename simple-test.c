@@ -9,6 +9,71 @@ void usage(char *prog)
   exit(1);
 }
 
+// read (or write, if 'write' is set) 'size' bytes of an image file
+// from 'offset' on
+int image_io(char *file, long offset, void *buf, int size, int write)
+{
+  FILE* f = fopen(file, "r+b");
+  if(!f) return -1;
+  int ret = fseek(f, offset, SEEK_SET) ||
+    (write ? fwrite(buf, size, 1, f) : fread(buf, size, 1, f)) != 1;
+  return fclose(f) || ret ? -1 : 0;
+}
+
+// damage a scratch file system next to the image 'disk', and have
+// FS_Check() repair it; the file system has 1000 inodes and 10003
+// sectors of 512 bytes, so that the last byte of its sector bitmap
+// has bits left over (which don't count); it then has the inode
+// bitmap in sector 1, the sector bitmap in sectors 2 to 4, and the
+// inode table (with 128-byte inodes) from sector 5 on
+int check_repair(char *disk)
+{
+  char file[1024];
+  snprintf(file, sizeof(file), "%s-check", disk);
+  remove(file);
+  FS_Options_t options;
+  FS_DefaultOptions(&options);
+  options.sector_size = 512;
+  options.total_sectors = 10003;
+  options.max_files = 1000;
+  if(FS_BootWithOptions(file, &options) < 0 || File_Create("/dup-1") < 0 ||
+     File_Create("/dup-2") < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't make file system in file '%s'\n", file);
+    return -1;
+  }
+
+  // the second entry of the root directory (inode 0, whose first
+  // extent starts at its fifth integer) takes the name of the first;
+  // inode 999 is marked in use, and so are sector 10002 and the bit
+  // after it, past the end
+  int root[5];
+  char name[16] = "dup-1";
+  unsigned char bit = 0x01;
+  unsigned char bits = 0x20|0x10;
+  if(image_io(file, 5*512, root, sizeof(root), 0) < 0 ||
+     image_io(file, root[4]*512L+20, name, sizeof(name), 1) < 0 ||
+     image_io(file, 512+999/8, &bit, 1, 1) < 0 ||
+     image_io(file, 2*512+10002/8, &bits, 1, 1) < 0) {
+    printf("ERROR: can't damage file system in file '%s'\n", file);
+    return -1;
+  }
+
+  FS_CheckReport_t report;
+  if(FS_Boot(file) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", file);
+    return -1;
+  } else if(FS_Check(0, &report) != 1 || report.bad_dirents != 1 ||
+	    report.lost_inodes != 2 || report.sector_bitmap_errors != 1)
+    printf("ERROR: damage to file '%s' not found\n", file);
+  else if(FS_Check(1, &report) != 1 || FS_Check(0, &report) != 0)
+    printf("ERROR: can't repair file system in file '%s'\n", file);
+  else if(Dir_Size("/") != 20)
+    printf("ERROR: repair left %d bytes of entries in the root directory\n", Dir_Size("/"));
+  else printf("file system in file '%s' repaired successfully\n", file);
+  remove(file);
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   if (argc != 2) usage(argv[0]);
@@ -73,11 +138,48 @@ int main(int argc, char *argv[])
   
   if(File_Close(fd) < 0) printf("ERROR: can't close fd %d\n", fd);
   else printf("fd %d closed successfully\n", fd);
+
+  // a batch of one name must not create a file that's there already
+  char* names[] = { "second-file" };
+  if(File_CreateBatch("/", names, 1) >= 0 || osErrno != E_CREATE)
+    printf("ERROR: batch created existing file '/%s' again\n", names[0]);
+  else printf("batch refused existing file '/%s' successfully\n", names[0]);
+
+  // nor unlink a directory, which File_Unlink() refuses as no such file
+  fn = "/third-dir";
+  names[0] = "third-dir";
+  if(Dir_Create(fn) < 0) printf("ERROR: can't create dir '%s'\n", fn);
+  else if(File_Unlink(fn) >= 0 || osErrno != E_NO_SUCH_FILE)
+    printf("ERROR: unlinked dir '%s' as a file\n", fn);
+  else if(File_UnlinkBatch("/", names, 1) >= 0 || osErrno != E_NO_SUCH_FILE)
+    printf("ERROR: batch unlinked dir '%s' as a file\n", fn);
+  else if(Dir_Unlink(fn) < 0) printf("ERROR: can't unlink dir '%s'\n", fn);
+  else printf("dir '%s' refused as a file and unlinked successfully\n", fn);
   
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
     return -1;
   } else printf("file system sync'd to file '%s'\n", argv[1]);
-    
+
+  // a namespace change is in the image file once the call returns: if
+  // the file system isn't synced (as in a crash), booting it again
+  // replays the change from the journal
+  fn = "/journal-dir";
+  FS_CheckReport_t report;
+  int dd;
+  if(Dir_Create(fn) < 0) printf("ERROR: can't create dir '%s'\n", fn);
+  else if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s' again\n", argv[1]);
+    return -1;
+  } else if((dd = Dir_Open(fn)) < 0 || Dir_Close(dd) < 0)
+    printf("ERROR: dir '%s' lost in a crash\n", fn);
+  else if(FS_Check(0, &report) != 0)
+    printf("ERROR: file system not consistent after a crash\n");
+  else if(Dir_Unlink(fn) < 0 || FS_Sync() < 0)
+    printf("ERROR: can't unlink dir '%s'\n", fn);
+  else printf("dir '%s' recovered from the journal successfully\n", fn);
+
+  if(check_repair(argv[1]) < 0) return -1;
+
   return 0;
 }
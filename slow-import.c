@@ -40,6 +40,15 @@ int main(int argc, char *argv[])
     return -3;
   }
 
+  // reserve the space up front, so that the file is laid out
+  // sequentially; if it can't be reserved, the writes below will
+  // report how much didn't fit
+  if(fseek(fptr, 0, SEEK_END) == 0) {
+    long fsize = ftell(fptr);
+    if(fsize > 0) File_Reserve(fd, (int)fsize);
+    rewind(fptr);
+  }
+
   char buf[BFSZ]; 
   while(!feof(fptr)) {
     int rsz = fread(buf, 1, BFSZ, fptr);
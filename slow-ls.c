@@ -20,30 +20,28 @@ int main(int argc, char *argv[])
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
-  int sz = Dir_Size(path);
-  printf("the directory size is %d\n",sz);
-  if(sz < 0) {
+  // the entries are listed a batch at a time
+  int dd = Dir_Open(path);
+  if(dd < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -2;
-  } else if (sz == 0) {
-    printf("directory '%s': empty\n", path);
-    return 0;
   }
-  
-  char* buf = malloc(sz);
-  int entries = Dir_Read(path, buf, sz);
+  FS_DirEntry_t batch[32];
+  int total = 0, entries;
+  while((entries = Dir_Next(dd, batch, 32)) > 0) {
+    if(total == 0)
+      printf("directory '%s':\n     %-15s\t%-5s\t%-4s\t%-s\n", path, "NAME", "INODE", "TYPE", "SIZE");
+    for(int i=0; i<entries; i++)
+      printf("%-4d %-15s\t%-5d\t%-4s\t%-d\n", total+i, batch[i].name, batch[i].inode,
+	     batch[i].type == 1 ? "dir" : "file", batch[i].size);
+    total += entries;
+  }
+  Dir_Close(dd);
   if(entries < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -3;
-  }
-  
-  printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
-  int idx = 0;
-  for(int i=0; i<entries; i++) {
-    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
-    idx += 20;
-  }
-  free(buf);
+  } else if(total == 0)
+    printf("directory '%s': empty\n", path);
 
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);